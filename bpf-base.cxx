@@ -445,6 +445,9 @@ bpf_function_nargs (unsigned id)
     case BPF_FUNC_get_current_comm:	return 2;
     case BPF_FUNC_perf_event_read:	return 2;
     case BPF_FUNC_perf_event_output:	return 5;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+    case BPF_FUNC_ringbuf_output:	return 4;
+#endif
     default:				return 5;
     }
 }
@@ -500,6 +503,9 @@ opcode_name(opcode op)
     case BPF_STX | BPF_MEM | BPF_W:	opn = "stxw"; break;
     case BPF_STX | BPF_MEM | BPF_DW:	opn = "stx"; break;
 
+    case BPF_STX | BPF_XADD | BPF_W:	opn = "xaddw"; break;
+    case BPF_STX | BPF_XADD | BPF_DW:	opn = "xadd"; break;
+
     case BPF_ST | BPF_MEM | BPF_B:	opn = "stkb"; break;
     case BPF_ST | BPF_MEM | BPF_H:	opn = "stkh"; break;
     case BPF_ST | BPF_MEM | BPF_W:	opn = "stkw"; break;
@@ -587,6 +593,8 @@ insn::print(std::ostream &o) const
     case BPF_STX | BPF_MEM | BPF_H:
     case BPF_STX | BPF_MEM | BPF_W:
     case BPF_STX | BPF_MEM | BPF_DW:
+    case BPF_STX | BPF_XADD | BPF_W:
+    case BPF_STX | BPF_XADD | BPF_DW:
     case BPF_ST | BPF_MEM | BPF_B:
     case BPF_ST | BPF_MEM | BPF_H:
     case BPF_ST | BPF_MEM | BPF_W:
@@ -892,6 +900,17 @@ program::mk_st(insn_inserter &ins, int sz, value *base, int off, value *src)
   i->src1 = src;
 }
 
+void
+program::mk_xadd(insn_inserter &ins, int sz, value *base, int off, value *src)
+{
+  assert(src->is_reg());
+  insn *i = ins.new_insn();
+  i->code = BPF_STX | BPF_XADD | sz;
+  i->off = off;
+  i->src0 = base;
+  i->src1 = src;
+}
+
 void
 program::mk_binary(insn_inserter &ins, opcode op, value *dest,
 		   value *s0, value *s1)
@@ -81,6 +81,10 @@ enum bpf_target {
 #define BPF_TRANSPORT_VAL uint64_t
 #define BPF_TRANSPORT_ARG uint64_t
 // XXX: BPF_TRANSPORT_ARG is for small numerical arguments, not pe_long values.
+// With the ringbuf transport all CPUs share one buffer, so the upper
+// half of the BPF_TRANSPORT_VAL also carries the sending CPU:
+#define BPF_TRANSPORT_TYPE(val) ((uint32_t)(val))
+#define BPF_TRANSPORT_CPU(val) ((uint32_t)((uint64_t)(val) >> 32))
 
 // DEPRECATED constants for foreach sorting.
 // Kept in the unlikely case we want to use new stapbpf to load old .bo's.
@@ -399,6 +403,7 @@ struct program
 
   void mk_ld(insn_inserter &ins, int sz, value *dest, value *base, int off);
   void mk_st(insn_inserter &ins, int sz, value *base, int off, value *src);
+  void mk_xadd(insn_inserter &ins, int sz, value *base, int off, value *src);
   void mk_unary(insn_inserter &ins, opcode op, value *dest, value *src);
   void mk_binary(insn_inserter &ins, opcode op, value *d,
 		 value *s0, value *s1);
@@ -549,18 +554,24 @@ struct globals
   {
     EXIT = 0,
     ERRORS, // Tracks the total number of errors.
+    TRANSPORT_DROPS, // Messages that did not fit in the ringbuf.
     NUM_INTERNALS, // non-ABI
   };
 
   // PR22330: Index into globals. This element represents the
   // perf_event_map used to send messages from kernel-side bpf
-  // programs to stapbpf.
+  // programs to stapbpf.  On kernels with BPF_MAP_TYPE_RINGBUF, it
+  // is a single ringbuf shared by all CPUs instead.
   static const map_idx perf_event_map_idx = 1;
 
-  // XXX: The number of elements for the perf_event_map is not known
-  // at translation time and must be determined by the stapbpf loader:
+  // XXX: The number of elements for the perf_event_map (or the size
+  // of the ringbuf) is not known at translation time and must be
+  // determined by the stapbpf loader:
   static const int NUM_CPUS_PLACEHOLDER = 0;
 
+  // Whether perf_event_map_idx is a ringbuf:
+  bool use_ringbuf;
+
   // Types of transport messages supported:
   enum perf_event_type
   {
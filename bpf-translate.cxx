@@ -262,6 +262,9 @@ struct bpf_unparser : public throwing_visitor
 
   void emit_transport_msg(globals::perf_event_type msg,
                           value *arg = NULL, exp_type format_type = pe_unknown);
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  void emit_ringbuf_msg(globals::perf_event_type msg, int msg_ofs);
+#endif
   value *emit_functioncall(functiondecl *f, const std::vector<value *> &args);
   value *emit_print_format(const std::string &format,
                            const std::vector<value *> &actual,
@@ -3858,6 +3861,14 @@ bpf_unparser::emit_transport_msg (globals::perf_event_type msg,
         assert(false); // XXX: Should be caught earlier.
       }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (glob.use_ringbuf)
+    {
+      emit_ringbuf_msg(msg, msg_ofs);
+      return;
+    }
+#endif
+
   // double word -- XXX verifier forces aligned access
   this_prog.mk_st(this_ins, BPF_DW, frame, msg_ofs, this_prog.new_imm(msg));
 
@@ -3874,6 +3885,63 @@ bpf_unparser::emit_transport_msg (globals::perf_event_type msg,
   this_prog.mk_call(this_ins, BPF_FUNC_perf_event_output, 5);
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+// Sends the transport message already laid out at frame+msg_ofs (apart
+// from its type word) through the ringbuf.  Since all CPUs share the
+// ringbuf, the type word is tagged with the sending CPU so stapbpf can
+// hand each message to the right bpf_transport_context.  A message that
+// does not fit is counted in the TRANSPORT_DROPS internal global.
+void
+bpf_unparser::emit_ringbuf_msg (globals::perf_event_type msg, int msg_ofs)
+{
+  value *frame = this_prog.lookup_reg(BPF_REG_10);
+  value *r0 = this_prog.lookup_reg(BPF_REG_0);
+  value *i0 = this_prog.new_imm(0);
+
+  this_prog.mk_call(this_ins, BPF_FUNC_get_smp_processor_id, 0);
+  value *type = this_prog.new_reg();
+  this_prog.mk_binary(this_ins, BPF_LSH, type, r0, this_prog.new_imm(32));
+  this_prog.mk_binary(this_ins, BPF_OR, type, type, this_prog.new_imm(msg));
+  // double word -- XXX verifier forces aligned access
+  this_prog.mk_st(this_ins, BPF_DW, frame, msg_ofs, type);
+
+  this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_1),
+                     globals::perf_event_map_idx);
+  this_prog.mk_binary(this_ins, BPF_ADD,
+                      this_prog.lookup_reg(BPF_REG_2),
+                      frame, this_prog.new_imm(msg_ofs));
+  emit_mov(this_prog.lookup_reg(BPF_REG_3), this_prog.new_imm(-msg_ofs));
+  emit_mov(this_prog.lookup_reg(BPF_REG_4), i0); // flags
+  this_prog.mk_call(this_ins, BPF_FUNC_ringbuf_output, 4);
+
+  block *drop_block = this_prog.new_block();
+  block *incr_block = this_prog.new_block();
+  block *join_block = this_prog.new_block();
+  this_prog.mk_jcond(this_ins, EQ, r0, i0, join_block, drop_block);
+
+  // Lookup the drop count.  The message is no longer needed, so its
+  // stack slot can hold the key.
+  set_block(drop_block);
+  this_prog.mk_st(this_ins, BPF_W, frame, msg_ofs,
+                  this_prog.new_imm(globals::TRANSPORT_DROPS));
+  this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_1),
+                     globals::internal_map_idx);
+  this_prog.mk_binary(this_ins, BPF_ADD, this_prog.lookup_reg(BPF_REG_2),
+                      frame, this_prog.new_imm(msg_ofs));
+  this_prog.mk_call(this_ins, BPF_FUNC_map_lookup_elem, 2);
+  this_prog.mk_jcond(this_ins, EQ, r0, i0, join_block, incr_block);
+
+  // Other CPUs may be dropping messages too, so add atomically.
+  set_block(incr_block);
+  value *one = this_prog.new_reg();
+  emit_mov(one, this_prog.new_imm(1));
+  this_prog.mk_xadd(this_ins, BPF_DW, r0, 0, one);
+  this_prog.mk_jmp(this_ins, join_block);
+
+  set_block(join_block);
+}
+#endif
+
 globals::perf_event_type
 printf_arg_type (value *arg, const print_format::format_component &c)
 {
@@ -4205,6 +4273,22 @@ build_internal_globals(globals& glob)
   glob.maps.push_back
     ({ BPF_MAP_TYPE_HASH, 4, /* NB: value_size */ 8, globals::NUM_INTERNALS, 0 });
 
+  // Prefer a single ringbuf (kernel 5.8+) for message transport: it
+  // keeps messages from all CPUs in order without reserving a buffer
+  // per CPU.  -DSTP_BPF_RINGBUF=0 forces the perf_event_map.
+  glob.use_ringbuf = false;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (strverscmp(glob.session->kernel_base_release.c_str(), "5.8") >= 0)
+    glob.use_ringbuf = true;
+  for (const std::string& macro: glob.session->c_macros)
+    if (macro == "STP_BPF_RINGBUF=0")
+      glob.use_ringbuf = false;
+
+  if (glob.use_ringbuf)
+    glob.maps.push_back
+      ({ BPF_MAP_TYPE_RINGBUF, 0, 0, globals::NUM_CPUS_PLACEHOLDER, 0 });
+  else
+#endif
   // PR22330: Use a PERF_EVENT_ARRAY map for message transport:
   glob.maps.push_back
     ({ BPF_MAP_TYPE_PERF_EVENT_ARRAY, 4, 4, globals::NUM_CPUS_PLACEHOLDER, 0 });
@@ -0,0 +1,400 @@
+// BTF (BPF Type Format) reader
+// Copyright (C) 2026 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#include "config.h"
+#include "btf.h"
+#include "staptree.h"
+#include "util.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+using namespace std;
+
+
+// The on-disk format, as in <linux/btf.h>.
+#define BTF_MAGIC 0xeB9F
+
+struct btf_file_header
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t flags;
+  uint32_t hdr_len;
+  uint32_t type_off;
+  uint32_t type_len;
+  uint32_t str_off;
+  uint32_t str_len;
+};
+
+#define BTF_INFO_KIND(info)	(((info) >> 24) & 0x1f)
+#define BTF_INFO_VLEN(info)	((info) & 0xffff)
+#define BTF_INFO_KFLAG(info)	((info) >> 31)
+#define BTF_INT_ENCODING(val)	(((val) & 0x0f000000) >> 24)
+#define BTF_INT_SIGNED		(1 << 0)
+#define BTF_MEMBER_BITFIELD_SIZE(val)	((val) >> 24)
+#define BTF_MEMBER_BIT_OFFSET(val)	((val) & 0xffffff)
+
+
+// The number of 32-bit words of kind-specific data following a type.
+static size_t
+btf_extra_words (uint32_t info)
+{
+  unsigned vlen = BTF_INFO_VLEN (info);
+  switch (BTF_INFO_KIND (info))
+    {
+    case btf_kind_int:
+    case btf_kind_var:
+    case btf_kind_decl_tag:
+      return 1;
+    case btf_kind_array:
+      return 3;
+    case btf_kind_struct:
+    case btf_kind_union:
+    case btf_kind_datasec:
+    case btf_kind_enum64:
+      return 3 * vlen;
+    case btf_kind_enum:
+    case btf_kind_func_proto:
+      return 2 * vlen;
+    default:
+      return 0;
+    }
+}
+
+
+void
+btf_reader::load (const string& path)
+{
+  ifstream in (path.c_str(), ios::binary);
+  if (!in)
+    throw SEMANTIC_ERROR (_F("cannot open BTF file %s", path.c_str()));
+  files.push_back (vector<char> ((istreambuf_iterator<char>(in)),
+                                 istreambuf_iterator<char>()));
+  const vector<char>& data = files.back();
+
+  btf_file_header hdr;
+  if (data.size() < sizeof(hdr))
+    throw SEMANTIC_ERROR (_F("truncated BTF file %s", path.c_str()));
+  memcpy (&hdr, &data[0], sizeof(hdr));
+  if (hdr.magic != BTF_MAGIC)
+    throw SEMANTIC_ERROR (_F("%s is not a native-endian BTF file", path.c_str()));
+
+  uint64_t type_start = (uint64_t) hdr.hdr_len + hdr.type_off;
+  uint64_t str_start = (uint64_t) hdr.hdr_len + hdr.str_off;
+  if (hdr.hdr_len < sizeof(hdr)
+      || type_start + hdr.type_len > data.size()
+      || str_start + hdr.str_len > data.size()
+      || (type_start % 4) != 0)
+    throw SEMANTIC_ERROR (_F("malformed BTF file %s", path.c_str()));
+
+  // The first file is vmlinux; later ones are split BTF, whose ids and
+  // string offsets continue from those of vmlinux.
+  if (files.size() == 1)
+    {
+      base_types = 0;
+      base_strings = 0;
+    }
+  else if (files.size() == 2)
+    {
+      base_types = types.size();
+      base_strings = string_sizes[0];
+    }
+  else
+    throw SEMANTIC_ERROR (_("only one split BTF file may be loaded"));
+
+  strings.push_back (&data[str_start]);
+  string_sizes.push_back (hdr.str_len);
+
+  const uint32_t* p = (const uint32_t*) &data[type_start];
+  const uint32_t* end = (const uint32_t*) &data[type_start + hdr.type_len];
+  while (p + 3 <= end)
+    {
+      type t;
+      t.name_off = p[0];
+      t.info = p[1];
+      t.size_type = p[2];
+      t.extra = p + 3;
+      p += 3 + btf_extra_words (t.info);
+      if (p > end)
+        throw SEMANTIC_ERROR (_F("malformed BTF file %s", path.c_str()));
+      types.push_back (t);
+
+      uint32_t id = types.size();
+      const char *n = str (t.name_off);
+      if (!n || !*n)
+        continue;
+      switch (BTF_INFO_KIND (t.info))
+        {
+        case btf_kind_struct:
+          names.insert (make_pair (string("struct ") + n, id));
+          break;
+        case btf_kind_union:
+          names.insert (make_pair (string("union ") + n, id));
+          break;
+        case btf_kind_enum:
+        case btf_kind_enum64:
+          names.insert (make_pair (string("enum ") + n, id));
+          break;
+        case btf_kind_typedef:
+        case btf_kind_int:
+        case btf_kind_float:
+          names.insert (make_pair (string(n), id));
+          break;
+        default:
+          break;
+        }
+    }
+}
+
+
+const btf_reader::type*
+btf_reader::get (uint32_t id) const
+{
+  if (id == 0 || id > types.size())
+    return NULL;
+  return &types[id - 1];
+}
+
+
+const char*
+btf_reader::str (uint32_t off) const
+{
+  unsigned i = 0;
+  if (strings.size() > 1 && off >= base_strings)
+    {
+      off -= base_strings;
+      i = 1;
+    }
+  if (i >= strings.size() || off >= string_sizes[i])
+    return NULL;
+  return strings[i] + off;
+}
+
+
+uint32_t
+btf_reader::find_type (const string& name) const
+{
+  // Prefer a full definition over a forward declaration, which we
+  // don't index anyway, and over a same-named type of a later module.
+  multimap<string, uint32_t>::const_iterator it = names.find (name);
+  if (it != names.end())
+    return it->second;
+
+  if (startswith (name, "struct ") || startswith (name, "union ")
+      || startswith (name, "enum "))
+    return 0;
+
+  static const char *const tags[] = { "struct ", "union ", "enum " };
+  for (unsigned i = 0; i < sizeof(tags) / sizeof(tags[0]); ++i)
+    {
+      it = names.find (tags[i] + name);
+      if (it != names.end())
+        return it->second;
+    }
+  return 0;
+}
+
+
+uint32_t
+btf_reader::resolve (uint32_t id) const
+{
+  // Bound the walk, in case of a malformed cycle.
+  for (unsigned depth = 0; depth < 32; ++depth)
+    {
+      const type* t = get (id);
+      if (!t)
+        return id;
+      switch (BTF_INFO_KIND (t->info))
+        {
+        case btf_kind_typedef:
+        case btf_kind_volatile:
+        case btf_kind_const:
+        case btf_kind_restrict:
+        case btf_kind_type_tag:
+          id = t->size_type;
+          break;
+        default:
+          return id;
+        }
+    }
+  return 0;
+}
+
+
+btf_kind
+btf_reader::kind (uint32_t id) const
+{
+  const type* t = get (id);
+  return t ? (btf_kind) BTF_INFO_KIND (t->info) : btf_kind_unknown;
+}
+
+
+string
+btf_reader::name (uint32_t id) const
+{
+  const type* t = get (id);
+  const char *n = t ? str (t->name_off) : NULL;
+  return n ? n : "";
+}
+
+
+unsigned
+btf_reader::ptr_size () const
+{
+  if (pointer_size == 0)
+    {
+      uint32_t id = find_type ("long unsigned int");
+      pointer_size = (id && kind (id) == btf_kind_int) ? size (id) : sizeof(void*);
+    }
+  return pointer_size;
+}
+
+
+uint64_t
+btf_reader::size (uint32_t id) const
+{
+  id = resolve (id);
+  const type* t = get (id);
+  if (!t)
+    return 0;
+  switch (BTF_INFO_KIND (t->info))
+    {
+    case btf_kind_int:
+    case btf_kind_struct:
+    case btf_kind_union:
+    case btf_kind_enum:
+    case btf_kind_enum64:
+    case btf_kind_float:
+      return t->size_type;
+    case btf_kind_ptr:
+      return ptr_size ();
+    case btf_kind_array:
+      return t->extra[2] * size (t->extra[0]);
+    default:
+      return 0;
+    }
+}
+
+
+bool
+btf_reader::int_signed_p (uint32_t id) const
+{
+  const type* t = get (resolve (id));
+  if (!t)
+    return false;
+  if (BTF_INFO_KIND (t->info) == btf_kind_int)
+    return BTF_INT_ENCODING (t->extra[0]) & BTF_INT_SIGNED;
+  if (BTF_INFO_KIND (t->info) == btf_kind_enum
+      || BTF_INFO_KIND (t->info) == btf_kind_enum64)
+    return BTF_INFO_KFLAG (t->info);
+  return false;
+}
+
+
+uint32_t
+btf_reader::target (uint32_t id) const
+{
+  const type* t = get (resolve (id));
+  if (!t)
+    return 0;
+  if (BTF_INFO_KIND (t->info) == btf_kind_ptr)
+    return t->size_type;
+  if (BTF_INFO_KIND (t->info) == btf_kind_array)
+    return t->extra[0];
+  return 0;
+}
+
+
+void
+btf_reader::members (uint32_t id, vector<btf_member>& ms) const
+{
+  const type* t = get (resolve (id));
+  if (!t || (BTF_INFO_KIND (t->info) != btf_kind_struct
+             && BTF_INFO_KIND (t->info) != btf_kind_union))
+    return;
+
+  bool kflag = BTF_INFO_KFLAG (t->info);
+  for (unsigned i = 0; i < BTF_INFO_VLEN (t->info); ++i)
+    {
+      const uint32_t* m = t->extra + 3 * i;
+      btf_member bm;
+      const char *n = str (m[0]);
+      bm.name = n ? n : "";
+      bm.type = m[1];
+      bm.bit_offset = kflag ? BTF_MEMBER_BIT_OFFSET (m[2]) : m[2];
+      bm.bitfield_size = kflag ? BTF_MEMBER_BITFIELD_SIZE (m[2]) : 0;
+      ms.push_back (bm);
+    }
+}
+
+
+bool
+btf_reader::find_member (uint32_t id, const string& member, btf_member& m) const
+{
+  vector<btf_member> ms;
+  members (id, ms);
+  for (unsigned i = 0; i < ms.size(); ++i)
+    if (ms[i].name == member)
+      {
+        m = ms[i];
+        return true;
+      }
+
+  // Look into anonymous structs and unions.
+  for (unsigned i = 0; i < ms.size(); ++i)
+    if (ms[i].name.empty() && find_member (ms[i].type, member, m))
+      {
+        m.bit_offset += ms[i].bit_offset;
+        return true;
+      }
+  return false;
+}
+
+
+string
+btf_reader::type_name (uint32_t id) const
+{
+  if (id == 0)
+    return "void";
+  const type* t = get (id);
+  if (!t)
+    return "<unknown>";
+
+  string n = name (id);
+  switch (BTF_INFO_KIND (t->info))
+    {
+    case btf_kind_struct:
+      return "struct " + (n.empty() ? "{...}" : n);
+    case btf_kind_union:
+      return "union " + (n.empty() ? "{...}" : n);
+    case btf_kind_enum:
+    case btf_kind_enum64:
+      return "enum " + (n.empty() ? "{...}" : n);
+    case btf_kind_fwd:
+      return (BTF_INFO_KFLAG (t->info) ? "union " : "struct ") + n;
+    case btf_kind_ptr:
+      return type_name (t->size_type) + "*";
+    case btf_kind_array:
+      return type_name (t->extra[0]) + "[" + lex_cast (t->extra[2]) + "]";
+    case btf_kind_const:
+      return "const " + type_name (t->size_type);
+    case btf_kind_volatile:
+      return "volatile " + type_name (t->size_type);
+    case btf_kind_restrict:
+    case btf_kind_type_tag:
+      return type_name (t->size_type);
+    case btf_kind_func_proto:
+      return "<function>";
+    default:
+      return n;
+    }
+}
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
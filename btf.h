@@ -0,0 +1,119 @@
+// -*- C++ -*-
+// BTF (BPF Type Format) reader
+// Copyright (C) 2026 Red Hat Inc.
+//
+// This file is part of systemtap, and is free software.  You can
+// redistribute it and/or modify it under the terms of the GNU General
+// Public License (GPL); either version 2, or (at your option) any
+// later version.
+
+#ifndef BTF_H
+#define BTF_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// The kernel describes its own types in BTF, at /sys/kernel/btf/vmlinux
+// and /sys/kernel/btf/MODULE.  This is enough to lay out structures for
+// @cast without any debuginfo.  Type ids are as in the file: 0 is void,
+// and the types of a module's split BTF follow those of vmlinux.
+
+enum btf_kind
+{
+  btf_kind_unknown = 0,
+  btf_kind_int = 1,
+  btf_kind_ptr = 2,
+  btf_kind_array = 3,
+  btf_kind_struct = 4,
+  btf_kind_union = 5,
+  btf_kind_enum = 6,
+  btf_kind_fwd = 7,
+  btf_kind_typedef = 8,
+  btf_kind_volatile = 9,
+  btf_kind_const = 10,
+  btf_kind_restrict = 11,
+  btf_kind_func = 12,
+  btf_kind_func_proto = 13,
+  btf_kind_var = 14,
+  btf_kind_datasec = 15,
+  btf_kind_float = 16,
+  btf_kind_decl_tag = 17,
+  btf_kind_type_tag = 18,
+  btf_kind_enum64 = 19,
+};
+
+struct btf_member
+{
+  std::string name;
+  uint32_t type;
+  uint64_t bit_offset;
+  unsigned bitfield_size; // 0 unless a bit field
+};
+
+class btf_reader
+{
+public:
+  btf_reader(): base_types (0), base_strings (0), pointer_size (0) {}
+
+  // Read the BTF in PATH.  A second load() adds the split BTF of a
+  // module on top of the vmlinux BTF read first.  Throws a semantic
+  // error if the file is missing or malformed.
+  void load (const std::string& path);
+
+  // The id of the type named NAME, as in @cast: "struct foo", "union
+  // foo" and "enum foo" are looked up as such, anything else as a
+  // typedef and then as a struct, union or enum.  0 if not found.
+  uint32_t find_type (const std::string& name) const;
+
+  // Skip typedefs and qualifiers.
+  uint32_t resolve (uint32_t id) const;
+
+  btf_kind kind (uint32_t id) const;
+  std::string name (uint32_t id) const;
+
+  // The size in bytes of an integer, enum, struct, union or array.
+  uint64_t size (uint32_t id) const;
+
+  // The size of a pointer on the traced kernel.
+  unsigned ptr_size () const;
+
+  bool int_signed_p (uint32_t id) const;
+
+  // The type pointed to, or the element type of an array.
+  uint32_t target (uint32_t id) const;
+
+  // Find MEMBER in struct or union ID, looking into anonymous members
+  // too; the offset returned is from the start of ID.
+  bool find_member (uint32_t id, const std::string& member, btf_member& m) const;
+
+  // The C spelling of a type, for error messages.
+  std::string type_name (uint32_t id) const;
+
+private:
+  struct type
+  {
+    uint32_t name_off;
+    uint32_t info;
+    uint32_t size_type;
+    const uint32_t* extra; // kind-specific data following the type
+  };
+
+  std::vector<std::vector<char> > files;
+  std::vector<type> types; // indexed by id - 1
+  std::vector<const char*> strings; // base, then split string sections
+  std::vector<uint32_t> string_sizes;
+  std::multimap<std::string, uint32_t> names; // "struct foo", typedef "foo"
+  uint32_t base_types;
+  uint32_t base_strings;
+  mutable unsigned pointer_size;
+
+  const type* get (uint32_t id) const;
+  const char* str (uint32_t off) const;
+  void members (uint32_t id, std::vector<btf_member>& ms) const;
+};
+
+#endif // BTF_H
+
+/* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -15,10 +15,13 @@
 
 #include <cstdlib>
 #include <fstream>
+#include <iterator>
 #include <sstream>
 #include <thread>
 
 extern "C" {
+#include <fcntl.h>
+#include <gelf.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <pwd.h>
@@ -35,13 +38,30 @@ extern "C" {
 
 using namespace std;
 
-/* Adjust and run make_cmd to build a kernel module. */
-static int
-run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
-             bool null_out=false, bool null_err=false)
+/* The number of make jobs to allow a kbuild, when CONCURRENT of them
+   run at once.  0 if we shouldn't ask for parallelism at all. */
+static unsigned
+make_jobs(unsigned concurrent)
 {
-  assert_no_interrupts();
+  // Exploit SMP parallelism, if available.
+  long smp = thread::hardware_concurrency();
+  if (smp <= 0) smp = 1;
+  // PR16276: but only if we're not running severely nproc-rlimited
+  struct rlimit rlim;
+  int rlimit_rc = getrlimit(RLIMIT_NPROC, &rlim);
+  const unsigned int severely_limited = smp*30; // WAG at number of gcc+make etc. nested processes
+  bool nproc_limited = (rlimit_rc == 0 && (rlim.rlim_max <= severely_limited || 
+                                           rlim.rlim_cur <= severely_limited));
+  if (nproc_limited)
+    return 0;
+  return max(smp / (long) concurrent, 1L) + 1;
+}
 
+/* Adjust make_cmd to build a kernel module, as one of CONCURRENT. */
+static void
+prepare_make_cmd(systemtap_session& s, vector<string>& make_cmd,
+                 bool& null_out, unsigned concurrent=1)
+{
   // PR14168: we used to unsetenv values here; instead do it via
   // env(1) in make_any_make_cmd().
 
@@ -61,17 +81,9 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       make_cmd.push_back("--no-print-directory");
     }
 
-  // Exploit SMP parallelism, if available.
-  long smp = thread::hardware_concurrency();
-  if (smp <= 0) smp = 1;
-  // PR16276: but only if we're not running severely nproc-rlimited
-  struct rlimit rlim;
-  int rlimit_rc = getrlimit(RLIMIT_NPROC, &rlim);
-  const unsigned int severely_limited = smp*30; // WAG at number of gcc+make etc. nested processes
-  bool nproc_limited = (rlimit_rc == 0 && (rlim.rlim_max <= severely_limited || 
-                                           rlim.rlim_cur <= severely_limited));
-  if (smp >= 1 && !nproc_limited)
-    make_cmd.push_back("-j" + lex_cast(smp+1));
+  unsigned jobs = make_jobs(concurrent);
+  if (jobs)
+    make_cmd.push_back("-j" + lex_cast(jobs));
 
   if (strverscmp (s.kernel_base_release.c_str(), "2.6.29") < 0)
     {
@@ -80,13 +92,57 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       // that with this bluntness.
       null_out = true;
     }
+}
+
+/* Adjust and run make_cmd to build a kernel module. */
+static int
+run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
+             bool null_out=false, bool null_err=false)
+{
+  assert_no_interrupts();
 
+  prepare_make_cmd(s, make_cmd, null_out);
   int rc = stap_system (s.verbose, "kbuild", make_cmd, null_out, null_err);
   if (rc != 0)
     s.set_try_server ();
   return rc;
 }
 
+/* Run several kbuilds at once, sharing the CPUs between them, and
+   return their exit codes.  An interrupt kills the children through
+   the usual stap_spawn bookkeeping, so the threads always finish. */
+static vector<int>
+run_make_cmds(systemtap_session& s, vector<vector<string> >& make_cmds,
+              bool null_out=false, bool null_err=false)
+{
+  assert_no_interrupts();
+
+  vector<int> rcs(make_cmds.size(), 0);
+  vector<bool> null_outs(make_cmds.size(), null_out);
+  for (size_t i = 0; i < make_cmds.size(); ++i)
+    {
+      bool no = null_out;
+      prepare_make_cmd(s, make_cmds[i], no, make_cmds.size());
+      null_outs[i] = no;
+    }
+
+  vector<thread> builds;
+  for (size_t i = 0; i < make_cmds.size(); ++i)
+    builds.push_back(thread([&, i] {
+      rcs[i] = stap_system (s.verbose, "kbuild", make_cmds[i],
+                            null_outs[i], null_err);
+    }));
+  for (size_t i = 0; i < builds.size(); ++i)
+    builds[i].join();
+
+  for (size_t i = 0; i < rcs.size(); ++i)
+    if (rcs[i] != 0)
+      s.set_try_server ();
+
+  assert_no_interrupts();
+  return rcs;
+}
+
 static vector<string>
 make_any_make_cmd(systemtap_session& s, const string& dir, const string& target)
 {
@@ -276,6 +332,8 @@ compile_pass (systemtap_session& s)
     return compile_dyninst (s);
 
   int rc = uprobes_pass (s);
+  if (!rc)
+    rc = shared_symbols_pass (s);
   if (rc)
     {
       s.set_try_server ();
@@ -653,6 +711,11 @@ compile_pass (systemtap_session& s)
   // o << "CFLAGS := $(subst -Os,-O2,$(CFLAGS)) -fminimal-toc" << endl;
   o << "obj-m := " << s.module_name << ".o" << endl;
 
+  // Resolve the tables that stap_symbols.o takes from the shared
+  // symbols module.
+  if (!s.shared_symbols_path.empty())
+    o << "KBUILD_EXTRA_SYMBOLS := " << s.tmpdir << "/symbols/Module.symvers" << endl;
+
   // print out all the auxiliary source (->object) file names
   o << s.module_name << "-y := ";
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
@@ -874,6 +937,70 @@ uprobes_pass (systemtap_session& s)
   return rc;
 }
 
+static int
+make_shared_symbols (systemtap_session& s, const string& dir)
+{
+  // create a simple Makefile
+  string makefile(dir + "/Makefile");
+  ofstream omf(makefile.c_str());
+  omf << "obj-m := " << s.shared_symbols_name << ".o" << endl;
+  // RHBZ 655231: later rhel6 kernels' module-signing kbuild logic breaks out-of-tree modules
+  omf << "CONFIG_MODULE_SIG := n" << endl;
+  omf << "EXTRA_CFLAGS += -I" << s.runtime_path << endl;
+  omf.close();
+
+  // create a simple #include-chained source file
+  string sourcefile(dir + "/" + s.shared_symbols_name + ".c");
+  ofstream osrc(sourcefile.c_str());
+  osrc << "#include \"" << s.shared_symbols_source << "\"" << endl;
+  osrc.close();
+
+  // make the module
+  vector<string> make_cmd = make_make_cmd(s, dir);
+  int rc = run_make_cmd(s, make_cmd);
+
+  if (s.verbose > 1)
+    clog << _("shared symbols module build exit code: ") << rc << endl;
+  return rc;
+}
+
+int
+shared_symbols_pass (systemtap_session& s)
+{
+  if (s.shared_symbols_name.empty())
+    return 0;
+
+  // Like uprobes.ko, this goes in its own directory, with the
+  // Module.symvers that the script module links against.
+  string dir(s.tmpdir + "/symbols");
+  if (create_dir(dir.c_str()) != 0)
+    return 1;
+
+  string tmpko = dir + "/" + s.shared_symbols_name + ".ko";
+  string tmpsyms = dir + "/Module.symvers";
+
+  // The module name is a hash of its contents, so any cached module of
+  // that name will do, and so will one that another script loaded.
+  string cacheko = s.shared_symbols_cache + ".ko";
+  string cachesyms = s.shared_symbols_cache + ".symvers";
+  if (s.shared_symbols_cache.empty()
+      || get_file_size(cacheko) <= 0 || !copy_file(cacheko, tmpko)
+      || get_file_size(cachesyms) <= 0 || !copy_file(cachesyms, tmpsyms))
+    {
+      int rc = make_shared_symbols(s, dir);
+      if (rc)
+        return rc;
+      if (!s.shared_symbols_cache.empty())
+        {
+          copy_file(tmpko, cacheko);
+          copy_file(tmpsyms, cachesyms);
+        }
+    }
+
+  s.shared_symbols_path = tmpko;
+  return 0;
+}
+
 static vector<string>
 make_dyninst_run_command (systemtap_session& s, const string& remotedir,
 			  const string&)
@@ -957,6 +1084,16 @@ make_kernel_run_command (systemtap_session& s, const string& remotedir,
       cmd.push_back(opt_u);
     }
 
+  if (!s.shared_symbols_path.empty())
+    {
+      string opt_k = "-K";
+      if (remotedir.empty())
+        opt_k.append(s.shared_symbols_path);
+      else
+        opt_k.append(remotedir + "/" + basename(s.shared_symbols_path.c_str()));
+      cmd.push_back(opt_k);
+    }
+
   if (s.load_only)
     cmd.push_back(s.output_file.empty() ? "-L" : "-D");
 
@@ -978,6 +1115,9 @@ make_kernel_run_command (systemtap_session& s, const string& remotedir,
   if (s.monitor)
     cmd.insert(cmd.end(), { "-M", lex_cast(s.monitor_interval) });
 
+  if (s.exporter_port)
+    cmd.insert(cmd.end(), { "-E", lex_cast(s.exporter_port) });
+
   cmd.push_back((remotedir.empty() ? s.tmpdir : remotedir)
                         + "/" + s.module_filename());
 
@@ -1038,16 +1178,16 @@ make_run_command (systemtap_session& s, const string& remotedir,
     }
 }
 
-// Build tiny kernel modules to query tracepoints.
-// Given a (header-file -> test-contents) map, compile them ASAP, and return
-// a (header-file -> obj-filename) map.
-
-map<string,string>
-make_tracequeries(systemtap_session& s, const map<string,string>& contents)
+// Write one kbuild directory holding the tracequery sources for HEADERS,
+// noting in OBJS where each object will be.  Return the directory, or ""
+// if it couldn't be created.
+static string
+make_tracequery_dir(systemtap_session& s, const vector<string>& headers,
+                    const map<string,string>& contents,
+                    map<string,string>& objs)
 {
   static unsigned tick = 0;
   string basename("tracequery_kmod_" + lex_cast(++tick));
-  map<string,string> objs;
 
   // create a subdirectory for the module
   string dir(s.tmpdir + "/" + basename);
@@ -1055,7 +1195,7 @@ make_tracequeries(systemtap_session& s, const map<string,string>& contents)
     {
       s.print_warning("failed to create directory for querying tracepoints.");
       s.set_try_server ();
-      return objs;
+      return "";
     }
 
   // create a simple Makefile
@@ -1080,41 +1220,104 @@ make_tracequeries(systemtap_session& s, const map<string,string>& contents)
 
   omf << "obj-m := " << endl;
   // write out each header-specific source file into a separate file
-  for (map<string,string>::const_iterator it = contents.begin(); it != contents.end(); it++)
+  for (size_t i = 0; i < headers.size(); ++i)
     {
       string sbasename = basename + "_" + lex_cast(++tick); // suffixed
 
       // write out source code
       string srcname = dir + "/" + sbasename + ".c";
-      string src = it->second;
       ofstream osrc(srcname.c_str());
-      osrc << src;
+      osrc << contents.at(headers[i]);
       osrc.close();
 
       if (s.verbose > 2)
         clog << _F("Processing tracepoint header %s with query %s", 
-                   it->first.c_str(), srcname.c_str())
+                   headers[i].c_str(), srcname.c_str())
              << endl;
 
       // arrange to build it
       omf << "obj-m += " + sbasename + ".o" << endl; // NB: without <dir> prefix
-      objs[it->first] = dir + "/" + sbasename + ".o";
+      objs[headers[i]] = dir + "/" + sbasename + ".o";
     }
   omf.close();
 
-  // make the module
-  vector<string> make_cmd = make_make_objs_cmd(s, dir);
-  make_cmd.push_back ("-i"); // ignore errors, give rc 0 even in case of tracepoint header nits
-  bool quiet = (s.verbose < 4);
-  int rc = run_make_cmd(s, make_cmd, quiet, quiet);
-  if (rc)
-    s.set_try_server ();
+  return dir;
+}
+
+// Build tiny kernel modules to query tracepoints.
+// Given a (header-file -> test-contents) map, compile them ASAP, and return
+// a (header-file -> obj-filename) map.
+
+map<string,string>
+make_tracequeries(systemtap_session& s, const map<string,string>& contents)
+{
+  map<string,string> objs;
+
+  // Spread the headers over a few concurrent kbuilds.  Each kbuild has
+  // a fixed cost of its own, so don't give it fewer than a handful.
+  const size_t min_group = 8;
+  vector<string> headers;
+  for (map<string,string>::const_iterator it = contents.begin(); it != contents.end(); it++)
+    headers.push_back(it->first);
+  unsigned jobs = make_jobs(1); // one per CPU and one more, or none
+  size_t ngroups = jobs ? min((size_t) jobs - 1, headers.size() / min_group) : 1;
+  if (ngroups == 0)
+    ngroups = 1;
+
+  vector<vector<string> > groups(ngroups);
+  for (size_t i = 0; i < headers.size(); ++i)
+    groups[i % ngroups].push_back(headers[i]);
+
+  while (!groups.empty())
+    {
+      if (s.verbose > 2)
+        clog << _F("Pass 2: building tracepoint queries in %zu kbuilds", groups.size())
+             << endl;
 
-  // Sometimes we fail a tracequery due to PR9993 / PR11649 type
-  // kernel trace header problems.  In this case, due to PR12729, we
-  // used to get a lovely "Warning: make exited with status: 2" but no
-  // other useful diagnostic.  -vvvv would let a user see what's up,
-  // but the user can't fix the problem even with that.
+      vector<vector<string> > make_cmds;
+      vector<vector<string> > built;
+      for (size_t i = 0; i < groups.size(); ++i)
+        {
+          string dir = make_tracequery_dir(s, groups[i], contents, objs);
+          if (dir.empty())
+            continue;
+          make_cmds.push_back(make_make_objs_cmd(s, dir));
+          make_cmds.back().push_back ("-i"); // ignore errors, give rc 0 even in case of tracepoint header nits
+          built.push_back(groups[i]);
+        }
+
+      bool quiet = (s.verbose < 4);
+      vector<int> rcs = run_make_cmds(s, make_cmds, quiet, quiet);
+
+      // Sometimes we fail a tracequery due to PR9993 / PR11649 type
+      // kernel trace header problems.  In this case, due to PR12729, we
+      // used to get a lovely "Warning: make exited with status: 2" but no
+      // other useful diagnostic.  -vvvv would let a user see what's up,
+      // but the user can't fix the problem even with that.
+      //
+      // Thanks to -i, those just leave their own object missing.  If a
+      // kbuild fails outright anyway, retry its missing objects in
+      // halves, concurrently, so one bad header can't take the others
+      // in its group down with it.
+      groups.clear();
+      for (size_t i = 0; i < built.size(); ++i)
+        {
+          if (rcs[i] == 0)
+            continue;
+          vector<string> missing;
+          for (size_t j = 0; j < built[i].size(); ++j)
+            if (!file_exists(objs[built[i][j]]))
+              missing.push_back(built[i][j]);
+          // Nothing built at all means kbuild itself is broken; a
+          // retry wouldn't help.
+          if (missing.size() < 2 || missing.size() == built[i].size())
+            continue;
+
+          size_t half = missing.size() / 2;
+          groups.push_back(vector<string>(missing.begin(), missing.begin() + half));
+          groups.push_back(vector<string>(missing.begin() + half, missing.end()));
+        }
+    }
 
   return objs;
 }
@@ -1265,4 +1468,131 @@ make_typequery(systemtap_session& s, string& module)
   return rc;
 }
 
+// Add up the size of each function and object defined in the ELF file
+// PATH, by name.  Clones that gcc made, like foo.constprop.0 or
+// foo.cold, count towards the function they came from.
+static void
+read_symbol_sizes (const string& path, map<string, unsigned long>& sizes)
+{
+  int fd = open (path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  elf_version (EV_CURRENT);
+  Elf* elf = elf_begin (fd, ELF_C_READ, NULL);
+  Elf_Scn* scn = NULL;
+  while (elf && (scn = elf_nextscn (elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr_mem;
+      GElf_Shdr* shdr = gelf_getshdr (scn, &shdr_mem);
+      if (shdr == NULL || shdr->sh_type != SHT_SYMTAB || shdr->sh_entsize == 0)
+        continue;
+      Elf_Data* data = elf_getdata (scn, NULL);
+      if (data == NULL)
+        continue;
+      for (size_t i = 0; i < shdr->sh_size / shdr->sh_entsize; ++i)
+        {
+          GElf_Sym sym_mem;
+          GElf_Sym* sym = gelf_getsym (data, i, &sym_mem);
+          if (sym == NULL || sym->st_shndx == SHN_UNDEF || sym->st_size == 0)
+            continue;
+          const char* name = elf_strptr (elf, shdr->sh_link, sym->st_name);
+          if (name == NULL)
+            continue;
+          string n = name;
+          sizes[n.substr (0, n.find ('.'))] += sym->st_size;
+        }
+    }
+  elf_end (elf);
+  close (fd);
+}
+
+
+static string
+json_string (const string& str)
+{
+  ostringstream o;
+  o << '"';
+  for (unsigned i = 0; i < str.size(); ++i)
+    {
+      unsigned char c = str[i];
+      if (c == '"' || c == '\\')
+        o << '\\' << c;
+      else if (c < 0x20)
+        o << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xf];
+      else
+        o << c;
+    }
+  o << '"';
+  return o.str();
+}
+
+
+// Write the --report-build JSON: the time of each pass so far, and the
+// generated C lines and object size of each probe handler, function
+// and probe group.  Handlers and functions are measured by their
+// symbols in the module, so a function that gcc inlined everywhere
+// has no size of its own; probe groups report only their lines.
+void
+write_build_report (systemtap_session& s)
+{
+  string module = s.tmpdir + "/" + s.module_filename();
+  map<string, unsigned long> sizes;
+  read_symbol_sizes (module, sizes);
+
+  unsigned long module_size = 0;
+  struct stat st;
+  if (stat (module.c_str(), &st) == 0)
+    module_size = st.st_size;
+
+  unsigned long source_lines = 0;
+  {
+    ifstream in (s.translated_source.c_str());
+    source_lines = count (istreambuf_iterator<char>(in), istreambuf_iterator<char>(), '\n');
+  }
+
+  ofstream o (s.report_build_path.c_str());
+  o << "{" << endl;
+  o << "  \"module\": " << json_string (s.module_filename()) << "," << endl;
+  o << "  \"module_size\": " << module_size << "," << endl;
+  o << "  \"source_lines\": " << source_lines << "," << endl;
+
+  o << "  \"passes\": [";
+  for (unsigned i = 0; i < s.build_report_times.size(); ++i)
+    {
+      const systemtap_session::build_report_time& t = s.build_report_times[i];
+      o << (i ? "," : "") << endl
+        << "    { \"pass\": " << json_string (t.pass)
+        << ", \"usr_ms\": " << t.usr << ", \"sys_ms\": " << t.sys
+        << ", \"real_ms\": " << t.real << " }";
+    }
+  o << endl << "  ]," << endl;
+
+  // A handler shared by duplicate probes is counted with the first.
+  set<string> counted;
+  o << "  \"units\": [";
+  for (unsigned i = 0; i < s.build_report_units.size(); ++i)
+    {
+      const systemtap_session::build_report_unit& u = s.build_report_units[i];
+      unsigned long size = 0;
+      if (! u.symbol.empty() && counted.insert (u.symbol).second)
+        size = sizes[u.symbol];
+      o << (i ? "," : "") << endl
+        << "    { \"kind\": " << json_string (u.kind)
+        << ", \"name\": " << json_string (u.name)
+        << ", \"symbol\": " << json_string (u.symbol)
+        << ", \"lines\": " << u.lines
+        << ", \"object_size\": " << size << " }";
+    }
+  o << endl << "  ]" << endl;
+  o << "}" << endl;
+
+  o.close ();
+  if (! o)
+    s.print_warning (_F("cannot write build report to %s",
+                        s.report_build_path.c_str()));
+  else if (s.verbose)
+    clog << _F("Wrote build report to %s", s.report_build_path.c_str()) << endl;
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
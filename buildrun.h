@@ -12,7 +12,9 @@
 #include "elaborate.h"
 
 int compile_pass (systemtap_session& s);
+void write_build_report (systemtap_session& s);
 int uprobes_pass (systemtap_session& s);
+int shared_symbols_pass (systemtap_session& s);
 
 std::vector<std::string> make_run_command (systemtap_session& s,
                                            const std::string& remotedir="",
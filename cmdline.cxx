@@ -62,6 +62,15 @@ struct option stap_long_options[] = {
   { "save-uprobes",                no_argument,       NULL, LONG_OPT_SAVE_UPROBES },
   { "target-namespaces",           required_argument, NULL, LONG_OPT_TARGET_NAMESPACES },
   { "monitor",                     optional_argument, NULL, LONG_OPT_MONITOR },
+  { "exporter",                    required_argument, NULL, LONG_OPT_EXPORTER },
+  { "lock-stripes",                required_argument, NULL, LONG_OPT_LOCK_STRIPES },
+  { "btf",                         required_argument, NULL, LONG_OPT_BTF },
+  { "pgo-collect",                 no_argument,       NULL, LONG_OPT_PGO_COLLECT },
+  { "pgo-use",                     required_argument, NULL, LONG_OPT_PGO_USE },
+  { "disable-cse",                 no_argument,       NULL, LONG_OPT_DISABLE_CSE },
+  { "inline-limit",                required_argument, NULL, LONG_OPT_INLINE_LIMIT },
+  { "report-build",                required_argument, NULL, LONG_OPT_REPORT_BUILD },
+  { "shared-symbols",              no_argument,       NULL, LONG_OPT_SHARED_SYMBOLS },
   { "interactive",                 no_argument,       NULL, LONG_OPT_INTERACTIVE},
   { "example",                     no_argument,       NULL, LONG_OPT_RUN_EXAMPLE},
   { "no-global-var-display",       no_argument,       NULL, LONG_OPT_NO_GLOBAL_VAR_DISPLAY},
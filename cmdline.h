@@ -66,6 +66,15 @@ enum {
   LONG_OPT_SAVE_UPROBES,
   LONG_OPT_TARGET_NAMESPACES,
   LONG_OPT_MONITOR,
+  LONG_OPT_EXPORTER,
+  LONG_OPT_LOCK_STRIPES,
+  LONG_OPT_BTF,
+  LONG_OPT_PGO_COLLECT,
+  LONG_OPT_PGO_USE,
+  LONG_OPT_DISABLE_CSE,
+  LONG_OPT_INLINE_LIMIT,
+  LONG_OPT_REPORT_BUILD,
+  LONG_OPT_SHARED_SYMBOLS,
   LONG_OPT_INTERACTIVE,
   LONG_OPT_RUN_EXAMPLE,
   LONG_OPT_NO_GLOBAL_VAR_DISPLAY,
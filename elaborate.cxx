@@ -21,6 +21,9 @@
 
 extern "C" {
 #include <sys/utsname.h>
+#include <sys/time.h>
+#include <sys/times.h>
+#include <unistd.h>
 #include <fnmatch.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -35,6 +38,8 @@ extern "C" {
 #include <algorithm>
 #include <iterator>
 #include <climits>
+#include <exception>
+#include <thread>
 
 
 using namespace std;
@@ -64,7 +69,7 @@ expression* add_condition (expression* a, expression* b)
 
 derived_probe::derived_probe (probe *p, probe_point *l, bool rewrite_loc):
   base (p), base_pp(l), group(NULL), sdt_semaphore_addr(0),
-  session_index((unsigned)-1)
+  session_index((unsigned)-1), tiny(false)
 {
   assert (p);
   this->tok = p->tok;
@@ -1787,14 +1792,168 @@ public:
   void visit_regex_query (regex_query *q) {
     functioncall_traversing_visitor::visit_regex_query (q);
 
-    string re = q->right->value;
-    regex_to_stapdfa (&session, re, q->right->tok);
+    if (!q->others.empty())
+      regex_to_stapdfa (&session, q->patterns(), q->tok);
+    else
+      {
+        string re = q->right->value;
+        regex_to_stapdfa (&session, re, q->right->tok);
+      }
   }
 };
 
+
+// Fuse chains of tests on the same string
+//
+//   if (s =~ "r1") A else if (s =~ "r2") B ... else Z
+//
+// into a single match set, which walks the string once for all the
+// patterns instead of once per pattern:
+//
+//   __regex_set_0_value = regexp_match_set(s, "r1", "r2", ...)
+//   if (__regex_set_0_value == 1) A else if (__regex_set_0_value == 2) B ... else Z
+
+struct regex_set_fuser: public update_visitor
+{
+  systemtap_session& session;
+  vector<vardecl*>& locals;
+  unsigned temps;
+
+  regex_set_fuser (systemtap_session& s, vector<vardecl*>& l):
+    update_visitor(s.verbose), session(s), locals(l), temps(0) {}
+
+  symbol* value (vardecl* v, const token* tok);
+  void visit_if_statement (if_statement* s);
+};
+
+
+symbol*
+regex_set_fuser::value (vardecl* v, const token* tok)
+{
+  symbol* sym = new symbol;
+  sym->name = v->name;
+  sym->tok = tok;
+  sym->referent = v;
+  sym->type = pe_long;
+  return sym;
+}
+
+
+void
+regex_set_fuser::visit_if_statement (if_statement* s)
+{
+  // Find the tests that can be fused: an operand that can't change
+  // between them, and no subexpressions for matched() to extract.
+  vector<if_statement*> chain;
+  symbol* operand = NULL;
+  for (if_statement* is = s; is; is = dynamic_cast<if_statement*>(is->elseblock))
+    {
+      regex_query* q = dynamic_cast<regex_query*>(is->condition);
+      if (!q || q->op != "=~" || !q->others.empty())
+        break;
+      symbol* sym = dynamic_cast<symbol*>(q->left);
+      if (!sym || !sym->referent || sym->referent->arity != 0
+          || (operand && sym->referent != operand->referent))
+        break;
+      operand = sym;
+      chain.push_back (is);
+    }
+
+  if (chain.size() < 2)
+    {
+      update_visitor::visit_if_statement (s);
+      return;
+    }
+
+  regex_query* set = new regex_query;
+  set->tok = chain[0]->condition->tok;
+  set->op = "=~";
+  set->left = operand;
+  set->right = static_cast<regex_query*>(chain[0]->condition)->right;
+  for (unsigned i = 1; i < chain.size(); i++)
+    set->others.push_back (static_cast<regex_query*>(chain[i]->condition)->right);
+  set->type = pe_long;
+
+  // Some patterns can't be part of a set; leave those chains alone.
+  try
+    {
+      regex_to_stapdfa (&session, set->patterns(), set->tok);
+    }
+  catch (const semantic_error& e)
+    {
+      if (session.verbose > 2)
+        clog << _F("Not fusing regex tests (%s) at ", e.what()) << *set->tok << endl;
+      delete set;
+      update_visitor::visit_if_statement (s);
+      return;
+    }
+
+  string name = "__regex_set_" + lex_cast (temps++) + "_value";
+  if (session.verbose > 2)
+    clog << _F("Fusing %zu regex tests into %s at ", chain.size(), name.c_str())
+         << *set->tok << endl;
+
+  vardecl* v = new vardecl;
+  v->unmangled_name = v->name = name;
+  v->tok = set->tok;
+  v->set_arity (0, set->tok);
+  v->type = pe_long;
+  locals.push_back (v);
+
+  assignment* a = new assignment;
+  a->tok = set->tok;
+  a->op = "=";
+  a->left = value (v, set->tok);
+  a->right = set;
+  a->type = pe_long;
+
+  expr_statement* es = new expr_statement;
+  es->tok = set->tok;
+  es->value = a;
+
+  for (unsigned i = 0; i < chain.size(); i++)
+    {
+      literal_number* index = new literal_number (i + 1);
+      index->tok = chain[i]->condition->tok;
+      index->type = pe_long;
+
+      comparison* c = new comparison;
+      c->tok = chain[i]->condition->tok;
+      c->op = "==";
+      c->left = value (v, c->tok);
+      c->right = index;
+      c->type = pe_long;
+      chain[i]->condition = c;
+
+      replace (chain[i]->thenblock);
+    }
+  replace (chain.back()->elseblock);
+
+  provide (new block (es, s));
+}
+
+
 // Go through the regex match invocations and generate corresponding DFAs.
 int gen_dfa_table (systemtap_session& s)
 {
+  // Without subexpressions in use, fuse chains of tests first, so
+  // that only the sets get DFAs for their patterns:
+  if (!s.unoptimized && !s.need_tagged_dfa)
+    {
+      for (unsigned i=0; i<s.probes.size(); i++)
+        {
+          regex_set_fuser rsf (s, s.probes[i]->locals);
+          rsf.replace (s.probes[i]->body);
+        }
+
+      for (map<string,functiondecl*>::iterator it = s.functions.begin();
+           it != s.functions.end(); it++)
+        {
+          regex_set_fuser rsf (s, it->second->locals);
+          rsf.replace (it->second->body);
+        }
+    }
+
   regex_collecting_visitor rcv(s);
 
   for (unsigned i=0; i<s.probes.size(); i++)
@@ -2578,6 +2737,32 @@ static void setup_timeout(systemtap_session& s)
   dp->body->visit (&sym);
 }
 
+// Run one step of pass 2, reporting its time with -v like the totals
+// of the passes.
+static int
+semantic_subpass (systemtap_session& s, const char* name,
+                  int (*subpass) (systemtap_session&))
+{
+  struct tms tms_before, tms_after;
+  struct timeval tv_before, tv_after;
+  unsigned _sc_clk_tck = sysconf (_SC_CLK_TCK);
+  times (& tms_before);
+  gettimeofday (&tv_before, NULL);
+
+  int rc = subpass (s);
+
+  times (& tms_after);
+  gettimeofday (&tv_after, NULL);
+  if (s.verbose > 0)
+    clog << _F("Pass 2: %s in %ldusr/%ldsys/%ldreal ms.", name,
+               (long)(tms_after.tms_utime - tms_before.tms_utime) * 1000 / _sc_clk_tck,
+               (long)(tms_after.tms_stime - tms_before.tms_stime) * 1000 / _sc_clk_tck,
+               (long)((tv_after.tv_sec - tv_before.tv_sec) * 1000 +
+                ((long)tv_after.tv_usec - (long)tv_before.tv_usec) / 1000))
+         << endl;
+  return rc;
+}
+
 int
 semantic_pass (systemtap_session& s)
 {
@@ -2599,17 +2784,17 @@ semantic_pass (systemtap_session& s)
       register_standard_tapsets(s);
 
       if (rc == 0) setup_timeout(s);
-      if (rc == 0) rc = semantic_pass_symbols (s);
+      if (rc == 0) rc = semantic_subpass (s, "resolved symbols", semantic_pass_symbols);
       if (rc == 0) monitor_mode_write (s);
-      if (rc == 0) rc = semantic_pass_conditions (s);
-      if (rc == 0) rc = semantic_pass_optimize1 (s);
-      if (rc == 0) rc = semantic_pass_types (s);
-      if (rc == 0) rc = gen_dfa_table(s);
+      if (rc == 0) rc = semantic_subpass (s, "checked conditions", semantic_pass_conditions);
+      if (rc == 0) rc = semantic_subpass (s, "optimized (early)", semantic_pass_optimize1);
+      if (rc == 0) rc = semantic_subpass (s, "inferred types", semantic_pass_types);
+      if (rc == 0) rc = semantic_subpass (s, "compiled regexes", gen_dfa_table);
       if (rc == 0) add_global_var_display (s);
       if (rc == 0) monitor_mode_read(s);
-      if (rc == 0) rc = semantic_pass_optimize2 (s);
-      if (rc == 0) rc = semantic_pass_vars (s);
-      if (rc == 0) rc = semantic_pass_stats (s);
+      if (rc == 0) rc = semantic_subpass (s, "optimized (late)", semantic_pass_optimize2);
+      if (rc == 0) rc = semantic_subpass (s, "checked variables", semantic_pass_vars);
+      if (rc == 0) rc = semantic_subpass (s, "checked statistics", semantic_pass_stats);
       if (rc == 0) embeddedcode_info_pass (s);
     }
   catch (const semantic_error& e)
@@ -3379,104 +3564,512 @@ symresolution_info::collect_functions(void)
 // optimization
 
 
-// Do away with functiondecls that are never (transitively) called
-// from probes.
-//
-// PR24239: this will generally not trigger, since we avoid adding
-// uncalled functions to s.functions[].
-void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
+// Replace calls of small functions by their bodies.  A function
+// qualifies if its body just returns an expression of its parameters,
+// globals, literals and calls of other functions, no bigger than
+// --inline-limit nodes, and it cannot call itself.  The arguments are
+// substituted directly if they are literals or locals, and otherwise
+// evaluated first into new locals of the caller, like the parameters
+// they replace:  f(a, g()) becomes (__inline_N = g(), BODY), with the
+// parameters of BODY replaced by a and __inline_N.
+
+struct inline_checker: public throwing_visitor
 {
-  functioncall_traversing_visitor ftv;
-  for (unsigned i=0; i<s.probes.size(); i++)
-    {
-      s.probes[i]->body->visit (& ftv);
-      if (s.probes[i]->sole_location()->condition)
-        s.probes[i]->sole_location()->condition->visit (& ftv);
-    }
-  vector<functiondecl*> new_unused_functions;
-  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+  functiondecl* fd;
+  const set<vardecl*>& globals;
+  inline_checker(functiondecl* f, const set<vardecl*>& g): fd(f), globals(g) {}
+
+  void check_variable (symbol* e, bool array);
+
+  void visit_literal_string (literal_string*) {}
+  void visit_literal_number (literal_number*) {}
+  void visit_embedded_expr (embedded_expr* e);
+  void visit_binary_expression (binary_expression* e);
+  void visit_unary_expression (unary_expression* e) { e->operand->visit (this); }
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_array_in (array_in* e) { e->operand->visit (this); }
+  void visit_regex_query (regex_query* e) { e->left->visit (this); }
+  void visit_comparison (comparison* e);
+  void visit_concatenation (concatenation* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_symbol (symbol* e) { check_variable (e, false); }
+  void visit_arrayindex (arrayindex* e);
+  void visit_functioncall (functioncall* e);
+  void visit_print_format (print_format* e);
+};
+
+
+void
+inline_checker::check_variable (symbol* e, bool array)
+{
+  if (!e->referent)
+    throwone (e->tok);
+  if (globals.find (e->referent) != globals.end())
+    return;
+  if (array || find (fd->formal_args.begin(), fd->formal_args.end(),
+                     e->referent) == fd->formal_args.end())
+    throwone (e->tok);
+}
+
+
+// Embedded-C may only be moved out of the function if it doesn't refer
+// to the function's own context.
+void
+inline_checker::visit_embedded_expr (embedded_expr* e)
+{
+  string code = e->code;
+  if (!e->tagged_p ("/* pure */")
+      || e->tagged_p ("/* myproc-unprivileged */")
+      || code.find ("STAP_") != string::npos
+      || code.find ("THIS") != string::npos
+      || code.find ("pragma:") != string::npos)
+    throwone (e->tok);
+}
+
+
+void
+inline_checker::visit_binary_expression (binary_expression* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+inline_checker::visit_logical_or_expr (logical_or_expr* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+inline_checker::visit_logical_and_expr (logical_and_expr* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+inline_checker::visit_comparison (comparison* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+inline_checker::visit_concatenation (concatenation* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+inline_checker::visit_ternary_expression (ternary_expression* e)
+{
+  e->cond->visit (this);
+  e->truevalue->visit (this);
+  e->falsevalue->visit (this);
+}
+
+
+void
+inline_checker::visit_arrayindex (arrayindex* e)
+{
+  symbol* sym;
+  if (!e->base->is_symbol (sym))
+    throwone (e->tok);
+  check_variable (sym, true);
+  for (unsigned i = 0; i < e->indexes.size(); i++)
+    if (e->indexes[i])
+      e->indexes[i]->visit (this);
+    else
+      throwone (e->tok);
+}
+
+
+void
+inline_checker::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); i++)
+    e->args[i]->visit (this);
+}
+
+
+void
+inline_checker::visit_print_format (print_format* e)
+{
+  if (e->hist)
+    throwone (e->tok);
+  for (unsigned i = 0; i < e->args.size(); i++)
+    e->args[i]->visit (this);
+}
+
+
+struct inline_size_counter: public expression_visitor
+{
+  unsigned size;
+  inline_size_counter(): size(0) {}
+  void visit_expression (expression*) { size++; }
+};
+
+
+// The type that E evaluates to, if it's plain from its root.
+static exp_type
+inline_result_type (expression* e)
+{
+  if (dynamic_cast<literal_string*>(e) || dynamic_cast<concatenation*>(e))
+    return pe_string;
+  if (dynamic_cast<literal_number*>(e) || dynamic_cast<binary_expression*>(e)
+      || dynamic_cast<unary_expression*>(e) || dynamic_cast<comparison*>(e)
+      || dynamic_cast<array_in*>(e) || dynamic_cast<regex_query*>(e))
+    return pe_long;
+  if (functioncall* fc = dynamic_cast<functioncall*>(e))
+    if (fc->referents.size() == 1)
+      return fc->referents[0]->type;
+  return pe_unknown;
+}
+
+
+// The expression that FD returns, if calls to FD may be replaced by it.
+static expression*
+inlinable_body (systemtap_session& s, functiondecl* fd,
+                const set<vardecl*>& globals)
+{
+  if (fd->has_next)
+    return NULL;
+
+  statement* st = fd->body;
+  block* b;
+  while ((b = dynamic_cast<block*>(st)) && b->statements.size() == 1)
+    st = b->statements[0];
+  return_statement* r = dynamic_cast<return_statement*>(st);
+  if (!r || !r->value)
+    return NULL;
+
+  // Keep the type checking of declared function types.
+  if (fd->type != pe_unknown && inline_result_type (r->value) != fd->type
+      && !dynamic_cast<embedded_expr*>(r->value))
+    return NULL;
+
+  inline_size_counter isc;
+  r->value->visit (&isc);
+  if (isc.size > s.inline_limit)
+    return NULL;
+
+  inline_checker ic (fd, globals);
+  try
     {
-      functiondecl* fd = it->second;
-      if (ftv.seen.find(fd) == ftv.seen.end())
-        {
-          if (! fd->synthetic && !fd->cloned_p && s.is_user_file(fd->tok->location.file->name))
-            s.print_warning (_F("Eliding unused function '%s'",
-                                fd->unmangled_name.to_string().c_str()),
-			     fd->tok);
-          // s.functions.erase (it); // NB: can't, since we're already iterating upon it
-          new_unused_functions.push_back (fd);
-          relaxed_p = false;
-        }
+      r->value->visit (&ic);
     }
-  for (unsigned i=0; i<new_unused_functions.size(); i++)
+  catch (const semantic_error&)
     {
-      map<string,functiondecl*>::iterator where = s.functions.find (new_unused_functions[i]->name);
-      assert (where != s.functions.end());
-      s.functions.erase (where);
-      if (s.tapset_compile_coverage)
-        s.unused_functions.push_back (new_unused_functions[i]);
+      return NULL;
     }
+  return r->value;
 }
 
 
-// ------------------------------------------------------------------------
-
-// Do away with local & global variables that are never
-// written nor read.
-void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations)
+struct inline_substituter: public update_visitor
 {
-  varuse_collecting_visitor vut(s);
+  map<vardecl*, expression*>& values;
+  inline_substituter(map<vardecl*, expression*>& v): values(v) {}
 
-  for (unsigned i=0; i<s.probes.size(); i++)
+  void visit_symbol (symbol* e)
     {
-      s.probes[i]->body->visit (& vut);
-
-      if (s.probes[i]->sole_location()->condition)
-        s.probes[i]->sole_location()->condition->visit (& vut);
+      map<vardecl*, expression*>::iterator it = values.find (e->referent);
+      if (it != values.end())
+        provide (deep_copy_visitor::deep_copy (it->second));
+      else
+        provide (e);
     }
+};
 
-  // NB: Since varuse_collecting_visitor also traverses down
-  // actually called functions, we don't need to explicitly
-  // iterate over them.  Uncalled ones should have been pruned
-  // in _opt1 above.
-  //
-  // for (unsigned i=0; i<s.functions.size(); i++)
-  //   s.functions[i]->body->visit (& vut);
 
-  // Now in vut.read/written, we have a mixture of all locals, globals
+struct inline_use_counter: public traversing_visitor
+{
+  map<vardecl*, unsigned> uses;
+  void visit_symbol (symbol* e) { uses[e->referent]++; }
+};
 
-  for (unsigned i=0; i<s.probes.size(); i++)
-    for (unsigned j=0; j<s.probes[i]->locals.size(); /* see below */)
-      {
-        vardecl* l = s.probes[i]->locals[j];
 
-        // skip over "special" locals
-        if (l->synthetic) { j++; continue; }
+struct function_inliner: public update_visitor
+{
+  systemtap_session& session;
+  map<functiondecl*, expression*>& bodies;
+  const set<vardecl*>& globals;
+  vector<vardecl*>& locals;
 
-        if (vut.read.find (l) == vut.read.end() &&
-            vut.written.find (l) == vut.written.end())
-          {
-            if (!l->tok->location.file->synthetic && s.is_user_file(l->tok->location.file->name))
-              s.print_warning (_F("Eliding unused variable '%s'",
-                                  l->unmangled_name.to_string().c_str()),
-			       l->tok);
-	    if (s.tapset_compile_coverage) {
-	      s.probes[i]->unused_locals.push_back
-		      (s.probes[i]->locals[j]);
-	    }
-            s.probes[i]->locals.erase(s.probes[i]->locals.begin() + j);
-            relaxed_p = false;
-            // don't increment j
-          }
-        else
-          {
-            if (vut.written.find (l) == vut.written.end())
-              if (iterations == 0 && ! s.suppress_warnings)
-                {
-                  set<string> vars;
+  function_inliner(systemtap_session& s, map<functiondecl*, expression*>& b,
+                   const set<vardecl*>& g, vector<vardecl*>& l):
+    update_visitor(s.verbose), session(s), bodies(b), globals(g), locals(l) {}
 
-                  // like collect_functions()
-                  vector<vardecl*>::iterator it;
+  bool direct_p (functioncall* e, unsigned i, vardecl* formal);
+  void visit_functioncall (functioncall* e);
+};
+
+
+// Whether argument I of E may be substituted for FORMAL in place:
+// neither the later arguments nor the body can change it, and there's
+// no declared type to check.
+bool
+function_inliner::direct_p (functioncall* e, unsigned i, vardecl* formal)
+{
+  expression* arg = e->args[i];
+  if (dynamic_cast<literal_number*>(arg))
+    return formal->type == pe_unknown || formal->type == pe_long;
+  if (dynamic_cast<literal_string*>(arg))
+    return formal->type == pe_unknown || formal->type == pe_string;
+  symbol* sym;
+  if (formal->type != pe_unknown
+      || !arg->is_symbol (sym) || !sym->referent
+      || globals.find (sym->referent) != globals.end())
+    return false;
+
+  // e.g. f(x, x++) must pass the old x.
+  varuse_collecting_visitor vut (session);
+  for (unsigned j = i + 1; j < e->args.size(); j++)
+    e->args[j]->visit (&vut);
+  return vut.written.find (sym->referent) == vut.written.end();
+}
+
+
+void
+function_inliner::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); i++)
+    replace (e->args[i]);
+
+  map<functiondecl*, expression*>::iterator it;
+  if (e->referents.size() != 1
+      || (it = bodies.find (e->referents[0])) == bodies.end()
+      || e->args.size() != e->referents[0]->formal_args.size())
+    {
+      provide (e);
+      return;
+    }
+
+  static unsigned counter;
+  functiondecl* fd = e->referents[0];
+  if (session.verbose > 2)
+    clog << _F("Inlining function '%s' ", fd->unmangled_name.to_string().c_str())
+         << *e->tok << endl;
+  fd->inlined = true;
+
+  inline_use_counter iuc;
+  it->second->visit (&iuc);
+
+  map<vardecl*, expression*> values;
+  vector<expression*> inits;
+  for (unsigned i = 0; i < e->args.size(); i++)
+    {
+      vardecl* formal = fd->formal_args[i];
+      if (direct_p (e, i, formal))
+        {
+          values[formal] = e->args[i];
+          continue;
+        }
+      if (iuc.uses[formal] == 0)
+        {
+          // Evaluate it just for its side effects.
+          inits.push_back (e->args[i]);
+          continue;
+        }
+
+      vardecl* v = new vardecl;
+      v->unmangled_name = v->name = "__inline_" + lex_cast (counter++);
+      v->tok = e->args[i]->tok;
+      v->set_arity (0, v->tok);
+      v->type = formal->type;
+      locals.push_back (v);
+
+      symbol* sym = new symbol;
+      sym->name = v->name;
+      sym->tok = v->tok;
+      sym->referent = v;
+      values[formal] = sym;
+
+      assignment* a = new assignment;
+      a->tok = v->tok;
+      a->op = "=";
+      a->left = deep_copy_visitor::deep_copy (sym);
+      a->right = e->args[i];
+      inits.push_back (a);
+    }
+
+  expression* result = deep_copy_visitor::deep_copy (it->second);
+  inline_substituter is (values);
+  is.replace (result);
+
+  while (!inits.empty())
+    {
+      compound_expression* ce = new compound_expression;
+      ce->tok = e->tok;
+      ce->left = inits.back();
+      ce->right = result;
+      result = ce;
+      inits.pop_back();
+    }
+
+  provide (result);
+}
+
+
+void semantic_pass_inline (systemtap_session& s, bool& relaxed_p)
+{
+  if (s.inline_limit == 0)
+    return;
+
+  set<vardecl*> globals (s.globals.begin(), s.globals.end());
+
+  // Find the functions that can (transitively) call themselves.
+  map<functiondecl*, set<functiondecl*> > callees;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); ++it)
+    {
+      functioncall_traversing_visitor ftv;
+      it->second->body->visit (&ftv);
+      callees[it->second] = ftv.seen;
+    }
+
+  map<functiondecl*, expression*> bodies;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); ++it)
+    {
+      functiondecl* fd = it->second;
+      if (callees[fd].find (fd) != callees[fd].end())
+        continue;
+      expression* body = inlinable_body (s, fd, globals);
+      if (body)
+        bodies[fd] = body;
+    }
+  if (bodies.empty())
+    return;
+
+  for (unsigned i = 0; i < s.probes.size(); i++)
+    {
+      derived_probe* p = s.probes[i];
+      function_inliner fi (s, bodies, globals, p->locals);
+      fi.replace (p->body);
+      if (!fi.relaxed())
+        relaxed_p = false;
+    }
+
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); ++it)
+    {
+      functiondecl* fd = it->second;
+      function_inliner fi (s, bodies, globals, fd->locals);
+      fi.replace (fd->body);
+      if (!fi.relaxed())
+        relaxed_p = false;
+    }
+}
+
+
+// Do away with functiondecls that are never (transitively) called
+// from probes.
+//
+// PR24239: this will generally not trigger, since we avoid adding
+// uncalled functions to s.functions[].
+void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
+{
+  functioncall_traversing_visitor ftv;
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      s.probes[i]->body->visit (& ftv);
+      if (s.probes[i]->sole_location()->condition)
+        s.probes[i]->sole_location()->condition->visit (& ftv);
+    }
+  vector<functiondecl*> new_unused_functions;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
+    {
+      functiondecl* fd = it->second;
+      if (ftv.seen.find(fd) == ftv.seen.end())
+        {
+          if (! fd->synthetic && !fd->cloned_p && !fd->inlined
+              && s.is_user_file(fd->tok->location.file->name))
+            s.print_warning (_F("Eliding unused function '%s'",
+                                fd->unmangled_name.to_string().c_str()),
+			     fd->tok);
+          // s.functions.erase (it); // NB: can't, since we're already iterating upon it
+          new_unused_functions.push_back (fd);
+          relaxed_p = false;
+        }
+    }
+  for (unsigned i=0; i<new_unused_functions.size(); i++)
+    {
+      map<string,functiondecl*>::iterator where = s.functions.find (new_unused_functions[i]->name);
+      assert (where != s.functions.end());
+      s.functions.erase (where);
+      if (s.tapset_compile_coverage)
+        s.unused_functions.push_back (new_unused_functions[i]);
+    }
+}
+
+
+// ------------------------------------------------------------------------
+
+// Do away with local & global variables that are never
+// written nor read.
+void semantic_pass_opt2 (systemtap_session& s, bool& relaxed_p, unsigned iterations)
+{
+  varuse_collecting_visitor vut(s);
+
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      s.probes[i]->body->visit (& vut);
+
+      if (s.probes[i]->sole_location()->condition)
+        s.probes[i]->sole_location()->condition->visit (& vut);
+    }
+
+  // NB: Since varuse_collecting_visitor also traverses down
+  // actually called functions, we don't need to explicitly
+  // iterate over them.  Uncalled ones should have been pruned
+  // in _opt1 above.
+  //
+  // for (unsigned i=0; i<s.functions.size(); i++)
+  //   s.functions[i]->body->visit (& vut);
+
+  // Now in vut.read/written, we have a mixture of all locals, globals
+
+  for (unsigned i=0; i<s.probes.size(); i++)
+    for (unsigned j=0; j<s.probes[i]->locals.size(); /* see below */)
+      {
+        vardecl* l = s.probes[i]->locals[j];
+
+        // skip over "special" locals
+        if (l->synthetic) { j++; continue; }
+
+        if (vut.read.find (l) == vut.read.end() &&
+            vut.written.find (l) == vut.written.end())
+          {
+            if (!l->tok->location.file->synthetic && s.is_user_file(l->tok->location.file->name))
+              s.print_warning (_F("Eliding unused variable '%s'",
+                                  l->unmangled_name.to_string().c_str()),
+			       l->tok);
+	    if (s.tapset_compile_coverage) {
+	      s.probes[i]->unused_locals.push_back
+		      (s.probes[i]->locals[j]);
+	    }
+            s.probes[i]->locals.erase(s.probes[i]->locals.begin() + j);
+            relaxed_p = false;
+            // don't increment j
+          }
+        else
+          {
+            if (vut.written.find (l) == vut.written.end())
+              if (iterations == 0 && ! s.suppress_warnings)
+                {
+                  set<string> vars;
+
+                  // like collect_functions()
+                  vector<vardecl*>::iterator it;
                   for (it = s.probes[i]->locals.begin(); it != s.probes[i]->locals.end(); it++)
                     vars.insert((*it)->unmangled_name);
                   for (it = s.globals.begin(); it != s.globals.end(); it++)
@@ -5744,6 +6337,55 @@ void stable_functioncall_visitor::visit_functioncall (functioncall* e)
   provide(e);
 }
 
+// Run WORK on every probe, spreading the probes over a few threads.
+// A unit of work may only rewrite its own probe's body and locals,
+// and must log to the stream it is given rather than to clog.  The
+// logs and any exception are then replayed in probe order, so the
+// output doesn't depend on how the threads were scheduled.
+template <typename Work> static void
+for_each_probe_parallel (systemtap_session& s, Work work)
+{
+  const size_t n = s.probes.size();
+  const size_t min_per_thread = 64; // not worth a thread below that
+  size_t nthreads = thread::hardware_concurrency();
+  nthreads = max<size_t> (1, min (nthreads, n / min_per_thread));
+
+  vector<string> logs (n);
+  vector<exception_ptr> errors (n);
+  auto run = [&] (size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      try
+        {
+          ostringstream log;
+          work (s.probes[i], log);
+          logs[i] = log.str();
+        }
+      catch (...)
+        {
+          errors[i] = current_exception();
+        }
+  };
+
+  if (nthreads == 1)
+    run (0, n);
+  else
+    {
+      vector<thread> workers;
+      for (size_t t = 0; t < nthreads; ++t)
+        workers.push_back (thread (run, t * n / nthreads, (t + 1) * n / nthreads));
+      for (size_t t = 0; t < nthreads; ++t)
+        workers[t].join();
+    }
+
+  for (size_t i = 0; i < n; ++i)
+    {
+      clog << logs[i];
+      if (errors[i])
+        rethrow_exception (errors[i]);
+    }
+  assert_no_interrupts();
+}
+
 // Cache stable embedded-c functioncall results and replace
 // all calls with same name using that value to reduce duplicate
 // functioncall overhead. Functioncalls are pulled out of any
@@ -5761,18 +6403,16 @@ void semantic_pass_opt7(systemtap_session& s)
         stable_fcs.insert(fn->name);
     }
 
-  for (vector<derived_probe*>::iterator it = s.probes.begin();
-       it != s.probes.end(); ++it)
-    {
+  for_each_probe_parallel (s, [&] (derived_probe* p, ostream&) {
       stable_functioncall_visitor t(s, stable_fcs);
-      t.current_probe = *it;
-      (*it)->body = t.convert_stmt((*it)->body);
-      t.replace((*it)->body);
+      t.current_probe = p;
+      p->body = t.convert_stmt(p->body);
+      t.replace(p->body);
 
       for (vector<pair<expr_statement*,block*> >::iterator st = t.new_stmts.begin();
            st != t.new_stmts.end(); ++st)
         st->second->statements.insert(st->second->statements.begin(), st->first);
-    }
+    });
 
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); ++it)
@@ -5789,53 +6429,884 @@ void semantic_pass_opt7(systemtap_session& s)
     }
 }
 
-static int
-semantic_pass_optimize1 (systemtap_session& s)
-{
-  // In this pass, we attempt to rewrite probe/function bodies to
-  // eliminate some blatantly unnecessary code.  This is run before
-  // type inference, but after symbol resolution and derived_probe
-  // creation.  We run an outer "relaxation" loop that repeats the
-  // optimizations until none of them find anything to remove.
+// ------------------------------------------------------------------------
+// Common subexpression elimination.
+//
+// Calls of side-effect-free functions whose value only depends on their
+// arguments during a probe hit: /* stable */ embedded-C functions, and
+// script functions that merely compute an expression of such calls,
+// @const()s, target memory and register reads (the $var->a->b
+// dereference functions), literals and their parameters.  A call that
+// is evaluated unconditionally and appears again later in the body is
+// computed into a new local, which the later occurrences then read
+// until a variable it depends on is assigned.  Reads of target memory
+// are also dropped by any other function call or embedded-C, which
+// might write that memory.  Calls that cannot fail are hoisted out of
+// for and foreach loops that don't change their arguments.
+
+enum cse_level { cse_none, cse_fallible, cse_safe };
+
+struct cse_classifier: public throwing_visitor
+{
+  map<functiondecl*, cse_level>& functions;
+  const set<vardecl*>& vars; // the scalar locals an expression may read
+  bool function_body;
+  cse_level level;
+  set<vardecl*> deps;
+
+  cse_classifier(map<functiondecl*, cse_level>& f, const set<vardecl*>& v,
+                 bool fb = false):
+    functions(f), vars(v), function_body(fb), level(cse_safe) {}
+
+  cse_level classify (visitable* e);
 
-  int rc = 0;
+  void visit_block (block *s);
+  void visit_expr_statement (expr_statement *s);
+  void visit_return_statement (return_statement* s);
+  void visit_literal_string (literal_string*) {}
+  void visit_literal_number (literal_number*) {}
+  void visit_embedded_expr (embedded_expr* e);
+  void visit_binary_expression (binary_expression* e);
+  void visit_unary_expression (unary_expression* e) { e->operand->visit (this); }
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_comparison (comparison* e);
+  void visit_concatenation (concatenation* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_assignment (assignment* e);
+  void visit_symbol (symbol* e);
+  void visit_target_register (target_register*) { level = min (level, cse_fallible); }
+  void visit_target_deref (target_deref* e);
+  void visit_target_bitfield (target_bitfield* e) { e->base->visit (this); }
+  void visit_functioncall (functioncall* e);
+};
 
-  bool relaxed_p = false;
-  unsigned iterations = 0;
-  while (! relaxed_p)
+
+cse_level
+cse_classifier::classify (visitable* e)
+{
+  try
     {
-      // Save the old value of suppress_warnings, as we will be changing
-      // it below.
-      save_and_restore<bool> suppress_warnings(& s.suppress_warnings);
+      e->visit (this);
+    }
+  catch (const semantic_error&)
+    {
+      level = cse_none;
+    }
+  return level;
+}
 
-      assert_no_interrupts();
 
-      relaxed_p = true; // until proven otherwise
+// Function bodies may compute their value in steps, through locals.
+void
+cse_classifier::visit_block (block *s)
+{
+  if (!function_body)
+    throwone (s->tok);
+  for (unsigned i = 0; i < s->statements.size(); i++)
+    s->statements[i]->visit (this);
+}
 
-      // If the verbosity is high enough, always print warnings (overrides -w),
-      // or if not, always suppress warnings for every itteration after the first.
-      if(s.verbose > 2)
-        s.suppress_warnings = false;
-      else if (iterations > 0)
-        s.suppress_warnings = true;
 
-      if (s.unoptimized && ! s.dump_mode) // need these even in -u mode
-        {
-          semantic_pass_opt1 (s, relaxed_p);
-          semantic_pass_opt5 (s, relaxed_p);
-          semantic_pass_dead_control (s, relaxed_p);
-        }
-      if (!s.unoptimized)
-        {
-          semantic_pass_opt1 (s, relaxed_p);
-          semantic_pass_opt2 (s, relaxed_p, iterations); // produce some warnings only on iteration=0
-          semantic_pass_opt3 (s, relaxed_p);
-          semantic_pass_opt4 (s, relaxed_p);
-          semantic_pass_opt5 (s, relaxed_p);
-        }
+void
+cse_classifier::visit_expr_statement (expr_statement *s)
+{
+  if (!function_body || !dynamic_cast<assignment*>(s->value))
+    throwone (s->tok);
+  s->value->visit (this);
+}
 
-      // For listing mode, we need const-folding regardless of optimization so
-      // that @defined expressions can be properly resolved.  PR11360
+
+void
+cse_classifier::visit_return_statement (return_statement* s)
+{
+  if (!function_body)
+    throwone (s->tok);
+  s->value->visit (this);
+}
+
+
+void
+cse_classifier::visit_embedded_expr (embedded_expr* e)
+{
+  if (!e->tagged_p ("/* pure */") || !e->tagged_p ("/* stable */"))
+    throwone (e->tok);
+}
+
+
+void
+cse_classifier::visit_binary_expression (binary_expression* e)
+{
+  // Division checks for zero, which would be an error.
+  if (e->op == "/" || e->op == "%")
+    level = min (level, cse_fallible);
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+cse_classifier::visit_logical_or_expr (logical_or_expr* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+cse_classifier::visit_logical_and_expr (logical_and_expr* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+cse_classifier::visit_comparison (comparison* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+cse_classifier::visit_concatenation (concatenation* e)
+{
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+cse_classifier::visit_ternary_expression (ternary_expression* e)
+{
+  e->cond->visit (this);
+  e->truevalue->visit (this);
+  e->falsevalue->visit (this);
+}
+
+
+void
+cse_classifier::visit_assignment (assignment* e)
+{
+  symbol* sym;
+  if (!function_body || e->op != "=" || !e->left->is_symbol (sym))
+    throwone (e->tok);
+  e->left->visit (this);
+  e->right->visit (this);
+}
+
+
+void
+cse_classifier::visit_symbol (symbol* e)
+{
+  if (!e->referent || e->referent->arity != 0
+      || (e->type != pe_long && e->type != pe_string)
+      || vars.find (e->referent) == vars.end())
+    throwone (e->tok);
+  deps.insert (e->referent);
+}
+
+
+void
+cse_classifier::visit_target_deref (target_deref* e)
+{
+  level = min (level, cse_fallible);
+  e->addr->visit (this);
+}
+
+
+void
+cse_classifier::visit_functioncall (functioncall* e)
+{
+  if (e->referents.size() != 1
+      || (e->type != pe_long && e->type != pe_string))
+    throwone (e->tok);
+  map<functiondecl*, cse_level>::iterator it = functions.find (e->referents[0]);
+  if (it == functions.end() || it->second == cse_none)
+    throwone (e->tok);
+  level = min (level, it->second);
+  for (unsigned i = 0; i < e->args.size(); i++)
+    e->args[i]->visit (this);
+}
+
+
+// The scalar locals that a statement or expression assigns, and whether
+// it might write target memory.
+struct cse_kill_finder: public traversing_visitor
+{
+  map<functiondecl*, cse_level>& functions;
+  symbol* spared; // an assignment target whose value is read first
+  set<vardecl*> kills;
+  bool impure;
+
+  cse_kill_finder(map<functiondecl*, cse_level>& f, symbol* s = NULL):
+    functions(f), spared(s), impure(false) {}
+
+  void kill (expression* e);
+
+  void visit_try_block (try_block *s);
+  void visit_embeddedcode (embeddedcode *s);
+  void visit_foreach_loop (foreach_loop* s);
+  void visit_delete_statement (delete_statement* s);
+  void visit_embedded_expr (embedded_expr* e);
+  void visit_pre_crement (pre_crement* e);
+  void visit_post_crement (post_crement* e);
+  void visit_assignment (assignment* e);
+  void visit_functioncall (functioncall* e);
+};
+
+
+void
+cse_kill_finder::kill (expression* e)
+{
+  symbol* sym;
+  if (e && e->is_symbol (sym) && sym != spared && sym->referent)
+    kills.insert (sym->referent);
+}
+
+
+void
+cse_kill_finder::visit_try_block (try_block *s)
+{
+  kill (s->catch_error_var);
+  traversing_visitor::visit_try_block (s);
+}
+
+
+void
+cse_kill_finder::visit_embeddedcode (embeddedcode *s)
+{
+  impure = true;
+  traversing_visitor::visit_embeddedcode (s);
+}
+
+
+void
+cse_kill_finder::visit_foreach_loop (foreach_loop* s)
+{
+  for (unsigned i = 0; i < s->indexes.size(); i++)
+    kill (s->indexes[i]);
+  kill (s->value);
+  traversing_visitor::visit_foreach_loop (s);
+}
+
+
+void
+cse_kill_finder::visit_delete_statement (delete_statement* s)
+{
+  kill (s->value);
+  traversing_visitor::visit_delete_statement (s);
+}
+
+
+void
+cse_kill_finder::visit_embedded_expr (embedded_expr* e)
+{
+  if (!e->tagged_p ("/* pure */"))
+    impure = true;
+  traversing_visitor::visit_embedded_expr (e);
+}
+
+
+void
+cse_kill_finder::visit_pre_crement (pre_crement* e)
+{
+  kill (e->operand);
+  traversing_visitor::visit_pre_crement (e);
+}
+
+
+void
+cse_kill_finder::visit_post_crement (post_crement* e)
+{
+  kill (e->operand);
+  traversing_visitor::visit_post_crement (e);
+}
+
+
+void
+cse_kill_finder::visit_assignment (assignment* e)
+{
+  kill (e->left);
+  traversing_visitor::visit_assignment (e);
+}
+
+
+void
+cse_kill_finder::visit_functioncall (functioncall* e)
+{
+  map<functiondecl*, cse_level>::const_iterator it;
+  if (e->referents.size() != 1
+      || (it = functions.find (e->referents[0])) == functions.end()
+      || it->second == cse_none)
+    impure = true;
+  traversing_visitor::visit_functioncall (e);
+}
+
+
+struct cse_value
+{
+  vardecl* var;
+  cse_level level;
+  set<vardecl*> deps;
+};
+
+
+struct cse_optimizer: public update_visitor
+{
+  systemtap_session& session;
+  map<functiondecl*, cse_level>& functions;
+  set<vardecl*> vars;
+  vector<vardecl*>& locals;
+  ostream& log;
+  map<string, unsigned> uses; // how often each candidate call appears
+  map<string, cse_value> available;
+  unsigned temps;
+
+  // The expression being rewritten.
+  vector<statement*>* hoisted; // where new assignments go, or NULL
+  set<vardecl*> slot_kills;
+  bool slot_impure;
+  unsigned conditional;
+
+  cse_optimizer(systemtap_session& s, map<functiondecl*, cse_level>& f,
+                vector<vardecl*>& l, ostream& o):
+    update_visitor(s.verbose), session(s), functions(f), locals(l), log(o),
+    temps(0), hoisted(NULL), slot_impure(false), conditional(0) {}
+
+  cse_level classify (expression* e, set<vardecl*>& deps, string& key);
+  void count_uses (statement* s);
+  void kill (const set<vardecl*>& kills, bool impure);
+  void kill_in (visitable* v);
+  symbol* cached (vardecl* v, const token* tok);
+  vardecl* cache (functioncall* e, const string& key, cse_level level,
+                  const set<vardecl*>& deps, vector<statement*>& out);
+  void optimize_expr (expression*& e, visitable* scope, symbol* spared,
+                      vector<statement*>* out);
+  void hoist_invariants (statement* loop, const set<vardecl*>& kills,
+                         vector<statement*>& out);
+  void optimize_stmt (statement* s, vector<statement*>& out);
+  void optimize_child (statement*& s);
+  void optimize_block (block* b);
+  void optimize_body (statement*& body);
+
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_functioncall (functioncall* e);
+};
+
+
+cse_level
+cse_optimizer::classify (expression* e, set<vardecl*>& deps, string& key)
+{
+  cse_classifier cc (functions, vars);
+  if (cc.classify (e) == cse_none)
+    return cse_none;
+  deps.swap (cc.deps);
+  ostringstream o;
+  e->print (o);
+  key = o.str();
+  return cc.level;
+}
+
+
+struct cse_use_counter: public traversing_visitor
+{
+  cse_optimizer& cse;
+  cse_use_counter(cse_optimizer& c): cse(c) {}
+
+  void visit_functioncall (functioncall* e)
+    {
+      set<vardecl*> deps;
+      string key;
+      if (cse.classify (e, deps, key) != cse_none)
+        cse.uses[key]++;
+      traversing_visitor::visit_functioncall (e);
+    }
+};
+
+
+void
+cse_optimizer::count_uses (statement* s)
+{
+  cse_use_counter cuc (*this);
+  s->visit (&cuc);
+}
+
+
+// Forget the values that depend on KILLS, or on target memory if IMPURE.
+void
+cse_optimizer::kill (const set<vardecl*>& kills, bool impure)
+{
+  map<string, cse_value>::iterator it = available.begin();
+  while (it != available.end())
+    {
+      bool dead = impure && it->second.level == cse_fallible;
+      for (set<vardecl*>::const_iterator d = it->second.deps.begin();
+           !dead && d != it->second.deps.end(); ++d)
+        dead = kills.find (*d) != kills.end();
+      if (dead)
+        available.erase (it++);
+      else
+        ++it;
+    }
+}
+
+
+void
+cse_optimizer::kill_in (visitable* v)
+{
+  if (!v)
+    return;
+  cse_kill_finder ckf (functions);
+  v->visit (&ckf);
+  kill (ckf.kills, ckf.impure);
+}
+
+
+symbol*
+cse_optimizer::cached (vardecl* v, const token* tok)
+{
+  symbol* sym = new symbol;
+  sym->name = v->name;
+  sym->tok = tok;
+  sym->referent = v;
+  sym->type = v->type;
+  sym->type_details = v->type_details;
+  return sym;
+}
+
+
+// Compute E into a new local before the current statement.
+vardecl*
+cse_optimizer::cache (functioncall* e, const string& key, cse_level level,
+                      const set<vardecl*>& deps, vector<statement*>& out)
+{
+  string name = "__cse_" + lex_cast (temps++) + "_value";
+  if (session.verbose > 2)
+    log << _F("Caching %s in %s", key.c_str(), name.c_str()) << endl;
+
+  vardecl* v = new vardecl;
+  v->unmangled_name = v->name = name;
+  v->tok = e->tok;
+  v->set_arity (0, e->tok);
+  v->type = e->type;
+  v->type_details = e->type_details;
+  locals.push_back (v);
+  vars.insert (v);
+
+  assignment* a = new assignment;
+  a->tok = e->tok;
+  a->op = "=";
+  a->left = cached (v, e->tok);
+  a->right = e;
+  a->type = e->type;
+  a->type_details = e->type_details;
+
+  expr_statement* es = new expr_statement;
+  es->tok = e->tok;
+  es->value = a;
+  out.push_back (es);
+
+  cse_value& cv = available[key];
+  cv.var = v;
+  cv.level = level;
+  cv.deps = deps;
+  return v;
+}
+
+
+void
+cse_optimizer::visit_logical_or_expr (logical_or_expr* e)
+{
+  replace (e->left);
+  conditional++;
+  replace (e->right);
+  conditional--;
+  provide (e);
+}
+
+
+void
+cse_optimizer::visit_logical_and_expr (logical_and_expr* e)
+{
+  replace (e->left);
+  conditional++;
+  replace (e->right);
+  conditional--;
+  provide (e);
+}
+
+
+void
+cse_optimizer::visit_ternary_expression (ternary_expression* e)
+{
+  replace (e->cond);
+  conditional++;
+  replace (e->truevalue);
+  replace (e->falsevalue);
+  conditional--;
+  provide (e);
+}
+
+
+void
+cse_optimizer::visit_functioncall (functioncall* e)
+{
+  set<vardecl*> deps;
+  string key;
+  cse_level level = classify (e, deps, key);
+  if (level == cse_none)
+    {
+      update_visitor::visit_functioncall (e);
+      return;
+    }
+
+  map<string, cse_value>::iterator it = available.find (key);
+  if (it != available.end())
+    {
+      provide (cached (it->second.var, e->tok));
+      return;
+    }
+
+  for (unsigned i = 0; i < e->args.size(); i++)
+    replace (e->args[i]);
+
+  // Compute it ahead of the statement if that's where it would have
+  // been anyway, and it's needed again later.
+  bool hoist = hoisted && !conditional && uses[key] > 1
+    && !(level == cse_fallible && slot_impure);
+  for (set<vardecl*>::iterator d = deps.begin(); hoist && d != deps.end(); ++d)
+    hoist = slot_kills.find (*d) == slot_kills.end();
+  if (hoist)
+    provide (cached (cache (e, key, level, deps, *hoisted), e->tok));
+  else
+    provide (e);
+}
+
+
+// Rewrite the expression E, evaluated as a whole at the statement level:
+// reuse the values available, and compute those needed later into OUT,
+// unless it's NULL.  SCOPE is where E's own assignments are, except that
+// to SPARED, which only happens after E's value is known.
+void
+cse_optimizer::optimize_expr (expression*& e, visitable* scope, symbol* spared,
+                              vector<statement*>* out)
+{
+  cse_kill_finder ckf (functions, spared);
+  scope->visit (&ckf);
+  kill (ckf.kills, ckf.impure);
+
+  hoisted = out;
+  slot_kills = ckf.kills;
+  slot_impure = ckf.impure;
+  replace (e);
+  hoisted = NULL;
+
+  if (spared && spared->referent)
+    ckf.kills.insert (spared->referent);
+  kill (ckf.kills, ckf.impure);
+}
+
+
+struct cse_invariant_finder: public traversing_visitor
+{
+  cse_optimizer& cse;
+  const set<vardecl*>& kills;
+  map<string, functioncall*> invariants;
+  vector<string> order;
+
+  cse_invariant_finder(cse_optimizer& c, const set<vardecl*>& k):
+    cse(c), kills(k) {}
+
+  void visit_functioncall (functioncall* e)
+    {
+      set<vardecl*> deps;
+      string key;
+      if (cse.classify (e, deps, key) == cse_safe
+          && cse.available.find (key) == cse.available.end())
+        {
+          bool invariant = true;
+          for (set<vardecl*>::iterator d = deps.begin();
+               invariant && d != deps.end(); ++d)
+            invariant = kills.find (*d) == kills.end();
+          if (invariant)
+            {
+              if (invariants.insert (make_pair (key, e)).second)
+                order.push_back (key);
+              return;
+            }
+        }
+      traversing_visitor::visit_functioncall (e);
+    }
+};
+
+
+// Compute the calls in LOOP that cannot fail and don't depend on its
+// KILLS into OUT, ahead of the loop.
+void
+cse_optimizer::hoist_invariants (statement* loop, const set<vardecl*>& kills,
+                                 vector<statement*>& out)
+{
+  cse_invariant_finder cif (*this, kills);
+  if (for_loop* f = dynamic_cast<for_loop*>(loop))
+    {
+      if (f->cond)
+        f->cond->visit (&cif);
+      if (f->incr)
+        f->incr->visit (&cif);
+      f->block->visit (&cif);
+    }
+  else if (foreach_loop* f = dynamic_cast<foreach_loop*>(loop))
+    f->block->visit (&cif);
+
+  for (unsigned i = 0; i < cif.order.size(); i++)
+    {
+      functioncall* e = deep_copy_visitor::deep_copy (cif.invariants[cif.order[i]]);
+      for (unsigned j = 0; j < e->args.size(); j++)
+        optimize_expr (e->args[j], e->args[j], NULL, NULL);
+
+      set<vardecl*> deps;
+      string key;
+      classify (cif.invariants[cif.order[i]], deps, key);
+      cache (e, key, cse_safe, deps, out);
+    }
+}
+
+
+void
+cse_optimizer::optimize_stmt (statement* s, vector<statement*>& out)
+{
+  if (block* b = dynamic_cast<block*>(s))
+    optimize_block (b);
+
+  else if (expr_statement* es = dynamic_cast<expr_statement*>(s))
+    {
+      // This includes return and delete statements.
+      symbol* spared = NULL;
+      if (assignment* a = dynamic_cast<assignment*>(es->value))
+        a->left->is_symbol (spared);
+      optimize_expr (es->value, es, spared, &out);
+    }
+
+  else if (if_statement* ifs = dynamic_cast<if_statement*>(s))
+    {
+      optimize_expr (ifs->condition, ifs->condition, NULL, &out);
+      map<string, cse_value> saved = available;
+      optimize_child (ifs->thenblock);
+      available = saved;
+      if (ifs->elseblock)
+        optimize_child (ifs->elseblock);
+      available = saved;
+      kill_in (ifs);
+    }
+
+  else if (try_block* t = dynamic_cast<try_block*>(s))
+    {
+      // The try block may be left anywhere.
+      map<string, cse_value> saved = available;
+      if (t->try_block)
+        optimize_child (t->try_block);
+      available = saved;
+      kill_in (t);
+      saved = available;
+      if (t->catch_block)
+        optimize_child (t->catch_block);
+      available = saved;
+    }
+
+  else if (for_loop* f = dynamic_cast<for_loop*>(s))
+    {
+      cse_kill_finder ckf (functions);
+      f->visit (&ckf);
+
+      if (f->init)
+        {
+          symbol* spared = NULL;
+          if (assignment* a = dynamic_cast<assignment*>(f->init->value))
+            a->left->is_symbol (spared);
+          optimize_expr (f->init->value, f->init, spared, &out);
+        }
+
+      // Only what no iteration changes is available inside.
+      kill (ckf.kills, ckf.impure);
+      hoist_invariants (f, ckf.kills, out);
+      if (f->cond)
+        optimize_expr (f->cond, f->cond, NULL, NULL);
+      if (f->incr)
+        optimize_expr (f->incr->value, f->incr, NULL, NULL);
+      map<string, cse_value> saved = available;
+      optimize_child (f->block);
+      available = saved;
+    }
+
+  else if (foreach_loop* f = dynamic_cast<foreach_loop*>(s))
+    {
+      cse_kill_finder ckf (functions);
+      f->visit (&ckf);
+
+      for (unsigned i = 0; i < f->array_slice.size(); i++)
+        if (f->array_slice[i]) // NULL for a wildcard
+          optimize_expr (f->array_slice[i], f->array_slice[i], NULL, &out);
+      if (f->limit)
+        optimize_expr (f->limit, f->limit, NULL, &out);
+
+      kill (ckf.kills, ckf.impure);
+      hoist_invariants (f, ckf.kills, out);
+      map<string, cse_value> saved = available;
+      optimize_child (f->block);
+      available = saved;
+    }
+
+  else
+    kill_in (s);
+
+  out.push_back (s);
+}
+
+
+void
+cse_optimizer::optimize_child (statement*& s)
+{
+  vector<statement*> out;
+  optimize_stmt (s, out);
+  if (out.size() > 1)
+    {
+      block* b = new block;
+      b->tok = s->tok;
+      b->statements = out;
+      s = b;
+    }
+}
+
+
+void
+cse_optimizer::optimize_block (block* b)
+{
+  vector<statement*> out;
+  for (unsigned i = 0; i < b->statements.size(); i++)
+    optimize_stmt (b->statements[i], out);
+  b->statements = out;
+}
+
+
+void
+cse_optimizer::optimize_body (statement*& body)
+{
+  count_uses (body);
+  optimize_child (body);
+}
+
+
+static void
+semantic_pass_cse (systemtap_session& s)
+{
+  // Find out which functions qualify, repeating as long as callers of
+  // newly qualified functions may qualify in turn.
+  map<functiondecl*, cse_level> functions;
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); ++it)
+    functions[it->second] = cse_none;
+
+  bool changed = true;
+  while (changed)
+    {
+      changed = false;
+      for (map<string,functiondecl*>::iterator it = s.functions.begin();
+           it != s.functions.end(); ++it)
+        {
+          functiondecl* fd = it->second;
+          cse_level level = cse_none;
+          if (embeddedcode* ec = dynamic_cast<embeddedcode*>(fd->body))
+            {
+              if (ec->tagged_p ("/* pure */") && ec->tagged_p ("/* stable */"))
+                level = cse_safe;
+            }
+          else if (fd->type == pe_long || fd->type == pe_string)
+            {
+              set<vardecl*> vars (fd->formal_args.begin(), fd->formal_args.end());
+              vars.insert (fd->locals.begin(), fd->locals.end());
+              cse_classifier cc (functions, vars, true);
+              level = cc.classify (fd->body);
+            }
+          if (level != functions[fd])
+            {
+              functions[fd] = level;
+              changed = true;
+            }
+        }
+    }
+
+  for_each_probe_parallel (s, [&] (derived_probe* p, ostream& log) {
+      cse_optimizer cse (s, functions, p->locals, log);
+      cse.vars.insert (p->locals.begin(), p->locals.end());
+      cse.optimize_body (p->body);
+    });
+
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); ++it)
+    {
+      functiondecl* fd = it->second;
+      if (dynamic_cast<embeddedcode*>(fd->body))
+        continue;
+      cse_optimizer cse (s, functions, fd->locals, clog);
+      cse.vars.insert (fd->formal_args.begin(), fd->formal_args.end());
+      cse.vars.insert (fd->locals.begin(), fd->locals.end());
+      cse.optimize_body (fd->body);
+    }
+}
+
+
+static int
+semantic_pass_optimize1 (systemtap_session& s)
+{
+  // In this pass, we attempt to rewrite probe/function bodies to
+  // eliminate some blatantly unnecessary code.  This is run before
+  // type inference, but after symbol resolution and derived_probe
+  // creation.  We run an outer "relaxation" loop that repeats the
+  // optimizations until none of them find anything to remove.
+
+  int rc = 0;
+
+  bool relaxed_p = false;
+  unsigned iterations = 0;
+  while (! relaxed_p)
+    {
+      // Save the old value of suppress_warnings, as we will be changing
+      // it below.
+      save_and_restore<bool> suppress_warnings(& s.suppress_warnings);
+
+      assert_no_interrupts();
+
+      relaxed_p = true; // until proven otherwise
+
+      // If the verbosity is high enough, always print warnings (overrides -w),
+      // or if not, always suppress warnings for every itteration after the first.
+      if(s.verbose > 2)
+        s.suppress_warnings = false;
+      else if (iterations > 0)
+        s.suppress_warnings = true;
+
+      if (s.unoptimized && ! s.dump_mode) // need these even in -u mode
+        {
+          semantic_pass_opt1 (s, relaxed_p);
+          semantic_pass_opt5 (s, relaxed_p);
+          semantic_pass_dead_control (s, relaxed_p);
+        }
+      if (!s.unoptimized)
+        {
+          semantic_pass_inline (s, relaxed_p);
+          semantic_pass_opt1 (s, relaxed_p);
+          semantic_pass_opt2 (s, relaxed_p, iterations); // produce some warnings only on iteration=0
+          semantic_pass_opt3 (s, relaxed_p);
+          semantic_pass_opt4 (s, relaxed_p);
+          semantic_pass_opt5 (s, relaxed_p);
+        }
+
+      // For listing mode, we need const-folding regardless of optimization so
+      // that @defined expressions can be properly resolved.  PR11360
       // We also want it in case variables are used in if/case expressions,
       // so enable always.  PR11366
       // rc is incremented if there is an error that got reported.
@@ -5919,6 +7390,9 @@ semantic_pass_optimize2 (systemtap_session& s)
   if (!s.unoptimized)
     semantic_pass_opt7(s);
 
+  if (!s.unoptimized && !s.disable_cse)
+    semantic_pass_cse (s);
+
   return rc;
 }
 
@@ -6339,6 +7813,11 @@ typeresolution_info::visit_regex_query (regex_query *e)
   e->left->visit (this);
   t = pe_string;
   e->right->visit (this); // parser ensures this is a literal known at compile time
+  for (unsigned i=0; i<e->others.size(); i++)
+    {
+      t = pe_string;
+      e->others[i]->visit (this);
+    }
 
   if (e->type == pe_unknown)
     {
@@ -6356,6 +7835,14 @@ typeresolution_info::visit_compound_expression (compound_expression* e)
   // No incoming data for the LHS.
   t = pe_unknown;
   e->left->visit(this);
+
+  // The value is that of the RHS.
+  if (e->type == pe_unknown && e->right->type != pe_unknown)
+    {
+      e->type = e->right->type;
+      e->type_details = e->right->type_details;
+      resolved (e->tok, e->type);
+    }
 }
 
 
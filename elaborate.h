@@ -246,6 +246,10 @@ public:
   virtual bool needs_global_locks () { return true; }
   // by default, probes need locks around global variables
 
+  virtual bool infrequent_p () { return false; }
+  // probes known to fire at most about every 10ms, like slow timers,
+  // whose writes to globals may be made dearer to speed up their readers
+
   // Location of semaphores to activate sdt probes
   Dwarf_Addr sdt_semaphore_addr;
 
@@ -255,6 +259,11 @@ public:
   // index into session.probes[], set and used during translation
   unsigned session_index;
 
+  // the handler cannot fail, calls no functions and uses no strings, so
+  // its entry function may skip most of the context setup; set during
+  // translation
+  bool tiny;
+
   // List of other derived probes whose conditions may be affected by
   // this probe.
   std::set<derived_probe*> probes_with_affected_conditions;
@@ -232,6 +232,16 @@ find_script_hash (systemtap_session& s, const string& script)
   h.add("Compatible (--compatible): ", s.compatible);
   h.add("Error suppression (--suppress-handler-errors): ", s.suppress_handler_errors);
   h.add("Suppress Time Limits (--suppress-time-limits): ", s.suppress_time_limits);
+  h.add("Exporter (--exporter): ", s.exporter_port);
+  h.add("Lock Stripes (--lock-stripes): ", s.lock_stripes);
+  if (!s.btf_path.empty())
+    h.add_path("BTF (--btf) ", s.btf_path);
+  h.add("PGO collection (--pgo-collect): ", s.pgo_collect);
+  if (!s.pgo_use_path.empty())
+    h.add_path("PGO profile (--pgo-use) ", s.pgo_use_path);
+  h.add("Disable CSE (--disable-cse): ", s.disable_cse);
+  h.add("Inline Limit (--inline-limit): ", s.inline_limit);
+  h.add("Shared Symbols (--shared-symbols): ", s.shared_symbols);
   h.add("Prologue Searching (--prologue-searching[=WHEN]): ", int(s.prologue_searching_mode));
 
   for (unsigned i = 0; i < s.c_macros.size(); i++)
@@ -390,4 +400,69 @@ find_uprobes_hash (systemtap_session& s)
   return hashdir + "/uprobes_" + result;
 }
 
+
+void
+find_shared_symbols_hash (systemtap_session& s, const string& tables)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The tables run to many megabytes, so log only their digest.
+  string tables_result;
+  {
+    struct mdfour md4;
+    unsigned char sum[16];
+    ostringstream rstream;
+    mdfour_begin(&md4);
+    mdfour_update(&md4, (const unsigned char *) tables.data(), tables.size());
+    mdfour_update(&md4, NULL, 0);
+    mdfour_result(&md4, sum);
+    for (int i=0; i<16; i++)
+      rstream << hex << setfill('0') << setw(2) << (unsigned)sum[i];
+    tables_result = rstream.str();
+  }
+  h.add("Symbol Tables: ", tables_result);
+
+  // Add any custom kbuild flags
+  for (unsigned i = 0; i < s.kbuildflags.size(); i++)
+    h.add("Kbuildflags: ", s.kbuildflags[i]);
+
+  // The module name identifies the contents; kernel module names are
+  // short, so leave off the length suffix.
+  string result, hashdir;
+  h.result(result);
+  s.shared_symbols_name = "stap_symbols_" + result.substr(0, 32);
+
+  // Get the directory path to store our cached module
+  if (!s.use_cache || !create_hashdir(s, result, hashdir))
+    return;
+
+  create_hash_log(string("shared_symbols_hash"), h.get_parms(), result,
+                  hashdir + "/" + s.shared_symbols_name + "_hash.log");
+  s.shared_symbols_cache = hashdir + "/" + s.shared_symbols_name;
+}
+
+
+string
+find_regex_hash (systemtap_session& s, const string& regex, bool do_tag)
+{
+  // The generated matcher depends only on the translator, not on the
+  // kernel or the compiler, so don't start from the base hash.
+  stap_hash h;
+  h.add("Systemtap version: ", s.version_string());
+  h.add_path("Systemtap ", get_self_path());
+
+  h.add("Regex: ", regex);
+  h.add("Tagged: ", do_tag);
+
+  // Get the directory path to store our cached matcher
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("regex_hash"), h.get_parms(), result,
+                  hashdir + "/regex_" + result + "_hash.log");
+  return hashdir + "/regex_" + result + ".dfa";
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -592,6 +592,10 @@ passes_0_4 (systemtap_session &s)
   // translate.cxx:emit_symbol_data()
   s.symbols_source = string(s.tmpdir) + "/stap_symbols.c";
 
+  // The same for the shared symbols module, if --shared-symbols asks
+  // for one.
+  s.shared_symbols_source = string(s.tmpdir) + "/stap_symbols_shared.c";
+
   PROBE1(stap, pass0__end, &s);
 
   struct tms tms_before;
@@ -1027,6 +1031,16 @@ passes_0_4 (systemtap_session &s)
         << ((tv_after.tv_sec - tv_before.tv_sec) * 1000 + \
             ((long)tv_after.tv_usec - (long)tv_before.tv_usec) / 1000) << "real ms."
 
+  // The same times, for --report-build.
+#define TIMESREPORT(pass) \
+  s.build_report_times.push_back (systemtap_session::build_report_time ((pass), \
+           (tms_after.tms_cutime + tms_after.tms_utime \
+            - tms_before.tms_cutime - tms_before.tms_utime) * 1000 / (_sc_clk_tck), \
+           (tms_after.tms_cstime + tms_after.tms_stime \
+            - tms_before.tms_cstime - tms_before.tms_stime) * 1000 / (_sc_clk_tck), \
+           (tv_after.tv_sec - tv_before.tv_sec) * 1000 + \
+            ((long)tv_after.tv_usec - (long)tv_before.tv_usec) / 1000))
+
   // syntax errors, if any, are already printed
   if (s.verbose)
     {
@@ -1039,6 +1053,8 @@ passes_0_4 (systemtap_session &s)
            << endl;
     }
 
+  TIMESREPORT ("parse");
+
   if (rc && !s.dump_mode)
     cerr << _("Pass 1: parse failed.  [man error::pass1]") << endl;
 
@@ -1119,6 +1135,7 @@ passes_0_4 (systemtap_session &s)
          << TIMESPRINT
          << endl;
   }
+  TIMESREPORT ("elaborate");
 
   missing_rpm_list_print(s, "-debuginfo");
 
@@ -1252,6 +1269,7 @@ passes_0_4 (systemtap_session &s)
 	     << getmemusage()
 	     << TIMESPRINT
 	     << endl;
+      TIMESREPORT ("translate");
 
       if (rc && ! s.try_server ())
 	cerr << _("Pass 3: translation failed.  [man error::pass3]") << endl;
@@ -1298,6 +1316,10 @@ passes_0_4 (systemtap_session &s)
 	clog << _("Pass 4: compiled C into \"");
       clog << s.module_filename() << "\" " << TIMESPRINT << endl;
     }
+  TIMESREPORT ("compile");
+
+  if (! rc && ! s.report_build_path.empty())
+    write_build_report (s);
 
   if (rc && ! s.try_server ())
     {
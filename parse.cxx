@@ -217,6 +217,7 @@ private: // nonterminals
   expression* parse_probewrite_op(const token* t);
   expression* parse_const_op (const token* t);
   expression* parse_perf_op (const token* t);
+  expression* parse_regexp_match_set (const token* t);
   expression* parse_target_register (const token* t);
   expression* parse_target_deref (const token* t);
   expression* parse_expression ();
@@ -4083,6 +4084,10 @@ expression* parser::parse_symbol ()
 	  return fmt;
 	}
 
+      else if (name == "regexp_match_set" && input.has_version("5.2")
+	       && peek_op ("("))
+	return parse_regexp_match_set (t);
+
       else if (peek_op ("(")) // function call
 	{
 	  swallow ();
@@ -4307,6 +4312,22 @@ expression* parser::parse_perf_op (const token* t)
   return pop;
 }
 
+// Parse a regexp_match_set(str, "re1", "re2", ...).  Given head token
+// has already been consumed.
+expression* parser::parse_regexp_match_set (const token* t)
+{
+  regex_query* r = new regex_query;
+  r->op = "=~";
+  r->tok = t;
+  expect_op("(");
+  r->left = parse_expression ();
+  expect_op(",");
+  r->right = parse_literal_string ();
+  while (expect_op_any({")", ","}) == ",")
+    r->others.push_back (parse_literal_string ());
+  return r;
+}
+
 // Parse a @kregister or @uregister.  Given head token has already been consumed.
 expression* parser::parse_target_register (const token* t)
 {
@@ -547,6 +547,13 @@ class stapsh : public remote {
               return rc;
           }
 
+        if (!s->shared_symbols_path.empty())
+          {
+            string remotesymbols = basename(s->shared_symbols_path.c_str());
+            if ((rc = send_file(s->shared_symbols_path, remotesymbols)))
+              return rc;
+          }
+
         args = make_run_command(*s, ".", remote_version);
 
         // PR13354: identify our remote index/url
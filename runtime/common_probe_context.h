@@ -83,6 +83,15 @@ int aborted;
    been locked or not. PR26296 */
 int locked;
 
+#ifdef STP_LOCK_STRIPES
+/* The stripe lock held for the current element access to a striped
+   global array, if any, and that element's stripe.  See
+   stp_lock_stripe() in probe_lock.h. */
+stp_rwlock_t *stripe_lock;
+unsigned stripe_write_p;
+unsigned stripe;
+#endif
+
 /* A place to format error messages into if some error occurs, last_error
    will then be pointed here.  */
 string_t error_buffer;
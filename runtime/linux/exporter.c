@@ -0,0 +1,183 @@
+/* -*- linux-c -*-
+ *
+ * Global variable snapshots for the stapio prometheus exporter
+ * Copyright (C) 2026 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STP_EXPORTER_C_
+#define _STP_EXPORTER_C_
+
+#include <linux/seq_file.h>
+#include "proc_fs_compatibility.h"
+#include "uidgid_compatibility.h"
+
+/* The /proc/systemtap/MODULE/__exporter file is a seq_file rather than
+ * a procfs probe, so that its size is not limited by a buffer filled in
+ * probe context: each global is written straight into the seq_file
+ * buffer, which grows as needed.  The record layout is described in
+ * transport_msgs.h; stapio -E turns it into OpenMetrics text. */
+
+#ifndef STP_EXPORTER_NUM_GLOBALS
+#error "need STP_EXPORTER_NUM_GLOBALS"
+#endif
+
+typedef void (*_stp_exporter_dump_fn)(struct seq_file *m);
+
+/* Emitted by the translator after this file, one per exported global. */
+static const _stp_exporter_dump_fn _stp_exporter_dumps[STP_EXPORTER_NUM_GLOBALS];
+
+static struct proc_dir_entry *_stp_exporter_pde = NULL;
+
+
+static void _stp_exporter_put_int64(struct seq_file *m, int64_t val)
+{
+	seq_write(m, &val, sizeof(val));
+}
+
+static void _stp_exporter_put_str(struct seq_file *m, const char *str)
+{
+	uint32_t len = str ? strlen(str) : 0;
+	seq_write(m, &len, sizeof(len));
+	if (len)
+		seq_write(m, str, len);
+}
+
+static void _stp_exporter_put_stat(struct seq_file *m, const stat_data *sd)
+{
+	/* min/max are meaningless until something has been recorded. */
+	_stp_exporter_put_int64(m, sd ? sd->count : 0);
+	_stp_exporter_put_int64(m, sd ? sd->sum : 0);
+	_stp_exporter_put_int64(m, (sd && sd->count) ? sd->min : 0);
+	_stp_exporter_put_int64(m, (sd && sd->count) ? sd->max : 0);
+}
+
+static void _stp_exporter_put_global(struct seq_file *m, const char *name,
+				     uint32_t value_type, uint32_t arity,
+				     const uint32_t *key_types)
+{
+	struct _stp_exporter_global g;
+	uint32_t i;
+
+	memset(&g, 0, sizeof(g));
+	g.tag = STP_EXPORTER_GLOBAL;
+	g.value_type = value_type;
+	g.arity = arity;
+	for (i = 0; i < arity && i < STP_EXPORTER_MAXARITY; i++)
+		g.key_types[i] = key_types[i];
+	g.name_len = strlen(name);
+	seq_write(m, &g, sizeof(g));
+	seq_write(m, name, g.name_len);
+}
+
+static void _stp_exporter_put_entry(struct seq_file *m)
+{
+	uint32_t tag = STP_EXPORTER_ENTRY;
+	seq_write(m, &tag, sizeof(tag));
+}
+
+
+/* Position 0 is the header; position N is _stp_exporter_dumps[N-1]. */
+static void *_stp_exporter_seq_pos(loff_t pos)
+{
+	if (atomic_read(session_state()) != STAP_SESSION_RUNNING)
+		return NULL;
+	if (pos == 0)
+		return SEQ_START_TOKEN;
+	if (pos > STP_EXPORTER_NUM_GLOBALS)
+		return NULL;
+	return (void *)&_stp_exporter_dumps[pos - 1];
+}
+
+static void *_stp_exporter_seq_start(struct seq_file *m, loff_t *pos)
+{
+	return _stp_exporter_seq_pos(*pos);
+}
+
+static void *_stp_exporter_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return _stp_exporter_seq_pos(*pos);
+}
+
+static void _stp_exporter_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static int _stp_exporter_seq_show(struct seq_file *m, void *v)
+{
+	if (v == SEQ_START_TOKEN) {
+		struct _stp_exporter_header h;
+		h.tag = STP_EXPORTER_HEADER;
+		h.magic = STP_EXPORTER_MAGIC;
+		h.version = STP_EXPORTER_VERSION;
+		h.num_globals = STP_EXPORTER_NUM_GLOBALS;
+		seq_write(m, &h, sizeof(h));
+	}
+	else
+		(*(const _stp_exporter_dump_fn *)v)(m);
+	return 0;
+}
+
+static const struct seq_operations _stp_exporter_seq_ops = {
+	.start = _stp_exporter_seq_start,
+	.next = _stp_exporter_seq_next,
+	.stop = _stp_exporter_seq_stop,
+	.show = _stp_exporter_seq_show,
+};
+
+static int _stp_exporter_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &_stp_exporter_seq_ops);
+}
+
+#ifdef STAPCONF_PROC_OPS
+static const struct proc_ops _stp_exporter_fops = {
+	.proc_open	= _stp_exporter_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= seq_release,
+};
+#else
+static const struct file_operations _stp_exporter_fops = {
+	.owner		= THIS_MODULE,
+	.open		= _stp_exporter_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+#endif
+
+
+/* Called once the session is running; the /proc/systemtap/MODULE
+ * directory itself is made by systemtap_kernel_module_init(). */
+static int _stp_exporter_init(void)
+{
+	if (_stp_procfs_module_dir == NULL)
+		return -ENOENT;
+
+	_stp_exporter_pde = proc_create("__exporter", 0400,
+					_stp_procfs_module_dir,
+					&_stp_exporter_fops);
+	if (_stp_exporter_pde == NULL)
+		return -ENOMEM;
+	proc_set_user(_stp_exporter_pde, KUIDT_INIT(_stp_uid),
+		      KGIDT_INIT(_stp_gid));
+	return 0;
+}
+
+/* Must run before the globals are freed.  proc_remove() waits for any
+ * reader still inside a dump function. */
+static void _stp_exporter_exit(void)
+{
+	if (_stp_exporter_pde) {
+		proc_remove(_stp_exporter_pde);
+		_stp_exporter_pde = NULL;
+	}
+}
+
+#endif /* _STP_EXPORTER_C_ */
@@ -44,6 +44,35 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 }
 
 
+#ifdef STP_LOCK_STRIPES
+/* A striped map (stap --lock-stripes) spreads the keys of one global
+ * array over STP_LOCK_STRIPES maps by hash, each with its own lock, so
+ * that probes updating different keys need not contend.  Each stripe
+ * can hold the whole array; the array's size limit is kept in num.  */
+struct smap {
+	MAP map[STP_LOCK_STRIPES];	/* per-stripe maps */
+	MAP agg;			/* all stripes, for foreach */
+	stp_rwlock_t lock[STP_LOCK_STRIPES];
+	atomic_t num;			/* entries in all stripes */
+	int maxnum;
+#ifdef STP_TIMING
+	atomic_t skipped[STP_LOCK_STRIPES];
+	atomic_t contention[STP_LOCK_STRIPES];
+#endif
+};
+
+static inline MAP _stp_smap_get_agg(SMAP s)
+{
+	return s->agg;
+}
+
+static inline MAP _stp_smap_get_map(SMAP s, unsigned stripe)
+{
+	return s->map[stripe];
+}
+#endif
+
+
 /** Deletes a map.
  * Deletes a map, freeing all memory in all elements.
  * Normally done only when the module exits.
@@ -86,6 +115,21 @@ static void _stp_pmap_del(PMAP pmap)
 	_stp_vfree(pmap);
 }
 
+#ifdef STP_LOCK_STRIPES
+static void _stp_smap_del(SMAP smap)
+{
+	unsigned i;
+
+	if (smap == NULL)
+		return;
+
+	for (i = 0; i < STP_LOCK_STRIPES; i++)
+		_stp_map_del(smap->map[i]);
+	_stp_map_del(smap->agg);
+	_stp_vfree(smap);
+}
+#endif
+
 
 static void*
 _stp_map_vzalloc(size_t size, int cpu)
@@ -209,4 +253,36 @@ err1:
 	return NULL;
 }
 
+#ifdef STP_LOCK_STRIPES
+static SMAP
+_stp_smap_new(unsigned max_entries, int node_size)
+{
+	unsigned i;
+
+	SMAP smap = _stp_map_vzalloc(sizeof(struct smap), -1);
+	if (unlikely(smap == NULL))
+		return NULL;
+
+	smap->maxnum = max_entries;
+	atomic_set(&smap->num, 0);
+	for (i = 0; i < STP_LOCK_STRIPES; i++) {
+		stp_rwlock_init(&smap->lock[i]);
+		smap->map[i] = _stp_map_new(max_entries, 0, node_size, -1);
+		if (unlikely(smap->map[i] == NULL))
+			goto err;
+	}
+
+	/* Foreach copies every stripe into the aggregate map. */
+	smap->agg = _stp_map_new(max_entries, 0, node_size, -1);
+	if (unlikely(smap->agg == NULL))
+		goto err;
+
+	return smap;
+
+err:
+	_stp_smap_del(smap);
+	return NULL;
+}
+#endif
+
 #endif /* _LINUX_MAP_RUNTIME_H_ */
@@ -65,7 +65,7 @@ static long _stp_perf_init (struct stap_perf_probe *stp, struct task_struct* tas
 		  || rc == -EOPNOTSUPP || rc == -ENXIO) {
 	        _stp_warn("perf probe '%s' is not supported by this kernel (%ld).",
 #ifdef STP_NEED_PROBE_NAME
-			  stp->probe->pn,
+			  stap_probe_string(stp->probe->pn),
 #else
 			  stp->probe->pp,
 #endif
@@ -291,7 +291,7 @@ long _stp_perf_read (int ncpu, unsigned i)
     {
       _stp_error ("_stp_perf_read - probe '%s' is not supported by this kernel",
 #ifdef STP_NEED_PROBE_NAME
-		  (stp ? stp->probe->pn : "unknown")
+		  (stp ? stap_probe_string(stp->probe->pn) : "unknown")
 #else
 		  (stp ? stp->probe->pp : "unknown")
 #endif
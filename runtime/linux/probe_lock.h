@@ -24,20 +24,121 @@ struct stp_probe_lock {
 	#endif
 	stp_rwlock_t *lock;
 	unsigned write_p;
+	#ifdef STP_READ_MOSTLY
+	stp_rwlock_t **cpu_locks;
+	#endif
 };
 
 
+#ifdef STP_READ_MOSTLY
+/* A read-mostly global has a reader lock per CPU besides its ordinary
+ * lock.  Probes reading it take just the one of their own CPU, so they
+ * never dirty a cacheline that other CPUs use.  The rare probes writing
+ * it take the ordinary lock and then the locks of all CPUs, so other
+ * users of the ordinary lock, like the exporter, still exclude them.
+ * Probe handlers run with preemption disabled, so a reader unlocks the
+ * lock of the same CPU it locked.  */
+static int
+stp_cpu_locks_init(stp_rwlock_t **cpu_locks)
+{
+	int cpu;
+
+	*cpu_locks = _stp_alloc_percpu(sizeof(stp_rwlock_t));
+	if (*cpu_locks == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		stp_rwlock_init(per_cpu_ptr(*cpu_locks, cpu));
+	return 0;
+}
+
+
+static void
+stp_cpu_locks_free(stp_rwlock_t **cpu_locks)
+{
+	if (*cpu_locks)
+		_stp_free_percpu(*cpu_locks);
+	*cpu_locks = NULL;
+}
+
+
+static void
+stp_cpu_locks_write_unlock(stp_rwlock_t *cpu_locks, int upto)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (cpu == upto)
+			break;
+		stp_write_unlock(per_cpu_ptr(cpu_locks, cpu));
+	}
+}
+
+
+static unsigned
+stp_cpu_locks_write_trylock(stp_rwlock_t *cpu_locks)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (!stp_write_trylock(per_cpu_ptr(cpu_locks, cpu))) {
+			stp_cpu_locks_write_unlock(cpu_locks, cpu);
+			return 0;
+		}
+	return 1;
+}
+#endif
+
+
+static inline unsigned
+stp_probe_trylock(const struct stp_probe_lock *lock)
+{
+#ifdef STP_READ_MOSTLY
+	if (lock->cpu_locks) {
+		if (!lock->write_p)
+			return stp_read_trylock(per_cpu_ptr(*lock->cpu_locks,
+							    smp_processor_id()));
+		if (!stp_write_trylock(lock->lock))
+			return 0;
+		if (stp_cpu_locks_write_trylock(*lock->cpu_locks))
+			return 1;
+		stp_write_unlock(lock->lock);
+		return 0;
+	}
+#endif
+	if (lock->write_p)
+		return stp_write_trylock(lock->lock);
+	else
+		return stp_read_trylock(lock->lock);
+}
+
+
+static inline void
+stp_probe_unlock(const struct stp_probe_lock *lock)
+{
+#ifdef STP_READ_MOSTLY
+	if (lock->cpu_locks) {
+		if (!lock->write_p) {
+			stp_read_unlock(per_cpu_ptr(*lock->cpu_locks,
+						    smp_processor_id()));
+			return;
+		}
+		stp_cpu_locks_write_unlock(*lock->cpu_locks, -1);
+	}
+#endif
+	if (lock->write_p)
+		stp_write_unlock(lock->lock);
+	else
+		stp_read_unlock(lock->lock);
+}
+
+
 static void
 stp_unlock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 {
 	unsigned i;
 	if (num_locks == 0) return; /* defeat a gcc9 warning */
-	for (i = num_locks; i-- > 0;) {
-		if (locks[i].write_p)
-			stp_write_unlock(locks[i].lock);
-		else
-			stp_read_unlock(locks[i].lock);
-	}
+	for (i = num_locks; i-- > 0;)
+		stp_probe_unlock(&locks[i]);
 }
 
 
@@ -46,28 +147,16 @@ stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 {
 	unsigned i, retries = 0;
 	for (i = 0; i < num_locks; ++i) {
-		if (locks[i].write_p)
-			while (!stp_write_trylock(locks[i].lock)) {
+		while (!stp_probe_trylock(&locks[i])) {
 #if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
-				if (++retries > MAXTRYLOCK)
-					goto skip;
+			if (++retries > MAXTRYLOCK)
+				goto skip;
 #endif
-				#ifdef STP_TIMING
-					atomic_inc(locks[i].contention);
-				#endif
-				udelay (TRYLOCKDELAY);
-			}
-		else
-			while (!stp_read_trylock(locks[i].lock)) {
-#if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
-				if (++retries > MAXTRYLOCK)
-					goto skip;
-#endif
-				#ifdef STP_TIMING
-					atomic_inc(locks[i].contention);
-				#endif
-				udelay (TRYLOCKDELAY);
-			}
+			#ifdef STP_TIMING
+				atomic_inc(locks[i].contention);
+			#endif
+			udelay (TRYLOCKDELAY);
+		}
 	}
 	return 1;
 
@@ -81,4 +170,85 @@ skip:
 }
 
 
+#ifdef STP_LOCK_STRIPES
+/* Striped global arrays are not in the probe's lock table.  Instead,
+ * each access to one of their elements locks just the stripe holding
+ * the key, and notes it in the context so that an error exit from the
+ * access can drop it.  Timing out abandons the rest of the handler,
+ * which counts as a skipped probe.  */
+static unsigned
+stp_lock_stripe(struct context *c, SMAP smap, unsigned stripe, unsigned write_p)
+{
+	unsigned retries = 0;
+	stp_rwlock_t *lock = &smap->lock[stripe];
+
+	while (!(write_p ? stp_write_trylock(lock) : stp_read_trylock(lock))) {
+#if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
+		if (++retries > MAXTRYLOCK) {
+			atomic_inc(skipped_count());
+			#ifdef STP_TIMING
+				atomic_inc(&smap->skipped[stripe]);
+			#endif
+			c->aborted = 1;
+			return 0;
+		}
+#endif
+		#ifdef STP_TIMING
+			atomic_inc(&smap->contention[stripe]);
+		#endif
+		udelay (TRYLOCKDELAY);
+	}
+	c->stripe_lock = lock;
+	c->stripe_write_p = write_p;
+	c->stripe = stripe;
+	return 1;
+}
+
+
+static void
+stp_unlock_stripe(struct context *c)
+{
+	if (c->stripe_lock == NULL)
+		return;
+	if (c->stripe_write_p)
+		stp_write_unlock(c->stripe_lock);
+	else
+		stp_read_unlock(c->stripe_lock);
+	c->stripe_lock = NULL;
+}
+
+
+#ifdef STP_TIMING
+static void
+stp_report_stripe_contention(SMAP smap, const char *name)
+{
+	unsigned i;
+	int ctr;
+
+	for (i = 0; smap && i < STP_LOCK_STRIPES; i++) {
+		ctr = atomic_read(&smap->contention[i]);
+		if (ctr)
+			_stp_printf("'%s' stripe %u lock contention occurred %d times\n",
+				    name, i, ctr);
+	}
+}
+
+
+static void
+stp_report_stripe_skipped(SMAP smap, const char *name)
+{
+	unsigned i;
+	int ctr;
+
+	for (i = 0; smap && i < STP_LOCK_STRIPES; i++) {
+		ctr = atomic_read(&smap->skipped[i]);
+		if (ctr)
+			_stp_warn("Skipped due to global '%s' stripe %u lock timeout: %d\n",
+				  name, i, ctr);
+	}
+}
+#endif
+#endif
+
+
 #endif /* _STAPLINUX_PROBE_LOCK_H */
@@ -933,10 +933,14 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 }
 
 
-/* Pull in pmaps while all the defines are still in place.  */
-#ifdef MAP_DO_PMAP
+/* Pull in pmaps while all the defines are still in place.  Striped
+   maps reuse the pmap node helpers.  */
+#if defined(MAP_DO_PMAP) || defined(MAP_DO_SMAP)
 #include "pmap-gen.c"
 #endif
+#ifdef MAP_DO_SMAP
+#include "smap-gen.c"
+#endif
 
 
 #undef KEY1NAME
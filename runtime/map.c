@@ -131,6 +131,18 @@ static void _stp_pmap_clear(PMAP pmap)
 	_stp_map_clear(_stp_pmap_get_agg(pmap));
 }
 
+#ifdef STP_LOCK_STRIPES
+static void _stp_smap_clear(SMAP smap)
+{
+	unsigned i;
+
+	for (i = 0; i < STP_LOCK_STRIPES; i++)
+		_stp_map_clear(_stp_smap_get_map(smap, i));
+	_stp_map_clear(_stp_smap_get_agg(smap));
+	atomic_set(&smap->num, 0);
+}
+#endif
+
 
 /* sort keynum values */
 #define SORT_COUNT -5 /* see also translate.cxx:visit_foreach_loop */
@@ -387,6 +399,40 @@ out:
 	return agg;
 }
 
+#ifdef STP_LOCK_STRIPES
+/** Aggregate the stripes of a striped map.
+ * Each key lives in just one stripe, so this only copies every stripe
+ * into the aggregate map, whose hash table has the same size.
+ *
+ * Write locks must be held on all the stripes (or no probe that can
+ * modify the map may be running) during this function.
+ *
+ * @param smap A pointer to a striped map.
+ * @returns a pointer to the aggregated map. Null on failure.
+ */
+static MAP _stp_smap_agg (SMAP smap, map_update_fn update)
+{
+	unsigned i, hash;
+	MAP m, agg;
+	struct map_node *ptr;
+	struct mhlist_node *e;
+
+	agg = _stp_smap_get_agg(smap);
+	_stp_map_clear (agg);
+
+	for (i = 0; i < STP_LOCK_STRIPES; i++) {
+		m = _stp_smap_get_map(smap, i);
+		for (hash = 0; hash <= m->hash_table_mask; hash++) {
+			mhlist_for_each_entry(ptr, e, &m->hashes[hash], hnode) {
+				if (!_stp_new_agg(agg, &agg->hashes[hash], ptr, update))
+					return NULL;
+			}
+		}
+	}
+	return agg;
+}
+#endif
+
 static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
 {
 	struct map_node *m;
@@ -122,6 +122,11 @@ typedef struct map_root *MAP;
 struct pmap; /* defined in map_runtime.h */
 typedef struct pmap *PMAP;
 
+#ifdef STP_LOCK_STRIPES
+struct smap; /* defined in map_runtime.h */
+typedef struct smap *SMAP;
+#endif
+
 typedef key_data (*map_get_key_fn)(struct map_node *mn, int n, int *type);
 typedef void (*map_update_fn)(MAP m, struct map_node *dst, struct map_node *src, int add);
 typedef int (*map_cmp_fn)(struct map_node *dst, struct map_node *src);
@@ -184,5 +189,11 @@ static int _new_map_set_stat (MAP map, struct stat_data *dst, int64_t val, int a
 static int _new_map_copy_stat (MAP map, struct stat_data *dst, struct stat_data *src, int add);
 static void _stp_map_sort (MAP map, int keynum, int dir, map_get_key_fn get_key);
 static void _stp_map_sortn(MAP map, int n, int keynum, int dir, map_get_key_fn get_key);
+#ifdef STP_LOCK_STRIPES
+static SMAP _stp_smap_new(unsigned max_entries, int node_size);
+static void _stp_smap_del(SMAP smap);
+static void _stp_smap_clear(SMAP smap);
+static MAP _stp_smap_agg (SMAP smap, map_update_fn update);
+#endif
 /** @endcond */
 #endif /* _MAP_H_ */
@@ -30,6 +30,14 @@ struct stap_procfs_probe {
 	int needs_fill;
 	const int permissions;
 
+	/* For .read.stream probes, the read probe is run once per chunk
+	 * with an increasing offset, until it returns an empty value.
+	 * 'base' is the file position of the chunk now in 'buffer'. */
+	const int stream;
+	int64_t offset;
+	loff_t base;
+	int eof;
+
 	struct mutex lock;
 	int opencount;
 	wait_queue_head_t waitq;
@@ -106,6 +114,9 @@ _stp_proc_open_file(struct inode *inode, struct file *filp)
 			spp->buffer[0] = '\0';
 			spp->count = 0;
 			spp->needs_fill = 1;
+			spp->offset = 0;
+			spp->base = 0;
+			spp->eof = 0;
 		}
 	}
 
@@ -131,6 +142,55 @@ _stp_proc_release_file(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static ssize_t
+_stp_proc_stream_read_file(struct stap_procfs_probe *spp, char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	ssize_t copied = 0;
+	int rc;
+
+	/* Like seq_file, a backwards seek past the current chunk
+	 * restarts the iteration from the beginning. */
+	if (*ppos < spp->base) {
+		spp->buffer[0] = '\0';
+		spp->count = 0;
+		spp->offset = 0;
+		spp->base = 0;
+		spp->eof = 0;
+	}
+
+	while (count > 0) {
+		loff_t end = spp->base + spp->count;
+		size_t n;
+
+		if (*ppos >= end) {
+			if (spp->eof)
+				break;
+
+			/* Run the probe for the next chunk. */
+			spp->base = end;
+			spp->buffer[0] = '\0';
+			spp->count = 0;
+			spp->needs_fill = 1;
+			if ((rc = _stp_proc_fill_read_buffer(spp)))
+				return copied ? copied : rc;
+			spp->offset++;
+			if (spp->count == 0)
+				spp->eof = 1;
+			continue;
+		}
+
+		n = min_t(size_t, count, end - *ppos);
+		if (copy_to_user(buf + copied,
+				 spp->buffer + (*ppos - spp->base), n))
+			return copied ? copied : -EFAULT;
+		*ppos += n;
+		copied += n;
+		count -= n;
+	}
+	return copied;
+}
+
 static ssize_t
 _stp_proc_read_file(struct file *file, char __user *buf, size_t count,
 		    loff_t *ppos) 
@@ -142,6 +202,9 @@ _stp_proc_read_file(struct file *file, char __user *buf, size_t count,
 		goto out;
 	}
 
+	if (spp->stream)
+		return _stp_proc_stream_read_file(spp, buf, count, ppos);
+
 	/* If needed, fill up the buffer.*/
 	if (spp->needs_fill) {
 		if ((retval = _stp_proc_fill_read_buffer(spp))) {
@@ -18,6 +18,7 @@ struct _stp_procfs_data {
 	char *buffer;
 	size_t bufsize;
 	size_t count;
+	int64_t offset;		/* chunk number, for .read.stream probes */
 };
 
 #ifndef STP_PROCFS_BUFSIZE
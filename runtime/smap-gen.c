@@ -0,0 +1,74 @@
+/* -*- linux-c -*-
+ * smap API generator
+ * Copyright (C) 2026 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+/** @file smap-gen.c
+ * @brief Striped map function generator
+ * This file is a template designed to be included as many times as
+ * needed to generate the necessary striped map functions.  It is only
+ * included indirectly by map-gen.c, after pmap-gen.c, so all the shared
+ * #defines and the pmap node helpers are in place.
+ *
+ * Apart from new and agg, these functions work on the single stripe
+ * holding the key, whose lock the caller must hold; see
+ * stp_lock_stripe() in probe_lock.h.
+ */
+
+/* The low bits of the hash pick the bucket within a stripe, so pick
+ * the stripe with the high bits. */
+static unsigned KEYSYM(_stp_smap_stripe) (ALLKEYSD(key))
+{
+	return ((uint64_t) KEYSYM(hash) (ALLKEYS(key)) * STP_LOCK_STRIPES) >> 32;
+}
+
+static SMAP KEYSYM(_stp_smap_new) (unsigned max_entries)
+{
+	return _stp_smap_new (max_entries, sizeof(struct KEYSYM(map_node)));
+}
+
+static int KEYSYM(_stp_smap_set) (SMAP smap, unsigned stripe, ALLKEYSD(key), VSTYPE val)
+{
+	MAP m = _stp_smap_get_map (smap, stripe);
+	unsigned num = m->num;
+	int res = KEYSYM(_stp_map_set) (m, ALLKEYS(key), val);
+
+	/* A new key counts against the size limit of the whole array. */
+	if (m->num > num && atomic_inc_return(&smap->num) > smap->maxnum) {
+		atomic_dec(&smap->num);
+		(void) KEYSYM(_stp_map_del) (m, ALLKEYS(key));
+		return -1;
+	}
+	return res;
+}
+
+static VALTYPE KEYSYM(_stp_smap_get) (SMAP smap, unsigned stripe, ALLKEYSD(key))
+{
+	return KEYSYM(_stp_map_get) (_stp_smap_get_map (smap, stripe), ALLKEYS(key));
+}
+
+static int KEYSYM(_stp_smap_exists) (SMAP smap, unsigned stripe, ALLKEYSD(key))
+{
+	return KEYSYM(_stp_map_exists) (_stp_smap_get_map (smap, stripe), ALLKEYS(key));
+}
+
+static int KEYSYM(_stp_smap_del) (SMAP smap, unsigned stripe, ALLKEYSD(key))
+{
+	MAP m = _stp_smap_get_map (smap, stripe);
+	unsigned num = m->num;
+	int res = KEYSYM(_stp_map_del) (m, ALLKEYS(key));
+
+	if (m->num < num)
+		atomic_dec(&smap->num);
+	return res;
+}
+
+static MAP KEYSYM(_stp_smap_agg) (SMAP smap)
+{
+	return _stp_smap_agg(smap, KEYSYM(pmap_update_node));
+}
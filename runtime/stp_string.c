@@ -50,6 +50,124 @@ static int _stp_vscnprintf(char *buf, size_t size, const char *fmt, va_list args
 }
 
 
+/*
+ * Word-at-a-time string scanning.  Probe handlers can't use the FPU or
+ * vector registers, so these test a long's worth of bytes at once in
+ * ordinary registers instead.  The words read are aligned, so they
+ * never cross into another page, but they may include bytes past the
+ * terminating '\0'.  Memory checkers would rightly complain about
+ * that, so they scan byte by byte under those.
+ */
+#if defined(CONFIG_KASAN) || defined(CONFIG_KMSAN) || defined(STP_NO_STRING_SWAR)
+#define STP_STRING_SWAR 0
+#else
+#define STP_STRING_SWAR 1
+#endif
+
+typedef unsigned long __attribute__((__may_alias__)) _stp_word_t;
+
+#define _STP_WORD_ONES (~0UL / 0xff)
+#define _STP_WORD_HIGHS (_STP_WORD_ONES * 0x80)
+
+/* Nonzero if any byte of W is zero, or any byte is C.  */
+#define _stp_word_has_zero(w) \
+	(((w) - _STP_WORD_ONES) & ~(w) & _STP_WORD_HIGHS)
+#define _stp_word_has_byte(w, c) \
+	_stp_word_has_zero((w) ^ (_STP_WORD_ONES * (unsigned char)(c)))
+
+/* Nonzero if every byte of W is printable ASCII other than '"' and
+ * '\\', i.e. copied verbatim by _stp_text_str.  */
+static inline int _stp_word_is_plain(unsigned long w)
+{
+	unsigned long below = (w - _STP_WORD_ONES * 0x20) & ~w; /* < 0x20 */
+	unsigned long above = (w + _STP_WORD_ONES * 0x01) | w;  /* > 0x7e */
+	return !(((below | above) & _STP_WORD_HIGHS)
+		 | _stp_word_has_byte(w, '"') | _stp_word_has_byte(w, '\\'));
+}
+
+/** Return the length of a string, like strlen.  */
+static size_t _stp_strlen(const char *s)
+{
+	const char *p = s;
+#if STP_STRING_SWAR
+	const _stp_word_t *w;
+
+	for (; (uintptr_t)p % sizeof(_stp_word_t); p++)
+		if (!*p)
+			return p - s;
+	for (w = (const _stp_word_t *)p; !_stp_word_has_zero(*w); w++)
+		;
+	p = (const char *)w;
+#endif
+	while (*p)
+		p++;
+	return p - s;
+}
+
+/** Find the first C in a string, or else its terminating '\0'.  */
+static const char *_stp_strchrnul(const char *s, int c)
+{
+	unsigned char ch = c;
+#if STP_STRING_SWAR
+	const _stp_word_t *w;
+
+	for (; (uintptr_t)s % sizeof(_stp_word_t); s++)
+		if (!*s || (unsigned char)*s == ch)
+			return s;
+	for (w = (const _stp_word_t *)s;
+	     !_stp_word_has_zero(*w) && !_stp_word_has_byte(*w, ch); w++)
+		;
+	s = (const char *)w;
+#endif
+	while (*s && (unsigned char)*s != ch)
+		s++;
+	return s;
+}
+
+/** Find the first occurrence of a substring, like strstr.
+ * Candidate positions are those of the needle's first character, which
+ * _stp_strchrnul skips to a word at a time.
+ */
+static const char *_stp_strstr(const char *haystack, const char *needle)
+{
+	size_t n = _stp_strlen(needle);
+
+	if (n == 0)
+		return haystack;
+	for (;;) {
+		haystack = _stp_strchrnul(haystack, needle[0]);
+		if (!*haystack)
+			return NULL;
+		if (!strncmp(haystack, needle, n))
+			return haystack;
+		haystack++;
+	}
+}
+
+/** Split a string at the first of a set of delimiters, like strsep.
+ * A single delimiter, such as the '/' of a path, is found with
+ * _stp_strchrnul.
+ */
+static char *_stp_strsep(char **s, const char *delim)
+{
+	char *start = *s;
+	char *end;
+
+	if (!start)
+		return NULL;
+	if (delim[0] && !delim[1])
+		end = (char *)_stp_strchrnul(start, delim[0]);
+	else
+		end = start + strcspn(start, delim);
+	if (*end) {
+		*end = '\0';
+		*s = end + 1;
+	} else
+		*s = NULL;
+	return start;
+}
+
+
 /**
  * Decode a UTF-8 sequence into its codepoint.
  *
@@ -173,8 +291,33 @@ static int _stp_text_str(char *outstr, const char *in, int inlen, int outlen,
 
 	while (inlen > 0) {
 		int num = 1;
+		int n;
+
+#if STP_STRING_SWAR
+		unsigned long w;
+
+		/* Copy runs of plain ASCII a word at a time.  A word holding
+		 * the terminating '\0' isn't plain, so we never read past
+		 * it into another page.  The input may be any kernel or user
+		 * address, so the word is fetched without faulting; if that
+		 * fails, the byte-wise decode below reports it.  */
+		if (inlen >= (int)sizeof(_stp_word_t)
+		    && outlen >= (int)sizeof(_stp_word_t)
+		    && !((uintptr_t)in % sizeof(_stp_word_t))
+		    && !_stp_deref_nofault(w, sizeof(_stp_word_t), in,
+					   (user ? STP_USER_DS : STP_KERNEL_DS))
+		    && _stp_word_is_plain(w)) {
+			memcpy(out, &w, sizeof(_stp_word_t));
+			in += sizeof(_stp_word_t);
+			out += sizeof(_stp_word_t);
+			inlen -= sizeof(_stp_word_t);
+			outlen -= sizeof(_stp_word_t);
+			c = (unsigned char) out[-1];
+			continue;
+		}
+#endif
 
-		int n = _stp_decode_utf8(in, inlen, user, &c);
+		n = _stp_decode_utf8(in, inlen, user, &c);
 		if (n <= 0)
 			goto bad;
 		if ((c == 0 && !buffer) || outlen <= 0)
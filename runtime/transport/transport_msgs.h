@@ -194,3 +194,48 @@ struct _stp_msg_remote_id
         int32_t remote_id;
         char remote_uri[STP_REMOTE_URI_LEN];
 };
+
+/* Global variable snapshots, read by stapio -E from
+   /proc/systemtap/MODULE/__exporter.  module->stapio
+
+   The file is a stream of records, each starting with a uint32_t tag.
+   A STP_EXPORTER_GLOBAL record announces a global variable; it is
+   followed by one STP_EXPORTER_ENTRY record per element (exactly one
+   for scalars).  Entry fields are encoded in order key1..keyN, value:
+   INT64 as a native int64_t, STRING as a uint32_t length plus that
+   many bytes (no NUL), STAT as count, sum, min, max int64_t's. */
+#define STP_EXPORTER_MAGIC 0x53544558 /* "STEX" */
+#define STP_EXPORTER_VERSION 1
+#define STP_EXPORTER_MAXARITY 9 /* cf. map-gen.c KEY9_TYPE */
+
+enum
+{
+	STP_EXPORTER_HEADER = 1,
+	STP_EXPORTER_GLOBAL,
+	STP_EXPORTER_ENTRY,
+};
+
+enum
+{
+	STP_EXPORTER_INT64 = 1,
+	STP_EXPORTER_STRING,
+	STP_EXPORTER_STAT,
+};
+
+struct _stp_exporter_header
+{
+	uint32_t tag;		/* STP_EXPORTER_HEADER */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_globals;
+};
+
+struct _stp_exporter_global
+{
+	uint32_t tag;		/* STP_EXPORTER_GLOBAL */
+	uint32_t value_type;
+	uint32_t arity;
+	uint32_t key_types[STP_EXPORTER_MAXARITY];
+	uint32_t name_len;
+	/* name ... */
+};
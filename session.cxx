@@ -143,6 +143,15 @@ systemtap_session::systemtap_session ():
   tmpdir_opt_set = false;
   monitor = false;
   monitor_interval = 1;
+  exporter_port = 0;
+  lock_stripes = 0;
+  btf_path = "";
+  pgo_collect = false;
+  pgo_use_path = "";
+  disable_cse = false;
+  inline_limit = 16;
+  report_build_path = "";
+  shared_symbols = false;
   read_stdin = false;
   save_module = false;
   save_uprobes = false;
@@ -349,6 +358,15 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   tmpdir_opt_set = false;
   monitor = other.monitor;
   monitor_interval = other.monitor_interval;
+  exporter_port = other.exporter_port;
+  lock_stripes = other.lock_stripes;
+  btf_path = other.btf_path;
+  pgo_collect = other.pgo_collect;
+  pgo_use_path = other.pgo_use_path;
+  disable_cse = other.disable_cse;
+  inline_limit = other.inline_limit;
+  report_build_path = other.report_build_path;
+  shared_symbols = other.shared_symbols;
   save_module = other.save_module;
   save_uprobes = other.save_uprobes;
   modname_given = other.modname_given;
@@ -758,6 +776,25 @@ systemtap_session::usage (int exitcode)
     "   --monitor=INTERVAL\n"
     "              enables runtime interactive monitoring\n"
 #endif
+    "   --exporter=PORT\n"
+    "              serve script globals as OpenMetrics text on PORT\n"
+    "   --lock-stripes=N\n"
+    "              split the lock of write-heavy global arrays into N stripes\n"
+    "   --btf=PATH\n"
+    "              resolve @cast kernel types from BTF file PATH before debuginfo\n"
+    "   --pgo-collect\n"
+    "              report probe hits, function calls and branches taken at exit\n"
+    "   --pgo-use=PROFILE\n"
+    "              optimize for the --pgo-collect report in file PROFILE\n"
+    "   --disable-cse\n"
+    "              evaluate repeated pure function calls and $var reads each time\n"
+    "   --inline-limit=N\n"
+    "              inline functions returning expressions of up to N nodes, 0 for none\n"
+    "   --report-build=FILE\n"
+    "              write the C lines and object size of each probe and function\n"
+    "              and the time of each pass to FILE, as JSON\n"
+    "   --shared-symbols\n"
+    "              put kernel symbol and unwind data in a module shared by scripts\n"
 #if HAVE_JSON_C && HAVE_LANGUAGE_SERVER_SUPPORT
      "   --language-server\n"
      "              starts a systemtap language server\n"
@@ -1709,6 +1746,67 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
             }
           break;
 
+        case LONG_OPT_BTF:
+          assert(optarg);
+          btf_path = optarg;
+          break;
+
+        case LONG_OPT_PGO_COLLECT:
+          pgo_collect = true;
+          break;
+
+        case LONG_OPT_PGO_USE:
+          assert(optarg);
+          pgo_use_path = optarg;
+          break;
+
+        case LONG_OPT_DISABLE_CSE:
+          disable_cse = true;
+          break;
+
+        case LONG_OPT_INLINE_LIMIT:
+          assert(optarg);
+          inline_limit = (unsigned) strtoul(optarg, &num_endptr, 10);
+          if (*num_endptr != '\0' || *optarg == '-')
+            {
+              cerr << _("Invalid inline limit.") << endl;
+              return 1;
+            }
+          break;
+
+        case LONG_OPT_REPORT_BUILD:
+          assert(optarg);
+          report_build_path = optarg;
+          use_script_cache = false; // the report needs passes 3 and 4 to run
+          break;
+
+        case LONG_OPT_SHARED_SYMBOLS:
+          shared_symbols = true;
+          // A cached script module would need a shared symbols module
+          // that only pass 3 names.
+          use_script_cache = false;
+          break;
+
+        case LONG_OPT_LOCK_STRIPES:
+          assert(optarg);
+          lock_stripes = (int) strtoul(optarg, &num_endptr, 10);
+          if (*num_endptr != '\0' || lock_stripes < 0 || lock_stripes > 1024)
+            {
+              cerr << _("Invalid lock stripe count.") << endl;
+              return 1;
+            }
+          break;
+
+        case LONG_OPT_EXPORTER:
+          assert(optarg);
+          exporter_port = (int) strtoul(optarg, &num_endptr, 10);
+          if (*num_endptr != '\0' || exporter_port < 1 || exporter_port > 65535)
+            {
+              cerr << _("Invalid exporter port.") << endl;
+              return 1;
+            }
+          break;
+
 	case LONG_OPT_NO_GLOBAL_VAR_DISPLAY:
 	  no_global_var_display = true;
 	  break;
@@ -1900,6 +1998,16 @@ systemtap_session::check_options (int argc, char * const argv [])
       cerr << _("Cannot specify --monitor with -l/-L/--dump-* switches.") << endl;
       usage(1);
     }
+  if (exporter_port && runtime_mode != kernel_runtime)
+    {
+      cerr << _("--exporter is only supported with the kernel runtime.") << endl;
+      usage(1);
+    }
+  if (lock_stripes && runtime_mode != kernel_runtime)
+    {
+      cerr << _("--lock-stripes is only supported with the kernel runtime.") << endl;
+      usage(1);
+    }
   // FIXME: we need to think through other options that shouldn't be
   // used with '-i' and '--language-server'.
 
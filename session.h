@@ -246,6 +246,19 @@ public:
   bool read_stdin;
   bool monitor;
   int monitor_interval;
+  int exporter_port; // 0 = no native prometheus exporter
+  int lock_stripes; // 0 = one lock per global array
+  std::string btf_path; // --btf: kernel types from this BTF file
+  bool pgo_collect; // --pgo-collect: report probe, call and branch counts
+  std::string pgo_use_path; // --pgo-use: optimize for this profile
+  bool disable_cse; // --disable-cse: keep repeated pure calls
+  unsigned inline_limit; // --inline-limit: largest function body to inline
+  std::string report_build_path; // --report-build: write a JSON build report
+  bool shared_symbols; // --shared-symbols: kernel symbols in a shared module
+  std::string shared_symbols_source; // C source of the shared symbols module
+  std::string shared_symbols_name; // its module name, empty if none
+  std::string shared_symbols_cache; // cache path prefix for it
+  std::string shared_symbols_path; // the built module
   int timeout; // in ms
   std::map<std::string,std::string> typequery_memo;
   
@@ -424,6 +437,26 @@ public:
   std::vector<translator_output*> auxiliary_outputs;
   unparser* up;
 
+  // --report-build data: the C of each probe handler, function and
+  // probe group, from passes 3 and 4, and the time of each pass.
+  struct build_report_unit
+  {
+    std::string kind; // "probe", "function" or "group"
+    std::string name;
+    std::string symbol; // its C function, if any
+    std::streamoff begin, end; // where it is in the translated source
+    unsigned lines;
+  };
+  std::vector<build_report_unit> build_report_units;
+  struct build_report_time
+  {
+    std::string pass;
+    long usr, sys, real; // ms
+    build_report_time (const std::string& p, long u, long s, long r):
+      pass(p), usr(u), sys(s), real(r) {}
+  };
+  std::vector<build_report_time> build_report_times;
+
   // some symbol addresses
   // XXX: these belong elsewhere; perhaps the dwflpp instance
   Dwarf_Addr sym_kprobes_text_start;
@@ -26,7 +26,10 @@
 #include <deque>
 #include <algorithm>
 #include <type_traits>
+#include <mutex>
+#include <unordered_map>
 #include <inttypes.h>
+#include "config.h"
 #include "bpfinterp.h"
 #include "libbpf.h"
 #include "../bpf-internal.h"
@@ -95,7 +98,8 @@ struct foreach_state {
   std::deque<std::pair<std::string, uint64_t *>> str_sorted;
   std::deque<std::pair<int64_t, uint64_t *>> int_sorted;
 
-  // Used to track keys for deallocation by foreach_state_cleanup:
+  // Used to track keys (or blocks of keys) for deallocation by
+  // foreach_state_cleanup:
   std::vector<uint64_t *> keys;
 };
 
@@ -105,10 +109,12 @@ typedef std::vector<foreach_state> foreach_stack;
 
 #define foreach_info bpf::globals::foreach_info
 
+// Unless copy_key is false, kp is copied; otherwise it must stay
+// valid (and be tracked in s.keys) until foreach_state_cleanup:
 void
 foreach_state_add(const foreach_info &fi, foreach_state &s,
                   uint64_t *kp, uint64_t *colp,
-                  bool scalar_long)
+                  bool scalar_long, bool copy_key = true)
 {
   // extract col_str, col_long from colp
   std::string col_str;
@@ -147,9 +153,13 @@ foreach_state_add(const foreach_info &fi, foreach_state &s,
     }
 
   // copy and save key
-  uint64_t *kp2 = (uint64_t *)malloc(fi.keysize);
-  memcpy(kp2, kp, fi.keysize);
-  s.keys.push_back(kp2);
+  uint64_t *kp2 = kp;
+  if (copy_key)
+    {
+      kp2 = (uint64_t *)malloc(fi.keysize);
+      memcpy(kp2, kp, fi.keysize);
+      s.keys.push_back(kp2);
+    }
 
   // save (col,key) pair
   if (use_str_col)
@@ -246,7 +256,7 @@ _foreach_state_next(const foreach_info &fi, /* XXX foreach_state &s, */
   if (sorted.empty())
     return -1;
 
-  if (fi.sort_direction > 0)
+  if (fi.sort_direction >= 0) // -- unsorted keeps map order
     {
       std::pair<T,uint64_t*> item = sorted.front();
       convert_key(fi, item.second, (uint64_t *)next_key,
@@ -297,6 +307,100 @@ foreach_state_cleanup(foreach_state &s)
 {
   for (uint64_t *ptr : s.keys)
     free(ptr);
+  s.keys.clear();
+}
+
+// A break out of a foreach loop skips its final map_get_next_key call,
+// so its state, and those of loops nested in it, stay on the stack.
+// Discard the states above that of foreach_id, and when the loop is
+// starting over, its own stale state too.
+static void
+foreach_stack_unwind(foreach_stack &foreach_ctx, uint64_t foreach_id,
+                     bool restart)
+{
+  for (size_t i = foreach_ctx.size(); i-- > 0; )
+    if (foreach_ctx[i].foreach_id == foreach_id)
+      {
+        size_t keep = restart ? i : i + 1;
+        while (foreach_ctx.size() > keep)
+          {
+            foreach_state_cleanup(foreach_ctx.back());
+            foreach_ctx.pop_back();
+          }
+        return;
+      }
+}
+
+// Collect every element of the map into s, fetching many at a time
+// with BPF_MAP_LOOKUP_BATCH instead of a bpf_get_next_key() plus a
+// bpf_lookup_elem() syscall per element.  Returns false, with s left
+// empty, if the caller must walk the map one key at a time instead.
+static bool
+foreach_state_fill_batch(int fd, const bpf_map_def &attrs,
+                         const foreach_info &fi, foreach_state &s,
+                         bool use_val, bool key_long, bool val_long)
+{
+#ifdef HAVE_BPF_MAP_LOOKUP_BATCH
+  // XXX: percpu maps would need value_size * ncpus per element.
+  if (attrs.type != BPF_MAP_TYPE_HASH)
+    return false;
+
+  size_t key_size = attrs.key_size, value_size = attrs.value_size;
+  __u32 batch = 256;
+  std::vector<char> values(value_size * batch);
+  // NB: the batch cursor is opaque; for hash maps it is a bucket number.
+  std::vector<char> in_batch(std::max(key_size, sizeof(uint64_t)));
+  std::vector<char> out_batch(in_batch.size());
+  bool first = true;
+
+  for (;;)
+    {
+      char *keys = (char *)malloc(key_size * batch);
+      __u32 count = batch;
+      int rc = bpf_lookup_batch(fd, first ? NULL : in_batch.data(),
+                                out_batch.data(), keys, values.data(),
+                                &count);
+      bool done = rc != 0 && errno == ENOENT;
+      if (rc != 0 && errno == ENOSPC && count == 0)
+        {
+          // A single hash bucket holds more than batch elements.
+          free(keys);
+          batch *= 2;
+          values.resize(value_size * batch);
+          continue;
+        }
+      if (rc != 0 && !done)
+        {
+          // EINVAL etc. on kernels (or maps) without batch support.
+          free(keys);
+          foreach_state_cleanup(s);
+          s.str_sorted.clear();
+          s.int_sorted.clear();
+          return false;
+        }
+
+      s.keys.push_back((uint64_t *)keys);
+      for (__u32 i = 0; i < count; i++)
+        {
+          uint64_t *kp = (uint64_t *)(keys + i * key_size);
+          if (use_val)
+            foreach_state_add(fi, s, kp,
+                              (uint64_t *)(values.data() + i * value_size),
+                              val_long, false);
+          else // foreach_state_add extracts the column from kp
+            foreach_state_add(fi, s, kp, kp, key_long, false);
+        }
+
+      if (done)
+        return true;
+      in_batch.swap(out_batch);
+      first = false;
+    }
+#else
+  (void)fd; (void)attrs; (void)fi; (void)s;
+  (void)use_val; (void)key_long; (void)val_long;
+  return false;
+#endif
 }
 
 // Wrapper for bpf_get_next_key that includes logic for accessing
@@ -356,6 +460,11 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
   bool val_long = ctx->map_attrs[fd_idx].value_size != BPF_MAXSTRINGLEN;
   //bool val_str = !val_long;
 
+  // XXX Older .bo's may reuse a foreach_id (their sort_flags) for
+  // nested loops, so their states can't be told apart.
+  if (have_fi)
+    foreach_stack_unwind(foreach_ctx, foreach_id, !key);
+
   // Check iteration limit
   if (limit == 0)
     {
@@ -381,8 +490,32 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
       return -1;
     }
 
-  // Handle fi.sort_direction==0, where no foreach_ctx is needed
-  if (fi.sort_direction == 0)
+  // Handle fi.sort_direction==0 by taking a batched snapshot of the
+  // map (iterated in map order), if possible.
+  if (fi.sort_direction == 0 && !key)
+    {
+      foreach_state s;
+      s.foreach_id = foreach_id;
+      // The column is unused, so take it as a scalar long that never
+      // reads past the end of a short composite key:
+      if (foreach_state_fill_batch(fd, ctx->map_attrs[fd_idx], fi, s,
+                                   false, true, val_long))
+        {
+          if (foreach_state_empty(s))
+            {
+              foreach_state_cleanup(s);
+              return -1;
+            }
+          foreach_ctx.push_back(s);
+          return foreach_state_next(fi, foreach_ctx.back(), key, next_key,
+                                    strings, map_values);
+        }
+    }
+
+  // Otherwise fi.sort_direction==0 needs no foreach_ctx, and walks
+  // the map one key at a time.
+  if (fi.sort_direction == 0
+      && (foreach_ctx.empty() || foreach_ctx.back().foreach_id != foreach_id))
     {
       // handle scalar long values being passed directly
       if (key_long)
@@ -423,8 +556,12 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
       uint64_t *kp = (uint64_t *)_k;
       uint64_t *np = (uint64_t *)_n;
       foreach_state s;
+      s.foreach_id = foreach_id;
 
-      int rc = bpf_get_next_key(fd, 0, as_ptr(np));
+      int rc = -1;
+      if (!foreach_state_fill_batch(fd, ctx->map_attrs[fd_idx], fi, s,
+                                    use_val, key_long, val_long))
+        rc = bpf_get_next_key(fd, 0, as_ptr(np));
       while (!rc)
         {
           if (use_val)
@@ -448,7 +585,10 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
         }
       foreach_state_sort(s);
       if (foreach_state_empty(s))
-        return -1;
+        {
+          foreach_state_cleanup(s);
+          return -1;
+        }
       foreach_ctx.push_back(s);
     }
 
@@ -695,7 +835,8 @@ bpf_handle_transport_msg(void *buf, size_t size,
     BPF_TRANSPORT_ARG content_start;
   };
   bpf_transport_msg *_msg = (bpf_transport_msg *) buf;
-  bpf::globals::perf_event_type msg_type = (bpf::globals::perf_event_type)_msg->type;
+  bpf::globals::perf_event_type msg_type
+    = (bpf::globals::perf_event_type)BPF_TRANSPORT_TYPE(_msg->type);
   void *msg_content = (void*)&_msg->content_start;
   size_t msg_size = size - sizeof(BPF_TRANSPORT_ARG);
 
@@ -816,25 +957,140 @@ bpf_handle_transport_msg(void *buf, size_t size,
   return LIBBPF_PERF_EVENT_CONT;
 }
 
-uint64_t
-bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
-              bpf_transport_context *ctx)
+// Per-call state shared by the interpreters and bpf_call_helper().
+// Multiple threads accessing strings can cause concurrency issues for
+// procfs_probes. However, the procfs_lock should prevent this and thus,
+// clearing it on exit is unecessary for now.
+static std::vector<uint64_t *> map_values;
+static std::vector<std::string> strings;
+
+// Run helper function FUNC with arguments regs[1]..regs[5]:
+static uint64_t
+bpf_call_helper(int64_t func, const uint64_t regs[],
+                bpf_transport_context *ctx, foreach_stack foreach_ctxs[])
+{
+  bpf_map_def *map_attrs = ctx->map_attrs;
+  std::vector<int> &map_fds = *ctx->map_fds;
+  FILE *output_f = ctx->output_f;
+  uint64_t dr = 0;
+  bpf_perf_event_ret tr;
+
+  switch (func)
+    {
+    case BPF_FUNC_map_lookup_elem:
+      {
+        // allocate correctly sized buffer and store it in map_values
+        uint64_t *lookup_tmp = (uint64_t *)malloc(map_attrs[regs[1]].value_size);
+        map_values.push_back(lookup_tmp);
+
+        int res = bpf_lookup_elem(map_fds[regs[1]], as_ptr(regs[2]),
+                                  as_ptr(lookup_tmp));
+
+        if (res)
+          // element could not be found
+          dr = 0;
+        else
+          dr = as_int(lookup_tmp);
+      }
+      break;
+    case BPF_FUNC_map_update_elem:
+      dr = bpf_update_elem(map_fds[regs[1]], as_ptr(regs[2]),
+                           as_ptr(regs[3]), regs[4]);
+      break;
+    case BPF_FUNC_map_delete_elem:
+      dr = bpf_delete_elem(map_fds[regs[1]], as_ptr(regs[2]));
+      break;
+    case BPF_FUNC_ktime_get_ns:
+      dr = bpf_ktime_get_ns();
+      break;
+    case BPF_FUNC_perf_event_output:
+      /* XXX ignored, but could be checked: regs[1], regs[2], regs[3] */
+      tr = bpf_handle_transport_msg
+        ((void *)regs[4], (size_t)regs[5], ctx);
+      /* Normalize return value to match the helper API.
+         XXX: May want to look at errno as well? */
+      dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
+      break;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+    case BPF_FUNC_ringbuf_output:
+      /* XXX ignored: regs[1], regs[4] */
+      tr = bpf_handle_transport_msg
+        ((void *)regs[2], (size_t)regs[3], ctx);
+      dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
+      break;
+#endif
+    case BPF_FUNC_get_smp_processor_id:
+      dr = ctx->cpu;
+      break;
+    case BPF_FUNC_trace_printk:
+      /* XXX no longer need this code after PR22330 */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+      // regs[2] is the strlen(regs[1]) - not used by printf(3);
+      // instead we assume regs[1] string is \0 terminated
+      dr = fprintf(output_f, remove_tag(as_str(regs[1])).c_str(),
+                   /*regs[2],*/ regs[3], regs[4], regs[5]);
+      fflush(output_f);
+#pragma GCC diagnostic pop
+      break;
+    case bpf::BPF_FUNC_sprintf:
+      dr = bpf_sprintf(strings, as_str(regs[1]),
+                       regs[3], regs[4], regs[5]);
+      break;
+    case bpf::BPF_FUNC_text_str:
+      dr = bpf_text_str(strings, as_str(regs[1]), false);
+      break;
+    case bpf::BPF_FUNC_string_quoted:
+      dr = bpf_text_str(strings, as_str(regs[1]), true);
+      break;
+    case bpf::BPF_FUNC_str_concat:
+      dr = bpf_str_concat(strings, as_str(regs[1]), 
+                          as_str(regs[2]));
+      break;
+    case bpf::BPF_FUNC_map_get_next_key:
+      dr = map_get_next_key(regs[1], regs[2], regs[3],
+                            regs[4], regs[5],
+                            ctx, foreach_ctxs[regs[1]],
+                            strings, map_values);
+      break;
+    case bpf::BPF_FUNC_stapbpf_stat_get:
+      dr = stapbpf_stat_get((bpf::globals::agg_idx)regs[1], regs[2],
+                             bpf::globals::deintern_sc_type(regs[3]), ctx);
+      break;
+    case bpf::BPF_FUNC_gettimeofday_ns:
+      dr = bpf_gettimeofday_ns();
+      break;
+    case bpf::BPF_FUNC_get_target:
+      dr = bpf_get_target();
+      break;
+    case bpf::BPF_FUNC_set_procfs_value:
+      dr = bpf_set_procfs_value(as_str(regs[1]), ctx);
+      break;
+    case bpf::BPF_FUNC_append_procfs_value:
+      dr = bpf_append_procfs_value(as_str(regs[1]), ctx);
+      break;
+    case bpf::BPF_FUNC_get_procfs_value:
+      dr = bpf_get_procfs_value(ctx);
+      break;
+    default:
+      stapbpf_abort("unknown helper function");
+    }
+  return dr;
+}
+
+// The original switch-dispatch interpreter, decoding every instruction
+// each time it is executed.  Kept as a reference for the threaded
+// interpreter below; selected with STAPBPF_INTERP=switch.
+static uint64_t
+bpf_interpret_switch(size_t ninsns, const struct bpf_insn insns[],
+                     bpf_transport_context *ctx)
 {
   uint64_t result = 0; // return value
   uint64_t stack[65536 / 8]; // see MAX_BPF_USER_STACK in bpf-internal.h
   uint64_t regs[MAX_BPF_REG];
   memset(regs, 0x0, sizeof(uint64_t) * MAX_BPF_REG);
   const struct bpf_insn *i = insns;
-  static std::vector<uint64_t *> map_values;
-
-  // Multiple threads accessing strings can cause concurrency issues for
-  // procfs_probes. However, the procfs_lock should prevent this and thus,
-  // clearing it on exit is unecessary for now.
-  static std::vector<std::string> strings;
-
-  bpf_map_def *map_attrs = ctx->map_attrs;
   std::vector<int> &map_fds = *ctx->map_fds;
-  FILE *output_f = ctx->output_f;
 
   foreach_stack foreach_ctxs[map_fds.size()];
 
@@ -845,7 +1101,6 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
   while ((size_t)(i - insns) < ninsns)
     {
       uint64_t dr, sr, si, s1;
-      bpf_perf_event_ret tr;
 
       dr = regs[i->dst_reg];
       sr = regs[i->src_reg];
@@ -1038,95 +1293,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  continue;
 
 	case BPF_JMP | BPF_CALL:
-	  switch (si)
-	    {
-	    case BPF_FUNC_map_lookup_elem:
-	      {
-                // allocate correctly sized buffer and store it in map_values
-                uint64_t *lookup_tmp = (uint64_t *)malloc(map_attrs[regs[1]].value_size);
-                map_values.push_back(lookup_tmp);
-
-	        int res = bpf_lookup_elem(map_fds[regs[1]], as_ptr(regs[2]),
-			                  as_ptr(lookup_tmp));
-
-	        if (res)
-		  // element could not be found
-	          dr = 0;
-	        else
-	          dr = as_int(lookup_tmp);
-	      }
-	      break;
-	    case BPF_FUNC_map_update_elem:
-	      dr = bpf_update_elem(map_fds[regs[1]], as_ptr(regs[2]),
-			           as_ptr(regs[3]), regs[4]);
-	      break;
-	    case BPF_FUNC_map_delete_elem:
-	      dr = bpf_delete_elem(map_fds[regs[1]], as_ptr(regs[2]));
-	      break;
-	    case BPF_FUNC_ktime_get_ns:
-              dr = bpf_ktime_get_ns();
-              break;
-            case BPF_FUNC_perf_event_output:
-              /* XXX ignored, but could be checked: regs[1], regs[2], regs[3] */
-              tr = bpf_handle_transport_msg
-                ((void *)regs[4], (size_t)regs[5], ctx);
-              /* Normalize return value to match the helper API.
-                 XXX: May want to look at errno as well? */
-              dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
-              break;
-	    case BPF_FUNC_trace_printk:
-              /* XXX no longer need this code after PR22330 */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-nonliteral"
-              // regs[2] is the strlen(regs[1]) - not used by printf(3);
-              // instead we assume regs[1] string is \0 terminated
-	      dr = fprintf(output_f, remove_tag(as_str(regs[1])).c_str(),
-                           /*regs[2],*/ regs[3], regs[4], regs[5]);
-              fflush(output_f);
-#pragma GCC diagnostic pop
-	      break;
-            case bpf::BPF_FUNC_sprintf:
-              dr = bpf_sprintf(strings, as_str(regs[1]),
-                               regs[3], regs[4], regs[5]);
-              break;
-            case bpf::BPF_FUNC_text_str:
-              dr = bpf_text_str(strings, as_str(regs[1]), false);
-              break;
-            case bpf::BPF_FUNC_string_quoted:
-              dr = bpf_text_str(strings, as_str(regs[1]), true);
-              break;
-            case bpf::BPF_FUNC_str_concat:
-              dr = bpf_str_concat(strings, as_str(regs[1]), 
-                                  as_str(regs[2]));
-              break;
-            case bpf::BPF_FUNC_map_get_next_key:
-              dr = map_get_next_key(regs[1], regs[2], regs[3],
-                                    regs[4], regs[5],
-                                    ctx, foreach_ctxs[regs[1]],
-                                    strings, map_values);
-              break;
-            case bpf::BPF_FUNC_stapbpf_stat_get:
-              dr = stapbpf_stat_get((bpf::globals::agg_idx)regs[1], regs[2],
-                                     bpf::globals::deintern_sc_type(regs[3]), ctx);
-              break;
-            case bpf::BPF_FUNC_gettimeofday_ns:
-              dr = bpf_gettimeofday_ns();
-              break;
-            case bpf::BPF_FUNC_get_target:
-              dr = bpf_get_target();
-              break;
-            case bpf::BPF_FUNC_set_procfs_value:
-              dr = bpf_set_procfs_value(as_str(regs[1]), ctx);
-              break;
-            case bpf::BPF_FUNC_append_procfs_value:
-              dr = bpf_append_procfs_value(as_str(regs[1]), ctx);
-              break;
-            case bpf::BPF_FUNC_get_procfs_value:
-              dr = bpf_get_procfs_value(ctx);
-              break;
-	    default:
-	      stapbpf_abort("unknown helper function");
-	    }
+	  dr = bpf_call_helper(si, regs, ctx, foreach_ctxs);
 	  regs[0] = dr;
 	  regs[1] = 0xea7bee75;
 	  regs[2] = 0xea7bee75;
@@ -1152,6 +1319,388 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
   for (uint64_t *ptr : map_values)
     free(ptr);
   map_values.clear(); // XXX: avoid double free
+  // Loops left with a break may not have freed their states:
+  for (size_t j = 0; j < map_fds.size(); j++)
+    for (foreach_state &s : foreach_ctxs[j])
+      foreach_state_cleanup(s);
+
+  return result;
+}
+
+// The threaded interpreter decodes each program once into an array of
+// bpf_threaded_insn, holding the address of the code for its operation
+// (GCC's labels-as-values) and its operands, with BPF_K/BPF_X resolved,
+// LD_IMM64 constants assembled and jump targets turned into pointers.
+// Every operation then ends by jumping straight to the next one.
+
+#define BPF_THREADED_ALU_OPS(OP, SFX) \
+  OP(ADD##SFX) OP(SUB##SFX) OP(AND##SFX) OP(OR##SFX) OP(LSH##SFX) \
+  OP(RSH##SFX) OP(XOR##SFX) OP(MUL##SFX) OP(MOV##SFX) OP(ARSH##SFX) \
+  OP(DIV##SFX) OP(MOD##SFX)
+
+#define BPF_THREADED_JMP_OPS(OP) \
+  OP(JEQ) OP(JNE) OP(JGT) OP(JGE) OP(JSGT) OP(JSGE) OP(JSET)
+
+#define BPF_THREADED_XK(OP) OP##_X, OP##_K,
+#define BPF_THREADED_ONE(OP) OP,
+
+enum bpf_threaded_op {
+  LDX_B, LDX_H, LDX_W, LDX_DW,
+  ST_B, ST_H, ST_W, ST_DW,
+  STX_B, STX_H, STX_W, STX_DW,
+  BPF_THREADED_ALU_OPS(BPF_THREADED_XK, 64)
+  BPF_THREADED_ALU_OPS(BPF_THREADED_XK, 32)
+  NEG64, NEG32,
+  LD_IMM64, LD_MAP_FD,
+  BPF_THREADED_JMP_OPS(BPF_THREADED_XK)
+  JA, CALL, EXIT,
+  FELL_OFF_END, BAD_PSEUDO, BAD_OPCODE,
+  NUM_THREADED_OPS
+};
+
+struct bpf_threaded_insn {
+  const void *op;                   // -- label for the operation
+  const bpf_threaded_insn *target;  // -- jump target
+  uint64_t imm;                     // -- sign-extended or LD_IMM64 value
+  uint8_t dst_reg;
+  uint8_t src_reg;
+  int16_t off;
+};
+
+static bpf_threaded_op
+bpf_threaded_decode_op(const bpf_insn &insn)
+{
+  bool x = BPF_SRC(insn.code) == BPF_X;
+  switch (BPF_CLASS(insn.code))
+    {
+    case BPF_LDX:
+    case BPF_ST:
+    case BPF_STX:
+      if (BPF_MODE(insn.code) != BPF_MEM)
+        return BAD_OPCODE;
+      {
+        int base = (BPF_CLASS(insn.code) == BPF_LDX ? LDX_B
+                    : BPF_CLASS(insn.code) == BPF_ST ? ST_B : STX_B);
+        switch (BPF_SIZE(insn.code))
+          {
+          case BPF_B: return (bpf_threaded_op)(base + 0);
+          case BPF_H: return (bpf_threaded_op)(base + 1);
+          case BPF_W: return (bpf_threaded_op)(base + 2);
+          case BPF_DW: return (bpf_threaded_op)(base + 3);
+          }
+      }
+      return BAD_OPCODE;
+
+    case BPF_ALU64:
+    case BPF_ALU:
+      {
+        bool is64 = BPF_CLASS(insn.code) == BPF_ALU64;
+        int base = is64 ? ADD64_X : ADD32_X;
+        int n;
+        switch (BPF_OP(insn.code))
+          {
+          case BPF_ADD: n = 0; break;
+          case BPF_SUB: n = 1; break;
+          case BPF_AND: n = 2; break;
+          case BPF_OR: n = 3; break;
+          case BPF_LSH: n = 4; break;
+          case BPF_RSH: n = 5; break;
+          case BPF_XOR: n = 6; break;
+          case BPF_MUL: n = 7; break;
+          case BPF_MOV: n = 8; break;
+          case BPF_ARSH: n = 9; break;
+          case BPF_DIV: n = 10; break;
+          case BPF_MOD: n = 11; break;
+          case BPF_NEG:
+            // BPF_NEG is only recognized with BPF_K, as in the
+            // switch interpreter:
+            if (x)
+              return BAD_OPCODE;
+            return is64 ? NEG64 : NEG32;
+          default:
+            return BAD_OPCODE;
+          }
+        return (bpf_threaded_op)(base + 2 * n + !x);
+      }
+
+    case BPF_LD:
+      if (insn.code != (BPF_LD | BPF_IMM | BPF_DW))
+        return BAD_OPCODE;
+      switch (insn.src_reg)
+        {
+        case 0: return LD_IMM64;
+        case BPF_PSEUDO_MAP_FD: return LD_MAP_FD;
+        default: return BAD_PSEUDO;
+        }
+
+    case BPF_JMP:
+      {
+        int n;
+        switch (BPF_OP(insn.code))
+          {
+          case BPF_JEQ: n = 0; break;
+          case BPF_JNE: n = 1; break;
+          case BPF_JGT: n = 2; break;
+          case BPF_JGE: n = 3; break;
+          case BPF_JSGT: n = 4; break;
+          case BPF_JSGE: n = 5; break;
+          case BPF_JSET: n = 6; break;
+          case BPF_JA:
+            return insn.code == (BPF_JMP | BPF_JA) ? JA : BAD_OPCODE;
+          case BPF_CALL:
+            return insn.code == (BPF_JMP | BPF_CALL) ? CALL : BAD_OPCODE;
+          case BPF_EXIT:
+            return insn.code == (BPF_JMP | BPF_EXIT) ? EXIT : BAD_OPCODE;
+          default:
+            return BAD_OPCODE;
+          }
+        return (bpf_threaded_op)(JEQ_X + 2 * n + !x);
+      }
+
+    default:
+      return BAD_OPCODE;
+    }
+}
+
+// Decode ninsns instructions into out[0..ninsns], with out[ninsns] a
+// sentinel that ends the program like falling off its end does.
+// Errors are decoded into operations that report them if executed.
+static void
+bpf_threaded_decode(size_t ninsns, const struct bpf_insn insns[],
+                    const void *const labels[],
+                    std::vector<bpf_threaded_insn> &out)
+{
+  out.resize(ninsns + 1);
+  for (size_t n = 0; n < ninsns; n++)
+    {
+      const bpf_insn &insn = insns[n];
+      bpf_threaded_insn &d = out[n];
+      bpf_threaded_op op = bpf_threaded_decode_op(insn);
+
+      d.op = labels[op];
+      d.dst_reg = insn.dst_reg;
+      d.src_reg = insn.src_reg;
+      d.off = insn.off;
+      d.imm = (int64_t)insn.imm;
+      d.target = NULL;
+      if (d.dst_reg >= MAX_BPF_REG || d.src_reg >= MAX_BPF_REG)
+        d.op = labels[BAD_OPCODE];
+
+      if (op == LD_IMM64)
+        d.imm = (uint32_t)insn.imm
+          | (n + 1 < ninsns ? (uint64_t)insns[n + 1].imm << 32 : 0);
+
+      // Jumps outside the program end it, as they do in the switch
+      // interpreter.  (LD_IMM64 is a jump over its second half.)
+      if ((op >= JEQ_X && op <= JA) || op == LD_IMM64 || op == LD_MAP_FD)
+        {
+          int64_t t = (int64_t)n + 1
+            + (op == LD_IMM64 || op == LD_MAP_FD ? 1 : insn.off);
+          if (t < 0 || t > (int64_t)ninsns)
+            t = ninsns;
+          d.target = &out[t];
+        }
+    }
+
+  bpf_threaded_insn &end = out[ninsns];
+  end.op = labels[FELL_OFF_END];
+  end.target = NULL;
+  end.imm = 0;
+  end.dst_reg = end.src_reg = 0;
+  end.off = 0;
+}
+
+// Decoded programs live as long as stapbpf does, keyed by the address
+// of the ELF section data they were decoded from.
+static std::mutex threaded_progs_lock;
+static std::unordered_map<const bpf_insn *,
+                          std::vector<bpf_threaded_insn>> threaded_progs;
+
+static uint64_t
+bpf_interpret_threaded(size_t ninsns, const struct bpf_insn insns[],
+                       bpf_transport_context *ctx)
+{
+#define BPF_THREADED_LABEL_XK(OP) &&do_##OP##_X, &&do_##OP##_K,
+#define BPF_THREADED_LABEL(OP) &&do_##OP,
+  static const void *const labels[NUM_THREADED_OPS] = {
+    &&do_LDX_B, &&do_LDX_H, &&do_LDX_W, &&do_LDX_DW,
+    &&do_ST_B, &&do_ST_H, &&do_ST_W, &&do_ST_DW,
+    &&do_STX_B, &&do_STX_H, &&do_STX_W, &&do_STX_DW,
+    BPF_THREADED_ALU_OPS(BPF_THREADED_LABEL_XK, 64)
+    BPF_THREADED_ALU_OPS(BPF_THREADED_LABEL_XK, 32)
+    &&do_NEG64, &&do_NEG32,
+    &&do_LD_IMM64, &&do_LD_MAP_FD,
+    BPF_THREADED_JMP_OPS(BPF_THREADED_LABEL_XK)
+    &&do_JA, &&do_CALL, &&do_EXIT,
+    &&do_FELL_OFF_END, &&do_BAD_PSEUDO, &&do_BAD_OPCODE,
+  };
+#undef BPF_THREADED_LABEL_XK
+#undef BPF_THREADED_LABEL
+
+  const bpf_threaded_insn *prog;
+  {
+    std::lock_guard<std::mutex> guard(threaded_progs_lock);
+    auto it = threaded_progs.find(insns);
+    if (it == threaded_progs.end() || it->second.size() != ninsns + 1)
+      {
+        std::vector<bpf_threaded_insn> &d = threaded_progs[insns];
+        bpf_threaded_decode(ninsns, insns, labels, d);
+        prog = d.data();
+      }
+    else
+      prog = it->second.data();
+  }
+
+  uint64_t result = 0; // return value
+  uint64_t stack[65536 / 8]; // see MAX_BPF_USER_STACK in bpf-internal.h
+  uint64_t regs[MAX_BPF_REG];
+  memset(regs, 0x0, sizeof(uint64_t) * MAX_BPF_REG);
+  const bpf_threaded_insn *i = prog;
+  std::vector<int> &map_fds = *ctx->map_fds;
+
+  foreach_stack foreach_ctxs[map_fds.size()];
+
+  map_values.clear(); // XXX: avoid double free
+
+  regs[BPF_REG_10] = (uintptr_t)stack + sizeof(stack);
+
+#define DST regs[i->dst_reg]
+#define SRC regs[i->src_reg]
+#define NEXT do { i++; goto *i->op; } while (0)
+#define JUMP do { i = i->target; goto *i->op; } while (0)
+
+// An operation reading dr and s1 (from SRC or the immediate) and
+// writing the result back to DST:
+#define ALU_OP(OP, EXPR) \
+  do_##OP##_X: { uint64_t dr = DST, s1 = SRC; EXPR; DST = dr; NEXT; } \
+  do_##OP##_K: { uint64_t dr = DST, s1 = i->imm; EXPR; DST = dr; NEXT; }
+#define JMP_OP(OP, COND) \
+  do_##OP##_X: { uint64_t dr = DST, s1 = SRC; if (COND) JUMP; NEXT; } \
+  do_##OP##_K: { uint64_t dr = DST, s1 = i->imm; if (COND) JUMP; NEXT; }
+
+  goto *i->op;
+
+  do_LDX_B:  DST = *(uint8_t *)((uintptr_t)SRC + i->off); NEXT;
+  do_LDX_H:  DST = *(uint16_t *)((uintptr_t)SRC + i->off); NEXT;
+  do_LDX_W:  DST = *(uint32_t *)((uintptr_t)SRC + i->off); NEXT;
+  do_LDX_DW: DST = *(uint64_t *)((uintptr_t)SRC + i->off); NEXT;
+
+  do_ST_B:   *(uint8_t *)((uintptr_t)DST + i->off) = i->imm; NEXT;
+  do_ST_H:   *(uint16_t *)((uintptr_t)DST + i->off) = i->imm; NEXT;
+  do_ST_W:   *(uint32_t *)((uintptr_t)DST + i->off) = i->imm; NEXT;
+  do_ST_DW:  *(uint64_t *)((uintptr_t)DST + i->off) = i->imm; NEXT;
+  do_STX_B:  *(uint8_t *)((uintptr_t)DST + i->off) = SRC; NEXT;
+  do_STX_H:  *(uint16_t *)((uintptr_t)DST + i->off) = SRC; NEXT;
+  do_STX_W:  *(uint32_t *)((uintptr_t)DST + i->off) = SRC; NEXT;
+  do_STX_DW: *(uint64_t *)((uintptr_t)DST + i->off) = SRC; NEXT;
+
+  ALU_OP(ADD64, dr += s1)
+  ALU_OP(SUB64, dr -= s1)
+  ALU_OP(AND64, dr &= s1)
+  ALU_OP(OR64, dr |= s1)
+  ALU_OP(LSH64, dr <<= s1)
+  ALU_OP(RSH64, dr >>= s1)
+  ALU_OP(XOR64, dr ^= s1)
+  ALU_OP(MUL64, dr *= s1)
+  ALU_OP(MOV64, dr = s1)
+  ALU_OP(ARSH64, dr = (int64_t)dr >> s1)
+  ALU_OP(DIV64, if (s1 == 0) goto div_by_zero; dr /= s1)
+  ALU_OP(MOD64, if (s1 == 0) goto div_by_zero; dr %= s1)
+  do_NEG64: DST = -SRC; NEXT;
+
+  ALU_OP(ADD32, dr = (uint32_t)(dr + s1))
+  ALU_OP(SUB32, dr = (uint32_t)(dr - s1))
+  ALU_OP(AND32, dr = (uint32_t)(dr & s1))
+  ALU_OP(OR32, dr = (uint32_t)(dr | s1))
+  // coverity[overflow_before_widen:SUPPRESS]
+  ALU_OP(LSH32, dr = (uint64_t)((uint32_t)dr << s1))
+  ALU_OP(RSH32, dr = (uint32_t)dr >> s1)
+  ALU_OP(XOR32, dr = (uint32_t)(dr ^ s1))
+  ALU_OP(MUL32, dr = (uint32_t)(dr * s1))
+  ALU_OP(MOV32, dr = (uint32_t)s1)
+  ALU_OP(ARSH32, dr = (int32_t)dr >> s1)
+  ALU_OP(DIV32, if ((uint32_t)s1 == 0) goto div_by_zero;
+                dr = (uint32_t)dr / (uint32_t)s1)
+  ALU_OP(MOD32, if ((uint32_t)s1 == 0) goto div_by_zero;
+                dr = (uint32_t)dr % (uint32_t)s1)
+  do_NEG32: DST = -(uint32_t)SRC; NEXT;
+
+  do_LD_IMM64:
+    DST = i->imm;
+    JUMP;
+  do_LD_MAP_FD:
+    if (i->imm >= map_fds.size())
+      {
+        // TODO: Signal a proper error.
+        result = 0;
+        goto cleanup;
+      }
+    DST = i->imm;
+    JUMP;
+
+  JMP_OP(JEQ, dr == s1)
+  JMP_OP(JNE, dr != s1)
+  JMP_OP(JGT, dr > s1)
+  JMP_OP(JGE, dr >= s1)
+  JMP_OP(JSGT, (int64_t)dr > (int64_t)s1)
+  JMP_OP(JSGE, (int64_t)dr >= (int64_t)s1)
+  JMP_OP(JSET, dr & s1)
+  do_JA:
+    JUMP;
+
+  do_CALL:
+    regs[0] = bpf_call_helper(i->imm, regs, ctx, foreach_ctxs);
+    regs[1] = 0xea7bee75;
+    regs[2] = 0xea7bee75;
+    regs[3] = 0xea7bee75;
+    regs[4] = 0xea7bee75;
+    regs[5] = 0xea7bee75;
+    NEXT;
+
+  do_EXIT:
+    result = regs[0];
+    goto cleanup;
+
+  do_BAD_PSEUDO:
+    stapbpf_just_abort();
+  do_BAD_OPCODE:
+    stapbpf_abort("unknown bpf opcode");
+
+  div_by_zero:
+    // TODO: Signal a proper error.
+  do_FELL_OFF_END:
+    result = 0;
+
+#undef DST
+#undef SRC
+#undef NEXT
+#undef JUMP
+#undef ALU_OP
+#undef JMP_OP
+
+ cleanup:
+  for (uint64_t *ptr : map_values)
+    free(ptr);
+  map_values.clear(); // XXX: avoid double free
+  // Loops left with a break may not have freed their states:
+  for (size_t j = 0; j < map_fds.size(); j++)
+    for (foreach_state &s : foreach_ctxs[j])
+      foreach_state_cleanup(s);
 
   return result;
 }
+
+uint64_t
+bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
+              bpf_transport_context *ctx)
+{
+  // STAPBPF_INTERP=switch selects the old interpreter, for comparison.
+  static const bool use_switch = [] {
+    const char *e = getenv("STAPBPF_INTERP");
+    return e && strcmp(e, "switch") == 0;
+  }();
+
+  if (use_switch)
+    return bpf_interpret_switch(ninsns, insns, ctx);
+  return bpf_interpret_threaded(ninsns, insns, ctx);
+}
@@ -12,6 +12,7 @@
 #include <linux/if_packet.h>
 #include <linux/perf_event.h>
 #include <arpa/inet.h>
+#include "config.h"
 #include "libbpf.h"
 
 /* Older headers might not have this defined yet. */
@@ -90,6 +91,28 @@ int bpf_get_next_key(int fd, void *key, void *next_key)
 	return syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
 }
 
+#ifdef HAVE_BPF_MAP_LOOKUP_BATCH
+/* On return, *count is the number of elements copied out, also when
+   the end of the map is reached (-1 with errno ENOENT). */
+int bpf_lookup_batch(int fd, void *in_batch, void *out_batch, void *keys,
+		     void *values, __u32 *count)
+{
+	union bpf_attr attr;
+	int rc;
+        memset(&attr, 0, sizeof(union bpf_attr));
+	attr.batch.map_fd = fd;
+	attr.batch.in_batch = ptr_to_u64(in_batch);
+	attr.batch.out_batch = ptr_to_u64(out_batch);
+	attr.batch.keys = ptr_to_u64(keys);
+	attr.batch.values = ptr_to_u64(values);
+	attr.batch.count = *count;
+
+	rc = syscall(__NR_bpf, BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+	*count = attr.batch.count;
+	return rc;
+}
+#endif
+
 #define ROUND_UP(x, n) (((x) + (n) - 1u) & ~((n) - 1u))
 
 char bpf_log_buf[LOG_BUF_SIZE];
@@ -139,6 +139,17 @@ static int perf_event_page_size;
 static int perf_event_page_count = 8;
 static int perf_event_mmap_size;
 
+// Number of possible CPUs, as sized at map creation:
+static unsigned transport_ncpus;
+
+// Additional info for the ringbuf transport, which replaces the
+// perf_events when the translator emitted a BPF_MAP_TYPE_RINGBUF:
+static bool use_ringbuf = false;
+static size_t ringbuf_size;
+static unsigned long *ringbuf_consumer_pos;
+static unsigned long *ringbuf_producer_pos;
+static char *ringbuf_data;
+
 // Table of interned strings:
 static std::vector<std::string> interned_strings;
 
@@ -453,7 +464,11 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
          have max_entries equal to the number of active CPUs, which we
          wouldn't know for sure at translate time. Set it now: */
       bpf_map_type map_type = static_cast<bpf_map_type>(attrs[i].type);
-      if (map_type == BPF_MAP_TYPE_PERF_EVENT_ARRAY)
+      bool is_ringbuf = false;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+      is_ringbuf = (map_type == BPF_MAP_TYPE_RINGBUF);
+#endif
+      if (map_type == BPF_MAP_TYPE_PERF_EVENT_ARRAY || is_ringbuf)
         {
           /* XXX: Assume our only perf_event_map is the percpu transport one: */
           assert(i == bpf::globals::perf_event_map_idx);
@@ -473,7 +488,21 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
             fprintf(stderr, "WARNING: could not get number of CPUs, falling back to 1\n"); // XXX no errno
           //unsigned ncpus = get_nprocs_conf();
           mark_active_cpus((unsigned)ncpus);
+          transport_ncpus = ncpus;
           attrs[i].max_entries = ncpus;
+
+          // The ringbuf is sized in bytes instead; it must be a power
+          // of two number of pages.  Give it as much room as all the
+          // percpu perf_event buffers would have had.
+          if (is_ringbuf)
+            {
+              use_ringbuf = true;
+              size_t want = (size_t)getpagesize() * perf_event_page_count * ncpus;
+              ringbuf_size = getpagesize();
+              while (ringbuf_size < want)
+                ringbuf_size <<= 1;
+              attrs[i].max_entries = ringbuf_size;
+            }
         }
 
       if (verbose > 2)
@@ -484,6 +513,10 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
       int fd = bpf_create_map(static_cast<bpf_map_type>(attrs[i].type),
 			      attrs[i].key_size, attrs[i].value_size,
 			      attrs[i].max_entries, attrs[i].map_flags);
+      if (fd < 0 && is_ringbuf)
+        fatal("could not create the BPF ringbuf: %s\n"
+              "(rebuild the module with -DSTP_BPF_RINGBUF=0 to use perf_events instead)\n",
+              strerror(errno));
       if (fd < 0)
 	fatal("map entry %zu: %s\n", i, strerror(errno));
       map_fds[i] = fd;
@@ -1340,6 +1373,8 @@ init_internal_globals()
   std::vector<int> keys;
   keys.push_back(globals::EXIT);
   keys.push_back(globals::ERRORS);
+  if (use_ringbuf) // -- older .bo files lack this slot
+    keys.push_back(globals::TRANSPORT_DROPS);
 
   int64_t val = 0;
 
@@ -1349,13 +1384,61 @@ init_internal_globals()
       fatal("Error updating pid: %s\n", strerror(errno));
 }
 
+// Map the ringbuf used in place of the perf_event_map, and create a
+// transport context for each CPU that may send messages through it.
+static void
+init_ringbuf_transport()
+{
+  using namespace bpf;
+
+  unsigned ncpus = transport_ncpus;
+  int fd = map_fds[globals::perf_event_map_idx];
+  size_t page_size = getpagesize();
+
+  // XXX: based on ring_buffer__add() in libbpf: the consumer position
+  // page is writable, the producer position page and the data pages
+  // (mapped twice over, so records never wrap) are read-only.
+  void *cons = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cons == MAP_FAILED)
+    fatal("error mmapping ringbuf consumer page: %s\n", strerror(errno));
+  void *prod = mmap(NULL, page_size + 2 * ringbuf_size, PROT_READ, MAP_SHARED,
+                    fd, page_size);
+  if (prod == MAP_FAILED)
+    fatal("error mmapping ringbuf data: %s\n", strerror(errno));
+
+  ringbuf_consumer_pos = (unsigned long *)cons;
+  ringbuf_producer_pos = (unsigned long *)prod;
+  ringbuf_data = (char *)prod + page_size;
+
+  // Unlike the perf_event_map, the ringbuf also works for CPUs that
+  // come online later, so give every possible CPU a context:
+  for (unsigned cpu = 0; cpu < ncpus; cpu++)
+    {
+      perf_fds.push_back(-1);
+      bpf_transport_context *ctx
+        = new bpf_transport_context(cpu, fd, ncpus, map_attrs, &map_fds,
+                                    output_f, &interned_strings, &aggregates,
+                                    &foreach_loop_info, &error);
+      transport_contexts.push_back(ctx);
+    }
+
+  if (verbose > 2)
+    fprintf(stderr, "Initialized %zu byte ringbuf output\n", ringbuf_size);
+}
+
 // PR22330: Initialize perf_event_map and perf_fds.
 static void
 init_perf_transport()
 {
   using namespace bpf;
 
-  unsigned ncpus = map_attrs[globals::perf_event_map_idx].max_entries;
+  if (use_ringbuf)
+    {
+      init_ringbuf_transport();
+      return;
+    }
+
+  unsigned ncpus = transport_ncpus;
 
   for (unsigned cpu = 0; cpu < ncpus; cpu++)
     {
@@ -1790,6 +1873,19 @@ get_error_count()
   return val;
 }
 
+static int64_t
+get_transport_drops()
+{
+  int key = bpf::globals::TRANSPORT_DROPS;
+  int64_t val = 0;
+
+  if (bpf_lookup_elem
+       (map_fds[bpf::globals::internal_map_idx], &key, &val) != 0)
+    fatal("error during bpf map lookup: %s\n", strerror(errno));
+
+  return val;
+}
+
 // XXX: based on perf_event_sample
 // in kernel tools/testing/selftests/bpf/trace_helpers.c
 struct perf_event_sample {
@@ -1837,6 +1933,84 @@ perf_event_handle(struct perf_event_header *hdr, void *private_data)
   return LIBBPF_PERF_EVENT_CONT;
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+// Pass each complete record in the ringbuf to the transport context
+// of the CPU that sent it, stopping early at an STP_EXIT message.
+//
+// XXX: based on ringbuf_process_ring() in libbpf.
+static enum bpf_perf_event_ret
+ringbuf_consume()
+{
+  enum bpf_perf_event_ret ret = LIBBPF_PERF_EVENT_CONT;
+  unsigned long mask = ringbuf_size - 1;
+  unsigned long cons = __atomic_load_n(ringbuf_consumer_pos, __ATOMIC_ACQUIRE);
+  unsigned long prod = __atomic_load_n(ringbuf_producer_pos, __ATOMIC_ACQUIRE);
+
+  while (ret == LIBBPF_PERF_EVENT_CONT && cons < prod)
+    {
+      uint32_t *hdr = (uint32_t *)(ringbuf_data + (cons & mask));
+      uint32_t len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+      if (len & BPF_RINGBUF_BUSY_BIT)
+        break; // -- not committed yet
+      bool discarded = (len & BPF_RINGBUF_DISCARD_BIT) != 0;
+      len &= ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+
+      void *data = (char *)hdr + BPF_RINGBUF_HDR_SZ;
+      if (!discarded && len >= sizeof(BPF_TRANSPORT_VAL))
+        {
+          unsigned cpu = BPF_TRANSPORT_CPU(*(BPF_TRANSPORT_VAL *)data);
+          if (cpu < transport_contexts.size())
+            ret = bpf_handle_transport_msg(data, len, transport_contexts[cpu]);
+          else
+            fprintf(stderr, "WARNING: ringbuf message from unknown cpu %u\n", cpu);
+        }
+
+      cons += (len + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+      __atomic_store_n(ringbuf_consumer_pos, cons, __ATOMIC_RELEASE);
+    }
+  return ret;
+}
+
+// Listen for messages on the ringbuf.
+static void
+ringbuf_event_loop(pthread_t main_thread)
+{
+  struct pollfd pfd;
+  bool already_warned = false;
+
+  pfd.fd = map_fds[bpf::globals::perf_event_map_idx];
+  pfd.events = POLLIN;
+
+  for (;;)
+    {
+      if (verbose > 3)
+        fprintf(stderr, "Polling for ringbuf data...\n");
+      int ready = poll(&pfd, 1, 1000); // XXX: Consider setting timeout -1 (unlimited).
+      if (ready < 0 && errno == EINTR)
+        break;
+      if (ready < 0)
+        fatal("Error checking for ringbuf data: %s\n", strerror(errno));
+
+      // NB: Also drain on timeout, in case a wakeup was skipped.
+      enum bpf_perf_event_ret ret = ringbuf_consume();
+      if (ret == LIBBPF_PERF_EVENT_DONE)
+        {
+          // Saw STP_EXIT message. If the exit flag is set,
+          // wake up main thread to begin program shutdown.
+          if (get_exit_status())
+            break;
+        }
+      else if (ret != LIBBPF_PERF_EVENT_CONT && !already_warned)
+        {
+          fprintf(stderr, "WARNING: could not read from ringbuf\n");
+          already_warned = true;
+        }
+    }
+
+  pthread_kill(main_thread, SIGINT);
+}
+#endif
+
 // PR22330: Listen for perf_events.
 static void
 perf_event_loop(pthread_t main_thread)
@@ -1844,12 +2018,20 @@ perf_event_loop(pthread_t main_thread)
   // XXX: based on perf_event_poller_multi()
   // in kernel tools/testing/selftests/bpf/trace_helpers.c
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (use_ringbuf)
+    {
+      ringbuf_event_loop(main_thread);
+      return;
+    }
+#endif
+
   enum bpf_perf_event_ret ret;
   void *data = NULL;
   size_t len = 0;
 
   unsigned ncpus
-    = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
+    = transport_ncpus;
   unsigned n_active_cpus
     = count_active_cpus();
   struct pollfd *pmu_fds
@@ -2250,7 +2432,7 @@ main(int argc, char **argv)
   // XXX Done before begin probes, after load_bpf_file() sets __name__.
 
   // Create a bpf_transport_context for userspace programs:
-  unsigned ncpus = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
+  unsigned ncpus = transport_ncpus;
   bpf_transport_context uctx(default_cpu, -1/*pmu_fd*/, ncpus,
                              map_attrs, &map_fds, output_f,
                              &interned_strings, &aggregates,
@@ -2355,6 +2537,13 @@ main(int argc, char **argv)
   elf_end(module_elf);
   fclose(kmsg);
 
+  if (use_ringbuf)
+    {
+      int64_t drops = get_transport_drops();
+      if (drops > 0)
+        fprintf(stderr, "WARNING: lost %" PRId64 " messages, ringbuf was full\n", drops);
+    }
+
   int error_count = get_error_count();
 
   if (error_count > 0) {
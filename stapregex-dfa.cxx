@@ -41,6 +41,10 @@
 // Uncomment for a detailed walkthrough of the tagged-NFA conversion:
 //#define STAPREGEX_DEBUG_TNFA
 
+// Untagged DFAs with more states than this are emitted as a transition
+// table walked by a short loop, instead of as one switch per state:
+#define STAPREGEX_TABLE_STATES 32
+
 using namespace std;
 
 namespace stapregex {
@@ -48,9 +52,8 @@ namespace stapregex {
 regexp *pad_re = NULL;
 regexp *fail_re = NULL;
 
-dfa *
-stapregex_compile (regexp *re, const std::string& match_snippet,
-                   const std::string& fail_snippet)
+static void
+make_scaffolding ()
 {
   if (pad_re == NULL) {
     // build regexp for ".*"
@@ -68,19 +71,11 @@ stapregex_compile (regexp *re, const std::string& match_snippet,
     // XXX: this approach creates one extra spurious-but-safe state
     // (safe because the matching procedure stops after encountering '\0')
   }
+}
 
-  vector<string> outcomes(2);
-  outcomes[0] = fail_snippet;
-  outcomes[1] = match_snippet;
-
-  int num_tags = re->num_tags;
-
-  // Pad & wrap re in appropriate rule_ops to control match behaviour:
-  bool anchored = re->anchored ();
-  if (!anchored) re = new cat_op(pad_re, re); // -- left-padding
-  re = new rule_op(re, 1);
-  re = new alt_op(re, fail_re);
-
+static ins *
+compile_ins (regexp *re)
+{
 #ifdef STAPREGEX_DEBUG_INS
   cerr << "RESULTING INS FROM REGEX " << re << ":" << endl;
 #endif
@@ -114,6 +109,28 @@ stapregex_compile (regexp *re, const std::string& match_snippet,
   cerr << endl;
 #endif
 
+  return i;
+}
+
+dfa *
+stapregex_compile (regexp *re, const std::string& match_snippet,
+                   const std::string& fail_snippet)
+{
+  make_scaffolding ();
+
+  vector<string> outcomes(2);
+  outcomes[0] = fail_snippet;
+  outcomes[1] = match_snippet;
+
+  int num_tags = re->num_tags;
+
+  // Pad & wrap re in appropriate rule_ops to control match behaviour:
+  bool anchored = re->anchored ();
+  if (!anchored) re = new cat_op(pad_re, re); // -- left-padding
+  re = new rule_op(re, 1);
+  re = new alt_op(re, fail_re);
+
+  ins *i = compile_ins (re);
   dfa *d = new dfa(i, num_tags, outcomes);
 
   // Carefully deallocate temporary scaffolding:
@@ -127,6 +144,69 @@ stapregex_compile (regexp *re, const std::string& match_snippet,
   return d;
 }
 
+dfa *
+stapregex_compile_set (const vector<regexp *>& res,
+                       const vector<string>& match_snippets,
+                       const std::string& fail_snippet)
+{
+  make_scaffolding ();
+  assert (!res.empty() && res.size() == match_snippets.size());
+
+  // An untagged DFA stops at its first accepting state, which could
+  // belong to any of the patterns.  So each pattern is padded out to
+  // the end of the string, making every match end on the '\0', where
+  // the state prefers the highest numbered outcome; the first pattern
+  // gets the highest one.
+  unsigned n = res.size();
+  vector<string> outcomes(n + 1);
+  outcomes[0] = fail_snippet;
+
+  vector<regexp *> scaffolding; // -- deleted once the dfa is built
+  regexp *end_re = new cat_op(pad_re, new anchor_op('$'));
+  scaffolding.push_back(((cat_op *) end_re)->b);
+  scaffolding.push_back(end_re);
+
+  regexp *all = fail_re;
+  for (unsigned k = n; k-- > 0; )
+    {
+      regexp *re = res[k];
+      outcomes[n - k] = match_snippets[k];
+
+      // A trailing '$' already ends the match on the '\0'; elsewhere
+      // it would leave nothing for the padding to match:
+      bool at_end = (re->type_of() == "anchor_op"
+                     && ((anchor_op *) re)->type == '$');
+      if (re->type_of() == "cat_op")
+        {
+          regexp *last = ((cat_op *) re)->b;
+          at_end = (last->type_of() == "anchor_op"
+                    && ((anchor_op *) last)->type == '$'
+                    && !uses_end_anchor(((cat_op *) re)->a));
+        }
+      if (!at_end && uses_end_anchor(re))
+        {
+          for (unsigned j = 0; j < scaffolding.size(); j++)
+            delete scaffolding[j];
+          throw regex_error(_("'$' is only supported at the end of a pattern in a regex set"));
+        }
+
+      if (!re->anchored ())
+        scaffolding.push_back(re = new cat_op(pad_re, re)); // -- left-padding
+      if (!at_end)
+        scaffolding.push_back(re = new cat_op(re, end_re)); // -- right-padding
+      scaffolding.push_back(re = new rule_op(re, n - k));
+      scaffolding.push_back(all = new alt_op(re, all));
+    }
+
+  ins *i = compile_ins (all);
+  dfa *d = new dfa(i, 0, outcomes);
+
+  for (unsigned j = 0; j < scaffolding.size(); j++)
+    delete scaffolding[j];
+
+  return d;
+}
+
 // ------------------------------------------------------------------------
 
 /* Now follows the heart of the tagged-DFA algorithm. This is a basic
@@ -458,6 +538,13 @@ te_closure (dfa *dfa, state_kernel *start, int ntags, bool is_initial = false)
           // while *it is an iterator into closure
 
           int result = arc_compare(next.priority, (*it)->priority);
+
+          // Without tags to record, any path to an ins will do, so
+          // keep the one we have (e.g. the patterns of a match set
+          // are all padded out to the same end):
+          if (result == 0 && ntags == 0)
+            result = -1;
+
           if (result == 0)
             {
               ins *base = dfa->orig_nfa;
@@ -834,7 +921,7 @@ dfa::compute_finalizer (state *s)
 
 dfa::dfa (ins *i, int ntags, vector<string>& outcome_snippets,
           int accept_outcome)
-  : orig_nfa(i), nstates(0), nmapitems(0), ntags(ntags),
+  : orig_nfa(i), nstates(0), orig_nstates(0), nmapitems(0), ntags(ntags),
     outcome_snippets(outcome_snippets), success_outcome(accept_outcome)
 {
 #ifdef STAPREGEX_DEBUG_TNFA
@@ -993,6 +1080,102 @@ dfa::dfa (ins *i, int ntags, vector<string>& outcome_snippets,
 #ifdef STAPREGEX_DEBUG_TNFA
       cerr << endl;
 #endif
+
+  orig_nstates = nstates;
+  if (ntags == 0)
+    minimize();
+}
+
+/* Merge equivalent states by partition refinement (Moore's algorithm).
+
+   This is only done for untagged DFAs. Their transitions carry no
+   tdfa_actions, and entering an accepting state ends the match at
+   once, so two states are equivalent iff they accept with the same
+   outcome, or else go to equivalent states on every char. */
+void
+dfa::minimize ()
+{
+  vector<state *> states; // -- indexed by label
+  for (state *s = first; s != NULL; s = s->next)
+    states.push_back(s);
+
+  // Initial partition: non-accepting states, then one block per outcome.
+  vector<unsigned> block(nstates);
+  map<int, unsigned> initial;
+  for (unsigned k = 0; k < nstates; k++)
+    {
+      int key = states[k]->accepts ? (int) states[k]->accept_outcome : -1;
+      block[k] = initial.insert(make_pair(key, initial.size())).first->second;
+    }
+  unsigned nblocks = initial.size();
+
+  // Split blocks until every state in a block has the same signature,
+  // i.e. its own block followed by the blocks its spans lead to:
+  for (;;)
+    {
+      map<vector<unsigned>, unsigned> signatures;
+      vector<unsigned> new_block(nstates);
+      for (unsigned k = 0; k < nstates; k++)
+        {
+          vector<unsigned> sig(1, block[k]);
+          if (!states[k]->accepts)
+            for (list<span>::const_iterator it = states[k]->spans.begin();
+                 it != states[k]->spans.end(); it++)
+              {
+                // NB: equivalent states may split their spans differently,
+                // so only record the points where the target block changes.
+                unsigned to = block[it->to->label];
+                if (sig.size() == 1 || sig.back() != to)
+                  {
+                    sig.push_back(it->lb);
+                    sig.push_back(to);
+                  }
+              }
+          new_block[k] = signatures.insert(make_pair(sig, signatures.size())).first->second;
+        }
+      block.swap(new_block);
+      if (signatures.size() == nblocks)
+        break;
+      nblocks = signatures.size();
+    }
+
+  if (nblocks == nstates)
+    return;
+
+  // The lowest-numbered state of each block stands in for the rest;
+  // this keeps the initial state first:
+  vector<state *> rep(nblocks, (state *) NULL);
+  for (unsigned k = 0; k < nstates; k++)
+    if (rep[block[k]] == NULL)
+      rep[block[k]] = states[k];
+
+  // Redirect spans to the representatives, merging neighbours that
+  // now lead to the same state:
+  for (unsigned b = 0; b < nblocks; b++)
+    for (list<span>::iterator it = rep[b]->spans.begin();
+         it != rep[b]->spans.end(); )
+      {
+        it->to = rep[block[it->to->label]];
+        list<span>::iterator prev = it;
+        if (it != rep[b]->spans.begin() && (--prev)->to == it->to)
+          {
+            prev->ub = it->ub;
+            it = rep[b]->spans.erase(it);
+          }
+        else
+          it++;
+      }
+
+  first = last = NULL;
+  nstates = 0;
+  for (unsigned k = 0; k < states.size(); k++)
+    if (rep[block[k]] == states[k])
+      {
+        states[k]->next = NULL;
+        add_state(states[k]);
+      }
+    else
+      delete states[k];
 }
 
 dfa::~dfa ()
@@ -1181,14 +1364,107 @@ dfa::emit (translator_output *o) const
       o->newline() << "goto yyfinish;";      
     }
 
-  for (state *s = first; s; s = s->next)
-    s->emit(o, this);
+  if (ntags == 0 && !first->accepts && nstates > STAPREGEX_TABLE_STATES)
+    emit_table(o);
+  else
+    for (state *s = first; s; s = s->next)
+      {
+        // Without tags, entering an accepting state ends the match,
+        // so there is never a jump to its label:
+        if (ntags == 0 && s->accepts)
+          continue;
+        s->emit(o, this);
+      }
 
   o->newline() << "yyfinish: ;";
   o->newline(-1) << "}";
 #endif
 }
 
+/* Emit an untagged DFA as a table-driven matcher.  Chars that every
+   state treats alike share a column of the table; accepting states
+   are all replaced by one pseudo-state per outcome, numbered after
+   the non-accepting ones, at which the loop stops. */
+void
+dfa::emit_table (translator_output *o) const
+{
+  assert (ntags == 0);
+
+  vector<unsigned> index(nstates); // -- row, or pseudo-state of outcome
+  unsigned nlive = 0;
+  for (state *s = first; s; s = s->next)
+    if (!s->accepts)
+      index[s->label] = nlive++;
+  for (state *s = first; s; s = s->next)
+    if (s->accepts)
+      index[s->label] = nlive + s->accept_outcome;
+  unsigned ncodes = nlive + outcome_snippets.size();
+
+  // Compute the target of each row for each char, then share columns:
+  vector<vector<unsigned> > columns(NUM_REAL_CHARS);
+  for (state *s = first; s; s = s->next)
+    if (!s->accepts)
+      for (list<span>::const_iterator it = s->spans.begin();
+           it != s->spans.end(); it++)
+        {
+          // XXX: '\0' must end the match, as ensured by fail_re:
+          assert (it->lb != '\0' || it->to->accepts);
+          for (unsigned c = it->lb; c <= (unsigned) it->ub; c++)
+            columns[c].push_back(index[it->to->label]);
+        }
+
+  map<vector<unsigned>, unsigned> classes;
+  vector<unsigned> char_class(NUM_REAL_CHARS);
+  vector<unsigned> class_char; // -- a representative char of each class
+  for (unsigned c = 0; c < NUM_REAL_CHARS; c++)
+    {
+      pair<map<vector<unsigned>, unsigned>::iterator, bool> r
+        = classes.insert(make_pair(columns[c], classes.size()));
+      if (r.second)
+        class_char.push_back(c);
+      char_class[c] = r.first->second;
+    }
+
+  const char *elt = (ncodes <= 256 ? "unsigned char"
+                     : ncodes <= 65536 ? "unsigned short" : "unsigned int");
+
+  // The highest char value stands in for all non-ASCII chars:
+  o->newline() << "static const unsigned char yyclass[256] = {";
+  o->indent(1);
+  for (unsigned c = 0; c < 256; c++)
+    {
+      if (c % 16 == 0) o->newline();
+      o->line() << char_class[min(c, (unsigned) NUM_REAL_CHARS-1)] << ",";
+    }
+  o->newline(-1) << "};";
+
+  o->newline() << "static const " << elt << " yytrans["
+               << nlive << "][" << classes.size() << "] = {";
+  o->indent(1);
+  for (unsigned k = 0; k < nlive; k++)
+    {
+      o->newline() << "{";
+      for (unsigned j = 0; j < class_char.size(); j++)
+        o->line() << columns[class_char[j]][k] << ",";
+      o->line() << "},";
+    }
+  o->newline(-1) << "};";
+
+  o->newline() << "unsigned yys = 0;";
+  o->newline() << "do";
+  o->newline(1) << "yys = yytrans[yys][yyclass[(unsigned char) *YYCURSOR++]];";
+  o->newline(-1) << "while (yys < " << nlive << ");";
+  o->newline() << "switch (yys) {";
+  for (unsigned k = 0; k < outcome_snippets.size(); k++)
+    {
+      o->newline() << "case " << nlive + k << ":";
+      o->newline(1) << outcome_snippets[k];
+      o->newline() << "goto yyfinish;";
+      o->indent(-1);
+    }
+  o->newline() << "}";
+}
+
 void
 dfa::emit_action (translator_output *o, const tdfa_action &act) const
 {
@@ -1213,15 +1489,6 @@ dfa::emit_action (translator_output *o, const tdfa_action &act) const
     }
 }
 
-void
-dfa::emit_tagsave (translator_output *o, std::string,
-                   std::string, std::string num_final_tags) const
-{
-  // TODOXXX: ignoring other two snippets (tag_states and tag_vals),
-  // which are handled by the earlier code in the actual matcher.
-  o->newline() << num_final_tags << " = " << ntags << ";";
-}
-
 // ------------------------------------------------------------------------
 
 std::ostream&
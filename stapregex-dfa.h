@@ -138,6 +138,7 @@ struct dfa {
   ins *orig_nfa;
   state *first, *last; // -- store dfa states as a linked list
   unsigned nstates;
+  unsigned orig_nstates; // -- number of states before minimization
 
   // Infrastructure to deal with tagging:
   unsigned nmapitems;
@@ -156,8 +157,6 @@ struct dfa {
   void emit (translator_output *o) const;
 
   void emit_action (translator_output *o, const tdfa_action &act) const;
-  void emit_tagsave (translator_output *o, std::string tag_states,
-                     std::string tag_vals, std::string tag_count) const;
 
   void print (translator_output *o) const;
   void print (std::ostream& o) const;
@@ -168,6 +167,8 @@ private:
   state *find_equivalent (state *s, tdfa_action &r);
   tdfa_action compute_action (state_kernel *old_k, state_kernel *new_k);
   tdfa_action compute_finalizer (state *s);
+  void minimize ();
+  void emit_table (translator_output *o) const;
 };
 
 std::ostream& operator << (std::ostream &o, const dfa& d);
@@ -177,6 +178,13 @@ std::ostream& operator << (std::ostream &o, const dfa* d);
    or fail outcomes for an unanchored (by default) match of re. */
 dfa *stapregex_compile (regexp *re, const std::string& match_snippet, const std::string& fail_snippet);
 
+/* Produces an untagged dfa matching all of res at once, which runs
+   the match snippet of the first of them that matches the string, or
+   else the fail snippet. */
+dfa *stapregex_compile_set (const std::vector<regexp *>& res,
+                            const std::vector<std::string>& match_snippets,
+                            const std::string& fail_snippet);
+
 };
 
 #endif
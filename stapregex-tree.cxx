@@ -568,6 +568,113 @@ make_dot(bool allow_zero)
   return new match_op(new range(allow_zero ? 0 : 1, NUM_REAL_CHARS-1));
 }
 
+// ------------------------------------------------------------------------
+
+/* What we know about the literal text in matches of a regexp: every
+   match begins with prefix, ends with suffix and contains best.  If
+   exact, the regexp matches only the one string prefix (== suffix ==
+   best). */
+struct literal_info {
+  bool exact;
+  string prefix, suffix, best;
+  literal_info (bool exact = false, const string& str = "")
+    : exact(exact), prefix(str), suffix(str), best(str) {}
+};
+
+static const string&
+longer (const string& a, const string& b)
+{
+  return b.length() > a.length() ? b : a;
+}
+
+static literal_info
+find_literal (const regexp *re)
+{
+  const string type = re->type_of();
+
+  if (type == "null_op" || type == "tag_op")
+    return literal_info(true); // -- matches only the empty string
+  else if (type == "match_op")
+    {
+      // A single ASCII char; the top of the range stands for all
+      // non-ASCII chars, and '\0' never appears inside a string:
+      const range *ran = ((const match_op *) re)->ran;
+      if (ran->segments.size() == 1
+          && ran->segments[0].first == ran->segments[0].second
+          && ran->segments[0].first > 0
+          && ran->segments[0].first < NUM_REAL_CHARS-1)
+        return literal_info(true, string(1, (char) ran->segments[0].first));
+    }
+  else if (type == "cat_op")
+    {
+      const cat_op *cat = (const cat_op *) re;
+      literal_info a = find_literal(cat->a);
+      literal_info b = find_literal(cat->b);
+      if (a.exact && b.exact)
+        return literal_info(true, a.prefix + b.prefix);
+
+      literal_info r;
+      r.prefix = a.exact ? a.prefix + b.prefix : a.prefix;
+      r.suffix = b.exact ? a.suffix + b.suffix : b.suffix;
+      r.best = longer(longer(a.best, b.best), a.suffix + b.prefix);
+      return r;
+    }
+  else if (type == "close_op")
+    {
+      literal_info r = find_literal(((const close_op *) re)->re);
+      r.exact = false;
+      return r;
+    }
+  else if (type == "closev_op")
+    {
+      const closev_op *cl = (const closev_op *) re;
+      if (cl->nmin > 0)
+        {
+          literal_info r = find_literal(cl->re);
+          r.exact = false;
+          return r;
+        }
+    }
+  else if (type == "rule_op")
+    return find_literal(((const rule_op *) re)->re);
+
+  // XXX: an alt_op could yield the common prefix/suffix of its two
+  // alternatives; an anchor_op constrains the position and so is
+  // never exact.
+  return literal_info();
+}
+
+string
+required_literal (const regexp *re, bool *exact)
+{
+  literal_info r = find_literal(re);
+  if (exact) *exact = r.exact;
+  return r.best;
+}
+
+bool
+uses_end_anchor (const regexp *re)
+{
+  const string type = re->type_of();
+
+  if (type == "anchor_op")
+    return ((const anchor_op *) re)->type == '$';
+  else if (type == "alt_op")
+    return uses_end_anchor(((const alt_op *) re)->a)
+      || uses_end_anchor(((const alt_op *) re)->b);
+  else if (type == "cat_op")
+    return uses_end_anchor(((const cat_op *) re)->a)
+      || uses_end_anchor(((const cat_op *) re)->b);
+  else if (type == "close_op")
+    return uses_end_anchor(((const close_op *) re)->re);
+  else if (type == "closev_op")
+    return uses_end_anchor(((const closev_op *) re)->re);
+  else if (type == "rule_op")
+    return uses_end_anchor(((const rule_op *) re)->re);
+
+  return false;
+}
+
 };
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
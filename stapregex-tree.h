@@ -264,6 +264,15 @@ regexp *str_to_re(const std::string& str);
 regexp *make_alt(regexp* a, regexp* b);
 regexp *make_dot(bool allow_zero = false);
 
+/* Find the longest literal string that every match of re must contain,
+   e.g. "needle" for "[a-z]+needle.*".  An empty result means no literal
+   is required.  If exact is non-NULL, it is set to whether re matches
+   that literal string and nothing else. */
+std::string required_literal(const regexp *re, bool *exact = NULL);
+
+/* Does re contain a '$' anchor anywhere? */
+bool uses_end_anchor(const regexp *re);
+
 // ------------------------------------------------------------------------
 
 struct regex_error: public std::runtime_error
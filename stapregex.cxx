@@ -16,12 +16,20 @@
 
 #include "session.h"
 #include "staptree.h" // needed to use semantic_error
+#include "hash.h"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <cstdlib>
+#include <cstdio>
 #include <string>
 #include <algorithm>
 
+extern "C" {
+#include <unistd.h>
+}
+
 using namespace std;
 
 #include "stapregex-parse.h"
@@ -33,6 +41,26 @@ using namespace stapregex;
 
 // ------------------------------------------------------------------------
 
+// Shared by both kinds of regex_to_stapdfa(): note the new dfa's
+// needs and register it under key.
+static void
+add_stapdfa (systemtap_session *s, const string& key, const string& what,
+             stapdfa *dfa)
+{
+  // Update required size of subexpression-tracking data structure:
+  s->dfa_maxmap = max(s->dfa_maxmap, dfa->num_map_items());
+  s->dfa_maxtag = max(s->dfa_maxtag, dfa->num_tags());
+
+  if (s->verbose > 2 && dfa->cached())
+    clog << _F("regex %s loaded from cache: %u DFA states (%u before minimization)",
+               what.c_str(), dfa->num_states(), dfa->num_orig_states()) << endl;
+  else if (s->verbose > 2)
+    clog << _F("regex %s compiled to %u DFA states (%u before minimization)",
+               what.c_str(), dfa->num_states(), dfa->num_orig_states()) << endl;
+
+  s->dfas[key] = dfa;
+}
+
 stapdfa * 
 regex_to_stapdfa (systemtap_session *s, const string& input, const token *tok)
 {
@@ -43,66 +71,204 @@ regex_to_stapdfa (systemtap_session *s, const string& input, const token *tok)
   if (s->dfas.find(input) != s->dfas.end())
     return s->dfas[input];
 
-  stapdfa *dfa = new stapdfa ("__stp_dfa" + lex_cast(s->dfa_counter++), input, tok, true, do_tag);
+  // Tagged DFA construction can take exponential time, so keep the
+  // generated matchers in the cache:
+  string cache_path;
+  if (s->use_cache)
+    {
+      cache_path = find_regex_hash (*s, input, do_tag);
+      if (s->poison_cache)
+        unlink (cache_path.c_str());
+    }
 
-  // Update required size of subexpression-tracking data structure:
-  s->dfa_maxmap = max(s->dfa_maxmap, dfa->num_map_items());
-  s->dfa_maxtag = max(s->dfa_maxtag, dfa->num_tags());
+  stapdfa *dfa = new stapdfa ("__stp_dfa" + lex_cast(s->dfa_counter++), input, tok, true, do_tag,
+                              cache_path);
+  add_stapdfa (s, input, "\"" + input + "\"", dfa);
+  return dfa;
+}
+
+stapdfa *
+regex_to_stapdfa (systemtap_session *s, const vector<string>& inputs, const token *tok)
+{
+  // A regex never contains '\0', so this key can't be confused with
+  // that of a single regex:
+  string key = join (inputs, string(1, '\0')) + '\0';
+
+  if (s->dfas.find(key) != s->dfas.end())
+    return s->dfas[key];
+
+  string cache_path;
+  if (s->use_cache)
+    {
+      cache_path = find_regex_hash (*s, key, false);
+      if (s->poison_cache)
+        unlink (cache_path.c_str());
+    }
 
-  s->dfas[input] = dfa;
+  stapdfa *dfa = new stapdfa ("__stp_dfa" + lex_cast(s->dfa_counter++), inputs, tok, true,
+                              cache_path);
+  add_stapdfa (s, key, "set {\"" + join (inputs, "\", \"") + "\"}", dfa);
   return dfa;
 }
 
 // ------------------------------------------------------------------------
 
+static semantic_error
+compile_error (const regex_error &e, const token *tok)
+{
+  if (e.pos >= 0)
+    return SEMANTIC_ERROR(_F("regex compilation error (at position %d): %s",
+                             e.pos, e.what()), tok);
+  else
+    return SEMANTIC_ERROR(_F("regex compilation error: %s", e.what()), tok);
+}
+
 stapdfa::stapdfa (const string& func_name, const string& re,
-                  const token *tok, bool do_unescape, bool do_tag)
-  : func_name(func_name), orig_input(re), tok(tok), do_tag(do_tag)
+                  const token *tok, bool do_unescape, bool do_tag,
+                  const string& cache_path)
+  : func_name(func_name), orig_input(re), tok(tok), content(NULL),
+    do_tag(do_tag), nstates(0), orig_nstates(0), nmapitems(0), ntags(0),
+    literal_exact(false)
 {
   try
     {
       regex_parser p(re, do_unescape);
       ast = p.parse (do_tag);
+
+      // An anchored regex fails fast in the DFA anyway; otherwise a
+      // required literal lets most non-matching strings be rejected
+      // by a word-at-a-time search, without walking the DFA:
+      if (!ast->anchored ())
+        literal = required_literal (ast, &literal_exact);
+
+      if (!cache_path.empty() && load (cache_path))
+        return;
+
       content = stapregex_compile (ast, "goto match_success;", "goto match_fail;");
+      finish (cache_path);
+    }
+  catch (const regex_error &e)
+    {
+      throw compile_error (e, tok);
+    }
+}
+
+stapdfa::stapdfa (const string& func_name, const vector<string>& res,
+                  const token *tok, bool do_unescape,
+                  const string& cache_path)
+  : func_name(func_name), orig_input(join(res, "\", \"")), tok(tok),
+    ast(NULL), content(NULL), do_tag(false),
+    nstates(0), orig_nstates(0), nmapitems(0), ntags(0), literal_exact(false)
+{
+  try
+    {
+      vector<string> snippets;
+      for (unsigned k = 0; k < res.size(); k++)
+        {
+          regex_parser p(res[k], do_unescape);
+          set_asts.push_back (p.parse (false));
+          snippets.push_back ("return " + lex_cast(k + 1) + ";");
+        }
+
+      if (!cache_path.empty() && load (cache_path))
+        return;
+
+      content = stapregex_compile_set (set_asts, snippets, "goto match_fail;");
+      finish (cache_path);
     }
   catch (const regex_error &e)
     {
-      if (e.pos >= 0)
-        throw SEMANTIC_ERROR(_F("regex compilation error (at position %d): %s",
-                                e.pos, e.what()), tok);
-      else
-        throw SEMANTIC_ERROR(_F("regex compilation error: %s", e.what()), tok);
+      throw compile_error (e, tok);
     }
 }
 
+/* Record what the freshly compiled content needs, and its code: */
+void
+stapdfa::finish (const string& cache_path)
+{
+  nstates = content->nstates;
+  orig_nstates = content->orig_nstates;
+  nmapitems = content->nmapitems;
+  ntags = content->ntags;
+
+  ostringstream body;
+  translator_output to(body);
+  to.indent(1); // -- as in emit_declaration()
+  content->emit(&to);
+  code = body.str();
+
+  if (!cache_path.empty())
+    save (cache_path);
+}
+
 stapdfa::~stapdfa ()
 {
   delete content;
   delete ast;
+  for (unsigned k = 0; k < set_asts.size(); k++)
+    delete set_asts[k];
+}
+
+/* A cached matcher is a line of counts followed by the code: */
+bool
+stapdfa::load (const string& path)
+{
+  ifstream f(path.c_str());
+  string rest;
+  if (!(f >> nstates >> orig_nstates >> nmapitems >> ntags)
+      || !getline(f, rest) || !rest.empty())
+    return false;
+
+  ostringstream body;
+  body << f.rdbuf();
+  code = body.str();
+  return !code.empty();
+}
+
+void
+stapdfa::save (const string& path) const
+{
+  // Write a private copy and rename it into place, so that concurrent
+  // sessions never load a partial file:
+  string tmp = path + "." + lex_cast(getpid());
+  ofstream f(tmp.c_str());
+  f << nstates << " " << orig_nstates << " "
+    << nmapitems << " " << ntags << endl
+    << code;
+  f.close();
+  if (!f || rename (tmp.c_str(), path.c_str()) != 0)
+    unlink (tmp.c_str());
 }
 
 unsigned
 stapdfa::num_states () const
 {
-  return content->nstates;
+  return nstates;
+}
+
+unsigned
+stapdfa::num_orig_states () const
+{
+  return orig_nstates;
 }
 
 unsigned
 stapdfa::num_map_items () const
 {
-  return content->nmapitems;
+  return nmapitems;
 }
 
 unsigned
 stapdfa::num_tags () const
 {
-  return content->ntags;
+  return ntags;
 }
 
 void
 stapdfa::emit_declaration (translator_output *o) const
 {
-  o->newline() << "// DFA for \"" << orig_input << "\"";
+  o->newline() << "// DFA for " << (set_asts.empty() ? "" : "set ")
+               << "\"" << orig_input << "\"";
   o->newline() << "int " << func_name << " (struct context * __restrict__ c, const char *str);";
   o->newline() << "int " << func_name << " (struct context * __restrict__ c, const char *str) {";
   o->indent(1);
@@ -131,19 +297,23 @@ stapdfa::emit_declaration (translator_output *o) const
   // XXX: YYFILL is disabled as it doesn't play well with ^
   o->newline();
 
-  try
-    {
-      content->emit(o);
-    }
-  catch (const regex_error &e)
+  if (literal.length() == 1)
+    o->newline() << "if (!*_stp_strchrnul(str, " << (int) (unsigned char) literal[0] << "))";
+  else if (!literal.empty())
+    o->newline() << "if (!_stp_strstr(str, " << lex_cast_qstring(literal) << "))";
+  if (!literal.empty())
     {
-      if (e.pos >= 0)
-        throw SEMANTIC_ERROR(_F("regex compilation error (at position %d): %s",
-                                e.pos, e.what()), tok);
-      else
-        throw SEMANTIC_ERROR(_F("regex compilation error: %s", e.what()), tok);
+      o->newline(1) << "goto match_fail;";
+      o->indent(-1);
     }
 
+  // Without subexpressions to record, a regex that is just
+  // the literal is matched once the search has found it:
+  if (!literal.empty() && literal_exact && !do_tag)
+    o->newline() << "goto match_success;";
+  else
+    o->line() << code;
+
   if (do_tag)
     {
       o->newline() << "#undef YYTAG";
@@ -156,14 +326,18 @@ stapdfa::emit_declaration (translator_output *o) const
   o->newline() << "#undef YYLIMIT";
   o->newline() << "#undef YYMARKER";
 
-  o->newline() << "match_success:";
-  if (do_tag)
+  // A match set returns from each of its match outcomes instead:
+  if (set_asts.empty())
     {
-      o->newline() << "strlcpy (c->last_match.matched_str, str, MAXSTRINGLEN);";
-      o->newline() << "c->last_match.result = 1;";
-      content->emit_tagsave(o, "c->last_match.tag_states", "c->last_match.tag_vals", "c->last_match.num_final_tags");
+      o->newline() << "match_success:";
+      if (do_tag)
+        {
+          o->newline() << "strlcpy (c->last_match.matched_str, str, MAXSTRINGLEN);";
+          o->newline() << "c->last_match.result = 1;";
+          o->newline() << "c->last_match.num_final_tags = " << ntags << ";";
+        }
+      o->newline() << "return 1;";
     }
-  o->newline() << "return 1;";
 
   o->newline() << "match_fail:";
   if (do_tag)
@@ -198,7 +372,10 @@ void
 stapdfa::print (translator_output *o) const
 {
   o->line() << "STAPDFA (" << func_name << ", \"" << orig_input << "\") {";
-  content->print(o);
+  if (content)
+    content->print(o);
+  else
+    o->line() << code;
   o->newline(-1) << "}";
 }
 
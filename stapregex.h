@@ -16,6 +16,7 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
 
 #include "stapregex-defines.h"
 
@@ -33,12 +34,22 @@ struct stapdfa {
   std::string orig_input;
   const token *tok;
 
+  /* If cache_path is given, the generated matcher is loaded from
+     there, or else compiled and then saved there. */
   stapdfa (const std::string& func_name, const std::string& re,
-           const token *tok = NULL, bool do_unescape = true, bool do_tag = true);
+           const token *tok = NULL, bool do_unescape = true, bool do_tag = true,
+           const std::string& cache_path = "");
+  /* A match set is untagged, and returns the (1-based) index of the
+     first of res that matches, or 0: */
+  stapdfa (const std::string& func_name, const std::vector<std::string>& res,
+           const token *tok = NULL, bool do_unescape = true,
+           const std::string& cache_path = "");
   ~stapdfa ();
   unsigned num_states() const;
+  unsigned num_orig_states() const;
   unsigned num_map_items() const;
   unsigned num_tags() const;
+  bool cached() const { return content == NULL; }
 
   void emit_declaration (translator_output *o) const;
   void emit_matchop_start (translator_output *o) const;
@@ -48,8 +59,17 @@ struct stapdfa {
   void print(std::ostream& o) const;
 private:
   stapregex::regexp *ast;
-  stapregex::dfa *content;
+  std::vector<stapregex::regexp *> set_asts; // -- the patterns of a match set
+  stapregex::dfa *content; // -- NULL if loaded from the cache
   bool do_tag;
+  unsigned nstates, orig_nstates, nmapitems, ntags;
+  std::string code; // -- the body of the matcher, as emitted by content
+  std::string literal; // -- text that every match contains, or ""
+  bool literal_exact; // -- does a match consist of just literal?
+
+  void finish (const std::string& cache_path);
+  bool load (const std::string& path);
+  void save (const std::string& path) const;
 };
 
 std::ostream& operator << (std::ostream &o, const stapdfa& d);
@@ -58,6 +78,9 @@ std::ostream& operator << (std::ostream &o, const stapdfa& d);
    retrieves the corresponding dfa from s->dfas if already there: */
 stapdfa *regex_to_stapdfa (systemtap_session *s, const std::string& input, const token* tok);
 
+/* Likewise for a match set of several regexes: */
+stapdfa *regex_to_stapdfa (systemtap_session *s, const std::vector<std::string>& inputs, const token* tok);
+
 #endif
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
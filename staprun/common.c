@@ -40,6 +40,7 @@ int delete_mod;
 int load_only;
 int need_uprobes;
 const char *uprobes_path = NULL;
+const char *symbols_path = NULL;
 int daemon_mode;
 off_t fsize_max;
 int fnum_max;
@@ -51,6 +52,7 @@ int color_errors;
 color_modes color_mode;
 int monitor;
 int monitor_interval;
+int exporter_port;
 
 /* module variables */
 char *modname = NULL;
@@ -131,6 +133,7 @@ void parse_args(int argc, char **argv)
 	fnum_max = 0;
 	monitor = 0;
         monitor_interval = 1;
+	exporter_port = 0;
         remote_id = -1;
         remote_uri = NULL;
         relay_basedir_fd = -1;
@@ -138,7 +141,7 @@ void parse_args(int argc, char **argv)
         color_errors = isatty(STDERR_FILENO)
                 && strcmp(getenv("TERM") ?: "notdumb", "dumb");
 
-	while ((c = getopt(argc, argv, "ALu::vihb:t:dc:o:x:N:S:DwRr:VT:C:M:"
+	while ((c = getopt(argc, argv, "ALu::vihb:t:dc:o:x:N:S:DwRr:VT:C:M:E:K:"
 #ifdef HAVE_OPENAT
                            "F:"
 #endif
@@ -149,6 +152,9 @@ void parse_args(int argc, char **argv)
 			if (optarg)
 			  uprobes_path = strdup (optarg);
 			break;
+		case 'K':
+			symbols_path = strdup (optarg);
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -270,6 +276,13 @@ void parse_args(int argc, char **argv)
 				err(_("Invalid monitor interval\n"));
 			}
 			break;
+		case 'E':
+			exporter_port = atoi(optarg);
+			if (exporter_port < 1 || exporter_port > 65535) {
+				err(_("Invalid exporter port '%s'\n"), optarg);
+				usage(argv[0],1);
+			}
+			break;
 		default:
 			usage(argv[0],1);
 		}
@@ -343,13 +356,15 @@ void parse_args(int argc, char **argv)
 
 void usage(char *prog, int rc)
 {
-	printf(_("\n%s [-v] [-w] [-V] [-h] [-u] [-c cmd ] [-x pid] [-u user] [-A|-L|-d] [-C WHEN]\n"
+	printf(_("\n%s [-v] [-w] [-V] [-h] [-u] [-K path] [-c cmd ] [-x pid] [-u user] [-A|-L|-d] [-C WHEN]\n"
                 "\t[-b bufsize] [-R] [-r N:URI] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
 	printf(_("-v              Increase verbosity.\n"
 	"-V              Print version number and exit.\n"
 	"-h              Print this help text and exit.\n"
 	"-w              Suppress warnings.\n"
 	"-u              Load uprobes.ko\n"
+	"-K path         Load the shared symbols module at path,\n"
+	"                unless it is already loaded.\n"
 	"-c cmd          Command \'cmd\' will be run and staprun will\n"
 	"                exit when it does.  The '_stp_target' variable\n"
 	"                will contain the pid for the command.\n"
@@ -369,6 +384,7 @@ void usage(char *prog, int rc)
 #ifdef HAVE_MONITOR_LIBS                 
 	"-M INTERVAL     Enable monitor mode.\n"
 #endif
+	"-E PORT         Serve script globals as OpenMetrics text on PORT.\n"
         "-d              Delete a module.  Only detached or unused modules\n"
 	"                the user has permission to access will be deleted. Use \"*\"\n"
 	"                (quoted) to delete all unused modules.\n"
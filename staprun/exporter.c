@@ -0,0 +1,505 @@
+/* -*- linux-c -*-
+ *
+ * exporter.c - stapio native prometheus/OpenMetrics exporter
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2026 Red Hat Inc.
+ */
+
+/* With -E PORT, stapio answers HTTP GETs on PORT by reading the
+ * module's binary /proc/systemtap/MODULE/__exporter snapshot (see
+ * runtime/linux/exporter.c) and rendering it as OpenMetrics text.
+ * Each connection is served on its own thread, and each takes its own
+ * snapshot, so concurrent scrapers do not wait on one another. */
+
+#include "staprun.h"
+#include <stdarg.h>
+#include <netinet/in.h>
+
+#define EXPORTER_MAX_REQUEST 4096
+#define EXPORTER_TIMEOUT_S 10
+
+static int exporter_fd = -1;
+
+struct exporter_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+static void eb_append(struct exporter_buf *b, const char *s, size_t n)
+{
+	if (b->failed)
+		return;
+	if (b->len + n + 1 > b->size) {
+		size_t size = b->size ? b->size : 65536;
+		char *data;
+		while (b->len + n + 1 > size)
+			size *= 2;
+		data = realloc(b->data, size);
+		if (data == NULL) {
+			b->failed = 1;
+			return;
+		}
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+}
+
+static void eb_puts(struct exporter_buf *b, const char *s)
+{
+	eb_append(b, s, strlen(s));
+}
+
+static void eb_printf(struct exporter_buf *b, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+static void eb_printf(struct exporter_buf *b, const char *fmt, ...)
+{
+	char tmp[128];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		eb_append(b, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+/* Label values may contain anything; escape per the exposition format. */
+static void eb_label_value(struct exporter_buf *b, const char *s, size_t n)
+{
+	size_t i;
+	eb_puts(b, "\"");
+	for (i = 0; i < n; i++) {
+		switch (s[i]) {
+		case '\\': eb_puts(b, "\\\\"); break;
+		case '"':  eb_puts(b, "\\\""); break;
+		case '\n': eb_puts(b, "\\n"); break;
+		default:   eb_append(b, &s[i], 1); break;
+		}
+	}
+	eb_puts(b, "\"");
+}
+
+
+/* Bounds-checked reader over one snapshot. */
+struct snapshot_cursor {
+	const char *p;
+	const char *end;
+};
+
+static int sc_get(struct snapshot_cursor *c, void *dst, size_t n)
+{
+	if ((size_t)(c->end - c->p) < n)
+		return -1;
+	memcpy(dst, c->p, n);
+	c->p += n;
+	return 0;
+}
+
+static int sc_peek_tag(const struct snapshot_cursor *c, uint32_t *tag)
+{
+	if ((size_t)(c->end - c->p) < sizeof(*tag))
+		return -1;
+	memcpy(tag, c->p, sizeof(*tag));
+	return 0;
+}
+
+static int sc_get_str(struct snapshot_cursor *c, const char **s, uint32_t *len)
+{
+	if (sc_get(c, len, sizeof(*len)))
+		return -1;
+	if ((size_t)(c->end - c->p) < *len)
+		return -1;
+	*s = c->p;
+	c->p += *len;
+	return 0;
+}
+
+
+/* One decoded array element; strings point into the snapshot. */
+struct snapshot_field {
+	int64_t num;
+	const char *str;
+	uint32_t len;
+	int64_t stat[4]; /* count, sum, min, max */
+};
+
+struct snapshot_entry {
+	struct snapshot_field keys[STP_EXPORTER_MAXARITY];
+	struct snapshot_field value;
+};
+
+static int sc_get_field(struct snapshot_cursor *c, uint32_t type,
+			struct snapshot_field *f)
+{
+	switch (type) {
+	case STP_EXPORTER_INT64:
+		return sc_get(c, &f->num, sizeof(f->num));
+	case STP_EXPORTER_STRING:
+		return sc_get_str(c, &f->str, &f->len);
+	case STP_EXPORTER_STAT:
+		return sc_get(c, f->stat, sizeof(f->stat));
+	default:
+		return -1;
+	}
+}
+
+/* Returns 1 if an entry was decoded, 0 at the end of this global's
+   entries, -1 on a malformed snapshot. */
+static int sc_get_entry(struct snapshot_cursor *c,
+			const struct _stp_exporter_global *g,
+			struct snapshot_entry *e)
+{
+	uint32_t tag, i;
+
+	if (sc_peek_tag(c, &tag) || tag != STP_EXPORTER_ENTRY)
+		return 0;
+	c->p += sizeof(tag);
+	for (i = 0; i < g->arity; i++)
+		if (sc_get_field(c, g->key_types[i], &e->keys[i]))
+			return -1;
+	if (sc_get_field(c, g->value_type, &e->value))
+		return -1;
+	return 1;
+}
+
+
+static void render_labels(struct exporter_buf *b,
+			  const struct _stp_exporter_global *g,
+			  const struct snapshot_entry *e,
+			  const char *extra, const struct snapshot_field *xv)
+{
+	uint32_t i;
+
+	if (g->arity == 0 && extra == NULL)
+		return;
+	eb_puts(b, "{");
+	for (i = 0; i < g->arity; i++) {
+		eb_printf(b, "%skey%u=", i ? "," : "", i + 1);
+		if (g->key_types[i] == STP_EXPORTER_INT64) {
+			char num[32];
+			snprintf(num, sizeof(num), "%lld", (long long)e->keys[i].num);
+			eb_label_value(b, num, strlen(num));
+		} else
+			eb_label_value(b, e->keys[i].str, e->keys[i].len);
+	}
+	if (extra) {
+		eb_printf(b, "%s%s=", g->arity ? "," : "", extra);
+		eb_label_value(b, xv->str, xv->len);
+	}
+	eb_puts(b, "}");
+}
+
+/* Walk one global's entries, emitting a single metric family.  Stats
+   expand into a summary plus separate min and max gauge families, so
+   the entries are walked once per family (OpenMetrics requires each
+   family's samples to be contiguous). */
+static int render_family(struct exporter_buf *b, struct snapshot_cursor *c,
+			 const struct _stp_exporter_global *g, const char *name,
+			 const char *suffix, int stat_index)
+{
+	struct snapshot_entry e;
+	int rc;
+
+	switch (g->value_type) {
+	case STP_EXPORTER_INT64:
+		eb_printf(b, "# TYPE %.100s gauge\n", name);
+		break;
+	case STP_EXPORTER_STRING:
+		eb_printf(b, "# TYPE %.100s info\n", name);
+		break;
+	case STP_EXPORTER_STAT:
+		if (stat_index < 2)
+			eb_printf(b, "# TYPE %.100s summary\n", name);
+		else
+			eb_printf(b, "# TYPE %.100s%s gauge\n", name, suffix);
+		break;
+	}
+
+	while ((rc = sc_get_entry(c, g, &e)) == 1) {
+		eb_puts(b, name);
+		switch (g->value_type) {
+		case STP_EXPORTER_INT64:
+			render_labels(b, g, &e, NULL, NULL);
+			eb_printf(b, " %lld\n", (long long)e.value.num);
+			break;
+		case STP_EXPORTER_STRING:
+			eb_puts(b, "_info");
+			render_labels(b, g, &e, "value", &e.value);
+			eb_puts(b, " 1\n");
+			break;
+		case STP_EXPORTER_STAT:
+			if (stat_index < 2) {
+				/* _count and _sum together form the summary. */
+				eb_puts(b, "_count");
+				render_labels(b, g, &e, NULL, NULL);
+				eb_printf(b, " %lld\n", (long long)e.value.stat[0]);
+				eb_puts(b, name);
+				eb_puts(b, "_sum");
+				render_labels(b, g, &e, NULL, NULL);
+				eb_printf(b, " %lld\n", (long long)e.value.stat[1]);
+			} else {
+				eb_puts(b, suffix);
+				render_labels(b, g, &e, NULL, NULL);
+				eb_printf(b, " %lld\n", (long long)e.value.stat[stat_index]);
+			}
+			break;
+		}
+	}
+	return rc;
+}
+
+static int render_snapshot(struct exporter_buf *b, const char *data, size_t len)
+{
+	struct snapshot_cursor c = { data, data + len };
+	struct _stp_exporter_header h;
+	uint32_t tag;
+
+	if (sc_get(&c, &h, sizeof(h)) || h.tag != STP_EXPORTER_HEADER
+	    || h.magic != STP_EXPORTER_MAGIC || h.version != STP_EXPORTER_VERSION)
+		return -1;
+
+	while (sc_peek_tag(&c, &tag) == 0) {
+		struct _stp_exporter_global g;
+		struct snapshot_cursor entries;
+		char name[256];
+		const char *s;
+
+		if (tag != STP_EXPORTER_GLOBAL || sc_get(&c, &g, sizeof(g))
+		    || g.arity > STP_EXPORTER_MAXARITY
+		    || g.name_len >= sizeof(name)
+		    || (size_t)(c.end - c.p) < g.name_len)
+			return -1;
+		s = c.p;
+		c.p += g.name_len;
+		memcpy(name, s, g.name_len);
+		name[g.name_len] = '\0';
+
+		entries = c;
+		if (render_family(b, &c, &g, name, "", 0) < 0)
+			return -1;
+		if (g.value_type == STP_EXPORTER_STAT) {
+			struct snapshot_cursor again = entries;
+			if (render_family(b, &again, &g, name, "_min", 2) < 0)
+				return -1;
+			again = entries;
+			if (render_family(b, &again, &g, name, "_max", 3) < 0)
+				return -1;
+		}
+	}
+	eb_puts(b, "# EOF\n");
+	return 0;
+}
+
+static int read_snapshot(struct exporter_buf *raw)
+{
+	char path[PATH_MAX];
+	char chunk[65536];
+	ssize_t n;
+	int fd;
+
+	if (sprintf_chk(path, "/proc/systemtap/%s/__exporter", modname))
+		return -1;
+	fd = open_cloexec(path, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+		eb_append(raw, chunk, n);
+	close(fd);
+	return (n < 0 || raw->failed) ? -1 : 0;
+}
+
+
+static void send_all(int fd, const char *s, size_t n)
+{
+	while (n > 0) {
+		ssize_t w = send(fd, s, n, MSG_NOSIGNAL);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR)
+				continue;
+			return;
+		}
+		s += w;
+		n -= w;
+	}
+}
+
+static void send_response(int fd, const char *status, const char *type,
+			  const char *body, size_t len)
+{
+	char hdr[256];
+	int n = snprintf(hdr, sizeof(hdr),
+			 "HTTP/1.1 %s\r\n"
+			 "Content-Type: %s\r\n"
+			 "Content-Length: %zu\r\n"
+			 "Connection: close\r\n"
+			 "\r\n", status, type, len);
+	if (n > 0 && (size_t)n < sizeof(hdr))
+		send_all(fd, hdr, n);
+	send_all(fd, body, len);
+}
+
+static void *exporter_serve(void *arg)
+{
+	int fd = (int)(long)arg;
+	char req[EXPORTER_MAX_REQUEST];
+	size_t len = 0;
+	struct timeval tv = { EXPORTER_TIMEOUT_S, 0 };
+	char *path, *sp;
+
+	(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* We only need the request line. */
+	while (len < sizeof(req) - 1) {
+		ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (n <= 0)
+			break;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n") || strchr(req, '\n'))
+			break;
+	}
+	req[len] = '\0';
+
+	if (strncmp(req, "GET ", 4) != 0) {
+		const char msg[] = "method not allowed\n";
+		send_response(fd, "405 Method Not Allowed", "text/plain",
+			      msg, sizeof(msg) - 1);
+		goto out;
+	}
+	path = req + 4;
+	sp = strpbrk(path, " ?\r\n");
+	if (sp)
+		*sp = '\0';
+
+	if (strcmp(path, "/") == 0 || strcmp(path, "/metrics") == 0) {
+		struct exporter_buf raw = { NULL, 0, 0, 0 };
+		struct exporter_buf text = { NULL, 0, 0, 0 };
+
+		if (read_snapshot(&raw) == 0
+		    && render_snapshot(&text, raw.data, raw.len) == 0
+		    && !text.failed)
+			send_response(fd, "200 OK",
+				      "application/openmetrics-text; version=1.0.0; charset=utf-8",
+				      text.data, text.len);
+		else {
+			const char msg[] = "cannot read script globals, try again later\n";
+			dbug(1, "exporter snapshot failed\n");
+			send_response(fd, "503 Service Unavailable", "text/plain",
+				      msg, sizeof(msg) - 1);
+		}
+		free(raw.data);
+		free(text.data);
+	} else {
+		const char msg[] = "not found\n";
+		send_response(fd, "404 Not Found", "text/plain",
+			      msg, sizeof(msg) - 1);
+	}
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *exporter_accept(void *arg)
+{
+	sigset_t sigs;
+
+	/* Leave signal handling to the main loop. */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	while (1) {
+		pthread_t t;
+		int fd = accept4(exporter_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED
+			    || errno == EMFILE || errno == ENFILE) {
+				if (errno == EMFILE || errno == ENFILE)
+					usleep(100 * 1000);
+				continue;
+			}
+			_perr("exporter accept");
+			break;
+		}
+		if (pthread_create(&t, NULL, exporter_serve, (void *)(long)fd) == 0)
+			pthread_detach(t);
+		else
+			exporter_serve((void *)(long)fd);
+	}
+	return arg;
+}
+
+void exporter_setup(void)
+{
+	struct sockaddr_in6 addr6;
+	struct sockaddr_in addr4;
+	int one = 1, zero = 0;
+	pthread_t t;
+
+	exporter_fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (exporter_fd >= 0) {
+		(void) setsockopt(exporter_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		(void) setsockopt(exporter_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+		memset(&addr6, 0, sizeof(addr6));
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_addr = in6addr_any;
+		addr6.sin6_port = htons(exporter_port);
+		if (bind(exporter_fd, (struct sockaddr *)&addr6, sizeof(addr6)) < 0) {
+			close(exporter_fd);
+			exporter_fd = -1;
+		}
+	}
+	if (exporter_fd < 0) {
+		/* No IPv6; fall back to IPv4 only. */
+		exporter_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (exporter_fd < 0) {
+			_perr("exporter socket");
+			return;
+		}
+		(void) setsockopt(exporter_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		memset(&addr4, 0, sizeof(addr4));
+		addr4.sin_family = AF_INET;
+		addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr4.sin_port = htons(exporter_port);
+		if (bind(exporter_fd, (struct sockaddr *)&addr4, sizeof(addr4)) < 0) {
+			err(_("Couldn't bind exporter port %d: %s\n"),
+			    exporter_port, strerror(errno));
+			goto fail;
+		}
+	}
+	if (listen(exporter_fd, 64) < 0) {
+		_perr("exporter listen");
+		goto fail;
+	}
+	if (pthread_create(&t, NULL, exporter_accept, NULL) != 0) {
+		_perr("Failed to create exporter thread");
+		goto fail;
+	}
+	pthread_detach(t);
+	dbug(1, "exporter listening on port %d\n", exporter_port);
+	return;
+
+fail:
+	close(exporter_fd);
+	exporter_fd = -1;
+}
+
+void exporter_cleanup(void)
+{
+	if (exporter_fd >= 0) {
+		shutdown(exporter_fd, SHUT_RDWR);
+		close(exporter_fd);
+		exporter_fd = -1;
+	}
+}
@@ -276,6 +276,9 @@ void cleanup_and_exit(int detach, int rc)
   if (read_stdin)
     read_stdin_cleanup();
 
+  if (exporter_port)
+    exporter_cleanup();
+
   if (exiting)
     return;
   exiting = 1;
@@ -471,6 +474,9 @@ int stp_main_loop(void)
   if (read_stdin)
       read_stdin_setup();
 
+  if (exporter_port)
+      exporter_setup();
+
   /* In monitor mode, we must timeout pselect to poll the monitor
      interface. In non-monitor mode, we must timeout pselect so that
      we can handle pending_interrupts. */
@@ -177,6 +177,30 @@ static int enable_uprobes(void)
 	return 1; /* failure */
 }
 
+/*
+ * Module to be inserted takes the kernel's symbol and unwind data from
+ * a shared symbols module.  Its name is a hash of its contents, so if
+ * another script already loaded it, that one will do.  It stays loaded
+ * after we exit, for the next script.
+ */
+static int enable_symbols_module(void)
+{
+	char *argv[1];
+	int rc;
+
+	dbug(2, "Inserting shared symbols module from %s.\n", symbols_path);
+	/* Like uprobes.ko, this may only be loaded by privileged users,
+	   or be signed.  */
+	argv[0] = NULL;
+	rc = insert_module(symbols_path, NULL, argv, assert_uprobes_module_permissions, NULL);
+	if ((rc == 0) || /* OK */
+	    (rc == -EEXIST)) /* Someone else already loaded it */
+		return 0;
+
+	err("Couldn't insert module '%s': %s\n", symbols_path, moderror(errno));
+	return 1; /* failure */
+}
+
 static int insert_stap_module(privilege_t *user_credentials)
 {
 	char special_options[128];
@@ -413,6 +437,9 @@ int init_staprun(void)
 		if (need_uprobes && enable_uprobes() != 0)
 			return -1;
 
+		if (symbols_path && enable_symbols_module() != 0)
+			return -1;
+
                 disable_kprobes_optimization();
 
 		if (insert_stap_module(& user_credentials) < 0) {
@@ -266,6 +266,9 @@ void monitor_render(void);
 void monitor_input(void);
 void monitor_exited(void);
 void monitor_remember_output_line(const char* buf, const size_t bytes);
+/* exporter.c */
+void exporter_setup(void);
+void exporter_cleanup(void);
 
 /*
  * variables
@@ -299,6 +302,7 @@ extern int delete_mod;
 extern int load_only;
 extern int need_uprobes;
 extern const char *uprobes_path;
+extern const char *symbols_path;
 extern int daemon_mode;
 extern off_t fsize_max;
 extern int fnum_max;
@@ -308,6 +312,7 @@ extern int relay_basedir_fd;
 extern int color_errors;
 extern int monitor;
 extern int monitor_interval;
+extern int exporter_port;
 
 typedef enum {color_never, color_auto, color_always} color_modes;
 extern color_modes color_mode;
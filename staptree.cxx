@@ -213,7 +213,7 @@ vardecl::compatible_arity (int a)
 
 functiondecl::functiondecl ():
   body (0), synthetic (false), mangle_oldstyle (false), has_next(false), cloned_p(false),
-  priority(1)
+  inlined(false), priority(1)
 {
 }
 
@@ -456,12 +456,29 @@ void regex_query::print (ostream& o) const
 {
   // NB: we need a custom printer, because the parser does not accept
   // a parenthesized RHS.
+  if (!others.empty())
+    {
+      o << "regexp_match_set(" << *left << ", " << *right;
+      for (unsigned i=0; i<others.size(); i++)
+        o << ", " << *others[i];
+      o << ")";
+      return;
+    }
   o << "(" << *left << ") "
     << op
     << " " << *right;
 }
 
 
+vector<string> regex_query::patterns () const
+{
+  vector<string> result (1, right->value);
+  for (unsigned i=0; i<others.size(); i++)
+    result.push_back (others[i]->value);
+  return result;
+}
+
+
 void unary_expression::print (ostream& o) const
 {
   o << op << '(' << *operand << ")";
@@ -2113,6 +2130,8 @@ traversing_visitor::visit_regex_query (regex_query* e)
 {
   e->left->visit (this);
   e->right->visit (this);
+  for (unsigned i=0; i<e->others.size(); i++)
+    e->others[i]->visit (this);
 }
 
 void
@@ -3594,6 +3613,8 @@ update_visitor::visit_regex_query (regex_query* e)
 {
   replace (e->left);
   replace (e->right); // XXX: do we *need* to replace literal in RHS?
+  for (unsigned i=0; i<e->others.size(); i++)
+    replace (e->others[i]);
   provide (e);
 }
 
@@ -256,6 +256,10 @@ struct regex_query: public expression
   expression* left;
   interned_string op;
   literal_string* right;
+  // A match set also tries these patterns after right; its value is
+  // the (1-based) index of the first one that matches, or else 0.
+  std::vector<literal_string*> others;
+  std::vector<std::string> patterns () const;
   void visit (visitor* u);
   void print (std::ostream& o) const;
 };
@@ -686,6 +690,7 @@ struct functiondecl: public symboldecl
   bool mangle_oldstyle;
   bool has_next;
   bool cloned_p; // during probe-derivation time
+  bool inlined; // some calls were replaced by the body
   int64_t priority;
   functiondecl ();
   void print (std::ostream& o) const;
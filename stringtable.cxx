@@ -14,6 +14,7 @@
 #include <string>
 #include <cstring>
 #include <fstream>
+#include <mutex>
 #include <unordered_set>
 
 
@@ -80,6 +81,7 @@ typedef unordered_set<std::string> stringtable_t;
 
 static char chartable[256];
 static stringtable_t stringtable;
+static std::mutex stringtable_lock; // for the per-probe threads of pass 2
 // XXX: set a larger initial size?  For reference, a
 //
 //    probe kernel.function("*") {}
@@ -103,6 +105,7 @@ interned_string interned_string::intern(const string& value)
   if (value.size() == 1)
     return intern(value[0]);
 
+  std::lock_guard<std::mutex> guard(stringtable_lock);
   pair<stringtable_t::iterator,bool> result = stringtable.insert(value);
   PROBE2(stap, intern_string, value.c_str(), result.second);
   stringtable_t::iterator it = result.first; // persistent iterator!
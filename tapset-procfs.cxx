@@ -24,6 +24,7 @@ using namespace __gnu_cxx;
 static const string TOK_PROCFS("procfs");
 static const string TOK_READ("read");
 static const string TOK_WRITE("write");
+static const string TOK_STREAM("stream");
 static const string TOK_MAXSIZE("maxsize");
 static const string TOK_UMASK("umask");
 
@@ -36,17 +37,21 @@ struct procfs_derived_probe: public derived_probe
 {
   string path;
   bool write;
+  bool stream;
   bool target_symbol_seen;
   int64_t maxsize_val;
   int64_t umask; 
   string variable_name;
 
-  procfs_derived_probe (systemtap_session &, probe* p, probe_point* l, string ps, bool w, int64_t m, int64_t umask); 
+  procfs_derived_probe (systemtap_session &, probe* p, probe_point* l, string ps, bool w, bool st, int64_t m, int64_t umask); 
   void join_group (systemtap_session& s);
 
   // Set up this procfs probe to use a static C variable as input
   // instead using the probe body.
   void use_internal_buffer(const std::string& var);
+
+  // run by reads and writes of the procfs file
+  bool infrequent_p () { return true; }
 };
 
 
@@ -118,10 +123,12 @@ sort_for_bpf(systemtap_session& s __attribute__ ((unused)),
 struct procfs_var_expanding_visitor: public var_expanding_visitor
 {
   procfs_var_expanding_visitor(systemtap_session& s,
-                               string path, bool write_probe);
+                               string path, bool write_probe,
+                               bool stream_probe);
 
   string path;
   bool write_probe;
+  bool stream_probe;
   bool target_symbol_seen;
 
   void visit_target_symbol (target_symbol* e);
@@ -130,12 +137,12 @@ struct procfs_var_expanding_visitor: public var_expanding_visitor
 
 procfs_derived_probe::procfs_derived_probe (systemtap_session &s, probe* p,
                                             probe_point* l, string ps, bool w,
-					    int64_t m, int64_t umask):  
-    derived_probe(p, l), path(ps), write(w), target_symbol_seen(false),
-    maxsize_val(m), umask(umask) 
+					    bool st, int64_t m, int64_t umask):  
+    derived_probe(p, l), path(ps), write(w), stream(st),
+    target_symbol_seen(false), maxsize_val(m), umask(umask) 
 {
   // Expand local variables in the probe body
-  procfs_var_expanding_visitor v (s, path, write);
+  procfs_var_expanding_visitor v (s, path, write, stream);
   var_expand_const_fold_loop (s, this->body, v);
   target_symbol_seen = v.target_symbol_seen;
   if (path.compare("__stdin") == 0) s.read_stdin = true;
@@ -324,6 +331,8 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
 	  if (pset->read_probe != NULL)
 	    s.op->line() << " .read_probe="
 			 << common_probe_init (pset->read_probe) << ",";
+	  if (pset->read_probe != NULL && pset->read_probe->stream)
+	    s.op->line() << " .stream=1,";
 
           if (pset->write_probes.size() > 0)
             s.op->line() << " .write_probes=stap_procfs_write_probes.path_"
@@ -374,6 +383,7 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->newline() << "pdata.buffer = spp->buffer;";
       s.op->newline() << "pdata.bufsize = spp->bufsize;";
       s.op->newline() << "pdata.count = spp->count;";
+      s.op->newline() << "pdata.offset = spp->offset;";
       s.op->newline() << "if (c->ips.procfs_data == NULL)";
       s.op->newline(1) << "c->ips.procfs_data = &pdata;";
       s.op->newline(-1) << "else {";
@@ -507,9 +517,10 @@ procfs_derived_probe_group::emit_module_exit (systemtap_session& s)
 
 procfs_var_expanding_visitor::procfs_var_expanding_visitor (systemtap_session& s,
 							    string path,
-							    bool write_probe):
+							    bool write_probe,
+							    bool stream_probe):
   var_expanding_visitor (s), path (path), write_probe (write_probe),
-  target_symbol_seen (false)
+  stream_probe (stream_probe), target_symbol_seen (false)
 {
   // procfs probes can also handle '.='.
   valid_ops.insert (".=");
@@ -523,8 +534,41 @@ procfs_var_expanding_visitor::visit_target_symbol (target_symbol* e)
     {
       assert(e->name.size() > 0 && e->name[0] == '$');
 
+      if (e->name == "$offset" && stream_probe)
+        {
+          e->assert_no_components("procfs");
+          if (is_active_lvalue(e))
+            throw SEMANTIC_ERROR(_("procfs $offset variable is read-only"), e->tok);
+          if (e->addressof)
+            throw SEMANTIC_ERROR(_("cannot take address of procfs variable"), e->tok);
+
+          // The chunk number of this run of a .read.stream probe.
+          functiondecl *fdecl = new functiondecl;
+          fdecl->synthetic = true;
+          fdecl->tok = e->tok;
+          embeddedcode *ec = new embeddedcode;
+          ec->tok = e->tok;
+          ec->code = string("    struct _stp_procfs_data *data = (struct _stp_procfs_data *)(CONTEXT->ips.procfs_data); /* pure */ /* stable */\n")
+            + string("    STAP_RETVALUE = data->offset;\n");
+
+          string fname = "__private_" + detox_path(string(e->tok->location.file->name))
+            + "_procfs_offset_get" + lex_cast(++tick);
+          fdecl->unmangled_name = fdecl->name = fname;
+          fdecl->body = ec;
+          fdecl->type = pe_long;
+          fdecl->join (sess);
+
+          functioncall* n = new functioncall;
+          n->tok = e->tok;
+          n->function = fname;
+          provide (n);
+          return;
+        }
+
       if (e->name != "$value")
-        throw SEMANTIC_ERROR (_("invalid target symbol for procfs probe, $value expected"),
+        throw SEMANTIC_ERROR (stream_probe
+                              ? _("invalid target symbol for procfs probe, $value or $offset expected")
+                              : _("invalid target symbol for procfs probe, $value expected"),
                               e->tok);
 
       e->assert_no_components("procfs");
@@ -677,6 +721,7 @@ procfs_builder::build(systemtap_session & sess,
   bool has_procfs = get_param(parameters, TOK_PROCFS, path);
   bool has_read = (parameters.find(TOK_READ) != parameters.end());
   bool has_write = (parameters.find(TOK_WRITE) != parameters.end());
+  bool has_stream = (parameters.find(TOK_STREAM) != parameters.end());
   bool has_umask = (parameters.find(TOK_UMASK) != parameters.end()); 
   int64_t maxsize_val = 0;
   int64_t umask_val;
@@ -746,8 +791,12 @@ procfs_builder::build(systemtap_session & sess,
   if (!(has_read ^ has_write))
     throw SEMANTIC_ERROR (_("need read/write component"), location->components.front()->tok);
 
+  if (has_stream && sess.runtime_mode == systemtap_session::bpf_runtime)
+    throw SEMANTIC_ERROR (_("procfs read.stream probes are not supported in the bpf runtime"),
+                          location->components.front()->tok);
+
   finished_results.push_back(new procfs_derived_probe(sess, base, location,
-                                                      path, has_write,
+                                                      path, has_write, has_stream,
 						      maxsize_val, umask_val));
 }
 
@@ -767,6 +816,15 @@ register_tapset_procfs(systemtap_session& s)
   root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(builder);
   root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(builder);
 
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind(TOK_STREAM)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(TOK_STREAM)->bind(builder);
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind(TOK_STREAM)->bind_num(TOK_MAXSIZE)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(TOK_STREAM)->bind_num(TOK_MAXSIZE)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind(TOK_STREAM)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(TOK_STREAM)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind(TOK_STREAM)->bind_num(TOK_MAXSIZE)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(TOK_STREAM)->bind_num(TOK_MAXSIZE)->bind(builder);
+
   root->bind(TOK_PROCFS)->bind(TOK_WRITE)->bind(builder);
   root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_WRITE)->bind(builder);
   root->bind_str(TOK_PROCFS)->bind(TOK_WRITE)->bind(builder);
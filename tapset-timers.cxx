@@ -41,6 +41,9 @@ struct timer_derived_probe: public derived_probe
   // users.
   void emit_privilege_assertion (translator_output*) {}
   void print_dupe_stamp(ostream& o) { print_dupe_stamp_unprivileged (o); }
+
+  // 10 jiffies are at least 10ms, even with HZ=1000
+  bool infrequent_p () { return interval - randomize >= 10; }
 };
 
 
@@ -136,10 +139,12 @@ timer_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->line() << ");";
   s.op->newline(-1) << "{";
   s.op->indent(1);
+  bool tiny = all_probes_tiny (probes);
   common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "stp->probe",
-				 "stp_probe_type_timer");
+				 "stp_probe_type_timer", true, NULL, NULL, NULL,
+				 tiny);
   s.op->newline() << "(*stp->probe->ph) (c);";
-  common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
+  common_probe_entryfn_epilogue (s, true, otf_safe_context(s), tiny);
   s.op->newline(-1) << "}";
   s.op->newline(-1) << "}";
 }
@@ -222,6 +227,8 @@ struct hrtimer_derived_probe: public derived_probe
   // unprivileged users.
   void emit_privilege_assertion (translator_output*) {}
   void print_dupe_stamp(ostream& o) { print_dupe_stamp_unprivileged (o); }
+
+  bool infrequent_p () { return interval - randomize >= 10000000LL; }
 };
 
 
@@ -293,10 +300,12 @@ hrtimer_derived_probe_group::emit_module_decls (systemtap_session& s)
 
       s.op->newline() << "{";
       s.op->indent(1);
+      bool tiny = all_probes_tiny (probes);
       common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "stp->probe",
-				     "stp_probe_type_hrtimer");
+				     "stp_probe_type_hrtimer", true, NULL, NULL,
+				     NULL, tiny);
       s.op->newline() << "(*stp->probe->ph) (c);";
-      common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
+      common_probe_entryfn_epilogue (s, true, otf_safe_context(s), tiny);
       s.op->newline(-1) << "}";
       s.op->newline() << "return rc;";
       s.op->newline(-1) << "}";
@@ -508,7 +517,7 @@ profile_derived_probe_group::emit_module_decls (systemtap_session& s)
           // XXX: STP_TIMING stats are also not correct
           s.op->newline() << "probe = " << common_probe_init (probes[i]) << ";";
           s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
-          s.op->newline() << "c->probe_name = probe->pn;";
+          s.op->newline() << "c->probe_name = stap_probe_string(probe->pn);";
           s.op->newline() << "#endif";
 	   if(!s.suppress_time_limits)
 	     {
@@ -24,6 +24,7 @@
 #include "setupdwfl.h"
 #include "loc2stap.h"
 #include "analysis.h"
+#include "btf.h"
 #include <gelf.h>
 
 #include "sdt_types.h"
@@ -96,7 +97,7 @@ common_probe_entryfn_prologue (systemtap_session& s,
 			       string probe_type, bool overload_processing,
 			       void (*declaration_callback)(systemtap_session& s, void *data),
 			       void (*pre_context_callback)(systemtap_session& s, void *data),
-			       void *callback_data)
+			       void *callback_data, bool tiny)
 {
   if (s.runtime_usermode_p())
     {
@@ -201,8 +202,17 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline();
   s.op->newline() << "c->aborted = 0;";
   s.op->newline() << "c->locked = 0;";
-  s.op->newline() << "c->last_stmt = 0;";
   s.op->newline() << "c->last_error = 0;";
+  s.op->newline() << "c->probe_point = " << probe << "->pp;";
+  s.op->newline() << "c->probe_type = " << probe_type << ";";
+
+  // Tiny handlers (see derived_probe::tiny) touch nothing but their
+  // locals and numeric globals, never fail and call no functions, so
+  // they never read the rest; any other probe resets it for itself.
+  if (tiny)
+    return;
+
+  s.op->newline() << "c->last_stmt = 0;";
   s.op->newline() << "c->nesting = -1;"; // NB: PR10516 packs locals[] tighter
   s.op->newline() << "c->uregs = 0;";
   s.op->newline() << "c->kregs = 0;";
@@ -212,11 +222,9 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "#endif";
   if (s.runtime_usermode_p())
     s.op->newline() << "c->probe_index = " << probe << "->index;";
-  s.op->newline() << "c->probe_point = " << probe << "->pp;";
   s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
-  s.op->newline() << "c->probe_name = " << probe << "->pn;";
+  s.op->newline() << "c->probe_name = stap_probe_string(" << probe << "->pn);";
   s.op->newline() << "#endif";
-  s.op->newline() << "c->probe_type = " << probe_type << ";";
   // reset Individual Probe State union
   s.op->newline() << "memset(&c->ips, 0, sizeof(c->ips));";
   s.op->newline() << "c->user_mode_p = 0; c->full_uregs_p = 0; ";
@@ -257,7 +265,8 @@ common_probe_entryfn_prologue (systemtap_session& s,
 void
 common_probe_entryfn_epilogue (systemtap_session& s,
                                bool overload_processing,
-                               bool schedule_work_safe)
+                               bool schedule_work_safe,
+                               bool tiny)
 {
   if (!s.runtime_usermode_p()
       && schedule_work_safe)
@@ -361,7 +370,8 @@ common_probe_entryfn_epilogue (systemtap_session& s,
   s.op->newline() << "c->probe_type = 0;";
 
 
-  s.op->newline() << "if (unlikely (c->last_error)) {";
+  // A tiny handler can't have set last_error.
+  s.op->newline() << "if (" << (tiny ? "0 && " : "") << "unlikely (c->last_error)) {";
   s.op->indent(1);
   if (s.suppress_handler_errors) // PR 13306
     {
@@ -4962,11 +4972,15 @@ struct dwarf_cast_expanding_visitor: public var_expanding_visitor
 {
   dwarf_builder& db;
   map<string,string> compiled_headers;
+  map<string,btf_reader*> btf_readers;
 
   dwarf_cast_expanding_visitor(systemtap_session& s, dwarf_builder& db):
     var_expanding_visitor(s), db(db) {}
+  ~dwarf_cast_expanding_visitor();
   void visit_cast_op (cast_op* e);
   void filter_special_modules(string& module);
+  btf_reader* get_btf(cast_op* e, const string& module);
+  functioncall* btf_cast_query(cast_op* e, const string& module, bool lvalue);
 };
 
 
@@ -5076,6 +5090,294 @@ dwarf_cast_query::handle_query_module()
 }
 
 
+dwarf_cast_expanding_visitor::~dwarf_cast_expanding_visitor()
+{
+  for (auto it = btf_readers.begin(); it != btf_readers.end(); ++it)
+    delete it->second;
+}
+
+
+// Load the BTF describing MODULE: --btf or the running kernel's vmlinux,
+// plus the module's own split BTF.  NULL if there is none to be had.
+btf_reader*
+dwarf_cast_expanding_visitor::get_btf(cast_op* e, const string& module)
+{
+  // Only the kernel and modules named as such; not typequery modules
+  // built from headers, nor modules given by path.
+  string name = (module.empty() || module == "kernel") ? "kernel" : module;
+  if (name.find('/') != string::npos || endswith(name, ".ko"))
+    return NULL;
+
+  auto it = btf_readers.find(name);
+  if (it != btf_readers.end())
+    return it->second;
+
+  // The BTF under /sys only describes the kernel we're running on.
+  btf_reader* btf = NULL;
+  if (!sess.btf_path.empty() || sess.native_build)
+    {
+      btf = new btf_reader;
+      try
+        {
+          btf->load(sess.btf_path.empty() ? "/sys/kernel/btf/vmlinux"
+                    : sess.btf_path);
+          if (name != "kernel")
+            {
+              if (!sess.native_build)
+                throw SEMANTIC_ERROR(_F("no BTF for module %s of kernel %s",
+                                        name.c_str(), sess.kernel_release.c_str()));
+              btf->load("/sys/kernel/btf/" + name);
+            }
+          if (sess.verbose > 2)
+            clog << _F("Pass 2: using BTF for %s", name.c_str()) << endl;
+        }
+      catch (const semantic_error& er)
+        {
+          e->chain (er);
+          delete btf;
+          btf = NULL;
+        }
+    }
+  btf_readers[name] = btf;
+  return btf;
+}
+
+
+static expression*
+btf_deref(const token* tok, expression* addr, unsigned size, bool signed_p)
+{
+  target_deref *d = new target_deref;
+  d->tok = tok;
+  d->addr = addr;
+  d->size = size;
+  d->signed_p = signed_p;
+  d->userspace_p = false;
+  return d;
+}
+
+
+// Like synthetic_embedded_deref_call, but for a VALUE computed from BTF.
+// There's no DWARF to hang type_details on, so the result can't be
+// dereferenced any further as an autocast.
+static functioncall*
+synthetic_btf_deref_call(systemtap_session& s, location_context& ctx,
+                         const string& function_name, expression* value,
+                         expression* pointer)
+{
+  target_symbol *e = ctx.e;
+  const target_symbol *e_orig = ctx.e_orig;
+  const token *tok = e->tok;
+
+  string fhash = detox_path(string(tok->location.file->name));
+  functiondecl *fdecl = new functiondecl;
+  fdecl->synthetic = true;
+  fdecl->tok = tok;
+  fdecl->unmangled_name = fdecl->name = "__private_" + fhash + function_name;
+  fdecl->type = pe_long;
+
+  functioncall* fcall = new functioncall;
+  fcall->tok = tok;
+  fcall->referents.push_back(fdecl);
+  fcall->function = fdecl->name;
+  fcall->type = fdecl->type;
+
+  fdecl->formal_args.push_back(ctx.pointer);
+  fcall->args.push_back(pointer);
+
+  fdecl->formal_args.insert(fdecl->formal_args.end(),
+                            ctx.indicies.begin(), ctx.indicies.end());
+  for (unsigned i = 0; i < e->components.size(); ++i)
+    if (e->components[i].type == target_symbol::comp_expression_array_index)
+      fcall->args.push_back(e_orig->components[i].expr_index);
+
+  target_bitfield_remover().replace(value);
+
+  block *blk = new block;
+  blk->tok = tok;
+  fdecl->body = blk;
+
+  return_statement *ret = new return_statement;
+  ret->tok = tok;
+  ret->value = value;
+  blk->statements.push_back(ret);
+
+  fdecl->join (s);
+  return fcall;
+}
+
+
+// Expand a kernel @cast using BTF in place of DWARF.  This covers reads
+// of members, array elements, pointers, bit fields and their addresses.
+functioncall*
+dwarf_cast_expanding_visitor::btf_cast_query(cast_op* e, const string& module,
+                                             bool lvalue)
+{
+  static unsigned tick = 0;
+
+  btf_reader* btf = get_btf(e, module);
+  if (!btf)
+    return NULL;
+
+  string tns = e->type_name;
+  if (startswith(tns, "class "))
+    tns = "struct " + tns.substr(6);
+  uint32_t type = btf->find_type(tns);
+  if (!type)
+    return NULL;
+
+  try
+    {
+      if (lvalue)
+        throw SEMANTIC_ERROR(_("cannot write to a @cast resolved from BTF"), e->tok);
+      if (e->check_pretty_print())
+        throw SEMANTIC_ERROR(_("cannot pretty-print a @cast resolved from BTF"), e->tok);
+
+      location_context ctx(e, e->operand);
+      const token* tok = e->tok;
+      expression* addr = ctx.new_symref(ctx.pointer);
+      uint32_t t = btf->resolve(type);
+      uint64_t bit_offset = 0;
+      unsigned bit_size = 0;
+
+      for (unsigned i = 0; i < ctx.e->components.size(); ++i)
+        {
+          const target_symbol::component& c = ctx.e->components[i];
+          if (bit_size)
+            throw SEMANTIC_ERROR(_("bit field is being dereferenced"), c.tok);
+
+          if (c.type == target_symbol::comp_struct_member)
+            {
+              if (btf->kind(t) == btf_kind_ptr)
+                {
+                  addr = btf_deref(c.tok, addr, btf->ptr_size(), false);
+                  t = btf->resolve(btf->target(t));
+                }
+              if (btf->kind(t) != btf_kind_struct && btf->kind(t) != btf_kind_union)
+                throw SEMANTIC_ERROR(_F("'%s' is not a struct or union",
+                                        btf->type_name(t).c_str()), c.tok);
+
+              btf_member m;
+              if (!btf->find_member(t, c.member, m))
+                throw SEMANTIC_ERROR(_F("unable to find member '%s' for %s",
+                                        c.member.c_str(),
+                                        btf->type_name(t).c_str()), c.tok);
+              if (m.bitfield_size)
+                {
+                  // Left for the final fetch, which knows the storage unit.
+                  bit_offset = m.bit_offset;
+                  bit_size = m.bitfield_size;
+                }
+              else
+                addr = ctx.new_plus_const(addr, m.bit_offset / 8);
+              t = btf->resolve(m.type);
+            }
+          else
+            {
+              // The cast pointer itself may be indexed, as in C.
+              uint32_t elem = t;
+              if (btf->kind(t) == btf_kind_ptr)
+                {
+                  addr = btf_deref(c.tok, addr, btf->ptr_size(), false);
+                  elem = btf->target(t);
+                }
+              else if (btf->kind(t) == btf_kind_array)
+                elem = btf->target(t);
+              else if (i > 0)
+                throw SEMANTIC_ERROR(_F("'%s' is not an array or pointer",
+                                        btf->type_name(t).c_str()), c.tok);
+
+              uint64_t stride = btf->size(elem);
+              if (stride == 0)
+                throw SEMANTIC_ERROR(_F("cannot index into '%s' of unknown size",
+                                        btf->type_name(elem).c_str()), c.tok);
+              if (c.type == target_symbol::comp_literal_array_index)
+                addr = ctx.new_plus_const(addr, c.num_index * stride);
+              else
+                {
+                  binary_expression *m = new binary_expression;
+                  m->tok = c.tok;
+                  m->op = "*";
+                  m->left = c.expr_index;
+                  m->right = new literal_number(stride);
+                  m->right->tok = c.tok;
+                  binary_expression *a = new binary_expression;
+                  a->tok = c.tok;
+                  a->op = "+";
+                  a->left = addr;
+                  a->right = m;
+                  addr = a;
+                }
+              t = btf->resolve(elem);
+            }
+        }
+
+      expression* value;
+      if (e->addressof)
+        {
+          if (bit_size)
+            throw SEMANTIC_ERROR(_("cannot take address of bit field"), tok);
+          value = addr;
+        }
+      else switch (btf->kind(t))
+        {
+        case btf_kind_int:
+        case btf_kind_enum:
+        case btf_kind_enum64:
+          {
+            uint64_t size = btf->size(t);
+            bool signed_p = btf->int_signed_p(t);
+            if (size == 0 || size > 8)
+              throw SEMANTIC_ERROR(_("cannot process >64-bit values"), tok);
+            if (!bit_size)
+              {
+                value = btf_deref(tok, addr, size, signed_p);
+                break;
+              }
+
+            // As for DW_AT_data_bit_offset, fetch the storage unit
+            // holding the field and pick the bits out of that.
+            uint64_t unit = (bit_offset / 8) / size * size;
+            target_bitfield *bf = new target_bitfield;
+            bf->tok = tok;
+            bf->base = btf_deref(tok, ctx.new_plus_const(addr, unit),
+                                 size, signed_p);
+            bf->offset = bit_offset - 8 * unit;
+            bf->size = bit_size;
+            bf->signed_p = signed_p;
+            value = bf;
+          }
+          break;
+
+        case btf_kind_ptr:
+          value = btf_deref(tok, addr, btf->ptr_size(), false);
+          break;
+
+        case btf_kind_array:
+          // As in C, an array decays to the address of its first element.
+          value = addr;
+          break;
+
+        case btf_kind_struct:
+        case btf_kind_union:
+          throw SEMANTIC_ERROR(_F("'%s' is being accessed instead of a member",
+                                  btf->type_name(t).c_str()), tok);
+
+        default:
+          throw SEMANTIC_ERROR(_F("cannot fetch '%s' using BTF",
+                                  btf->type_name(t).c_str()), tok);
+        }
+
+      string fname = "_btf_cast_get_" + e->sym_name() + "_" + lex_cast(tick++);
+      return synthetic_btf_deref_call(sess, ctx, fname, value, e->operand);
+    }
+  catch (const semantic_error& er)
+    {
+      e->chain (er);
+      return NULL;
+    }
+}
+
+
 void dwarf_cast_expanding_visitor::filter_special_modules(string& module)
 {
   // look for "<path/to/header>" or "kernel<path/to/header>"
@@ -5145,12 +5447,17 @@ void dwarf_cast_expanding_visitor::visit_cast_op (cast_op* e)
       string& module = modules[i];
       filter_special_modules(module);
 
+      // An explicit --btf is trusted ahead of any kernel debuginfo.
+      userspace_p=is_user_module (module);
+      if (!userspace_p && !sess.btf_path.empty()
+          && (result = btf_cast_query (e, module, lvalue)))
+        break;
+
       // NB: This uses '/' to distinguish between kernel modules and userspace,
       // which means that userspace modules won't get any PATH searching.
       dwflpp* dw;
       try
 	{
-          userspace_p=is_user_module (module);
 	  if (! userspace_p)
 	    {
 	      // kernel or kernel module target
@@ -5164,12 +5471,18 @@ void dwarf_cast_expanding_visitor::visit_cast_op (cast_op* e)
 	}
       catch (const semantic_error& er)
 	{
+	  // Without debuginfo, the kernel may still describe itself in BTF.
+	  if (!userspace_p && sess.btf_path.empty())
+	    result = btf_cast_query (e, module, lvalue);
 	  /* ignore and go to the next module */
 	  continue;
 	}
 
       dwarf_cast_query q (*dw, module, *e, lvalue, userspace_p, result);
       dw->iterate_over_modules<base_query>(&query_module, &q);
+
+      if (!result && !userspace_p && sess.btf_path.empty())
+        result = btf_cast_query (e, module, lvalue);
     }
 
   if (!result)
@@ -11107,6 +11420,7 @@ struct tracepoint_derived_probe: public derived_probe
   void build_args(dwflpp& dw, Dwarf_Die& func_die);
   void build_args_for_bpf(dwflpp& dw, Dwarf_Die& struct_die);
   void getargs (std::list<std::string> &arg_set) const;
+  void prune_unused_args (systemtap_session& s);
   void join_group (systemtap_session& s);
   void print_dupe_stamp(ostream& o);
 };
@@ -11698,9 +12012,52 @@ tracepoint_derived_probe::getargs(std::list<std::string> &arg_set) const
       arg_set.push_back("$"+args[i].name+":"+args[i].c_type);
 }
 
+// Pass 2 marks an argument used as soon as the body mentions it, but
+// optimization may since have removed every such use, e.g. a tapset
+// alias's local that the script never reads.  Stop passing those, so
+// that a probe reading no arguments at all gets the no-argument entry.
+void
+tracepoint_derived_probe::prune_unused_args (systemtap_session& s)
+{
+  varuse_collecting_visitor vut(s);
+  body->visit (& vut);
+  if (sole_location()->condition)
+    sole_location()->condition->visit (& vut);
+
+  for (unsigned i = 0; i < args.size(); i++)
+    {
+      if (!args[i].used)
+        continue;
+
+      string name = "__tracepoint_arg_" + args[i].name;
+      for (unsigned j = 0; j < locals.size(); j++)
+        {
+          vardecl* v = locals[j];
+          if (!v->synthetic || v->name != name)
+            continue;
+          if (vut.read.find (v) == vut.read.end() &&
+              vut.written.find (v) == vut.written.end())
+            {
+              if (s.verbose > 2)
+                clog << _F("tracepoint %s: dropping unused argument %s",
+                           tracepoint_name.c_str(), args[i].name.c_str()) << endl;
+              args[i].used = false;
+              locals.erase (locals.begin() + j);
+            }
+          break;
+        }
+    }
+}
+
+
 void
 tracepoint_derived_probe::join_group (systemtap_session& s)
 {
+  // NB: --runtime=bpf refers to the arguments through separate
+  // bpf_context_vardecls, so its locals can't be matched up this way.
+  if (!s.unoptimized && s.runtime_mode == systemtap_session::kernel_runtime)
+    prune_unused_args (s);
+
   if (! s.tracepoint_derived_probes)
     s.tracepoint_derived_probes = new tracepoint_derived_probe_group ();
   s.tracepoint_derived_probes->enroll (this);
@@ -12263,7 +12620,8 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->newline(1) << "const struct stap_probe * const probe = "
                        << common_probe_init (p) << ";";
       common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "probe",
-				     "stp_probe_type_tracepoint");
+				     "stp_probe_type_tracepoint", true, NULL,
+				     NULL, NULL, p->tiny);
       s.op->newline() << "c->ips.tp.tracepoint_system = "
                       << lex_cast_qstring (p->tracepoint_system)
                       << ";";
@@ -12277,7 +12635,7 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
                           << " = __tracepoint_arg_" << used_args[j]->name << ";";
         }
       s.op->newline() << "(*probe->ph) (c);";
-      common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
+      common_probe_entryfn_epilogue (s, true, otf_safe_context(s), p->tiny);
       s.op->newline(-1) << "}";
 
       // define the real tracepoint callback function
@@ -12751,8 +13109,8 @@ tracepoint_builder::get_tracequery_modules(systemtap_session& s,
 
   map<string,string> headers_tracequery_src; // header -> C-source code mapping
 
-  // We could query several subsets of headers[] to make this go
-  // faster, but let's KISS and do one at a time.
+  // One source per header; make_tracequeries spreads them over
+  // several concurrent kbuilds.
   for (size_t i=0; i<uncached_headers.size(); i++)
     {
       const string& header = uncached_headers[i];
@@ -13249,13 +13607,17 @@ register_standard_tapsets(systemtap_session & s)
 
 
 vector<derived_probe_group*>
-all_session_groups(systemtap_session& s)
+all_session_groups(systemtap_session& s, vector<string>* names)
 {
   vector<derived_probe_group*> g;
 
 #define DOONE(x) \
   if (s. x##_derived_probes) \
-    g.push_back ((derived_probe_group*)(s. x##_derived_probes))
+    { \
+      g.push_back ((derived_probe_group*)(s. x##_derived_probes)); \
+      if (names) \
+        names->push_back (#x); \
+    }
 
   // Note that order *is* important here.  We want to make sure we
   // register (actually run) begin probes before any other probe type
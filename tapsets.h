@@ -18,7 +18,8 @@
 void check_process_probe_kernel_support(systemtap_session& s);
 
 void register_standard_tapsets(systemtap_session& sess);
-std::vector<derived_probe_group*> all_session_groups(systemtap_session& s);
+std::vector<derived_probe_group*> all_session_groups(systemtap_session& s,
+                                                     std::vector<std::string>* names = NULL);
 std::string common_probe_init (derived_probe* p);
 void common_probe_entryfn_prologue (systemtap_session& s, std::string statestr,
                                     std::string statestr2,
@@ -26,10 +27,21 @@ void common_probe_entryfn_prologue (systemtap_session& s, std::string statestr,
 				    bool overload_processing = true,
 				    void (*declaration_callback)(systemtap_session& s, void* data) = NULL,
 				    void (*pre_context_callback)(systemtap_session& s, void* data) = NULL,
-				    void* callback_data = NULL);
+				    void* callback_data = NULL,
+				    bool tiny = false);
 void common_probe_entryfn_epilogue (systemtap_session& s,
 				    bool overload_processing,
-				    bool schedule_work_safe);
+				    bool schedule_work_safe,
+				    bool tiny = false);
+
+template <class DP> bool
+all_probes_tiny (const std::vector<DP*>& probes)
+{
+  for (unsigned i = 0; i < probes.size(); i++)
+    if (! probes[i]->tiny)
+      return false;
+  return !probes.empty();
+}
 
 struct be_derived_probe_group;
 bool sort_for_bpf(systemtap_session& s,
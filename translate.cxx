@@ -22,10 +22,13 @@
 #include "dwflpp.h"
 #include "stapregex.h"
 #include "stringtable.h"
+#include "hash.h"
 
 #include <byteswap.h>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <set>
 #include <sstream>
 #include <string>
@@ -63,6 +66,7 @@ using namespace std;
 
 class var;
 struct tmpvar;
+struct pgo_profile;
 struct aggvar;
 struct mapvar;
 class itervar;
@@ -90,6 +94,15 @@ struct c_unparser: public unparser, public visitor
   bool already_checked_action_count;
 
   varuse_collecting_visitor vcv_needs_global_locks; // tracks union of all probe handler body reads/writes
+  set<vardecl*> striped_globals; // arrays locked per stripe (--lock-stripes)
+  set<vardecl*> atomic_globals; // counters updated with atomic64 ops
+  set<vardecl*> read_mostly_globals; // read under per-CPU locks
+
+  // --pgo-collect counter indices
+  map<if_statement*, unsigned> pgo_branches;
+  map<functiondecl*, unsigned> pgo_functions;
+  // --pgo-use profile, or NULL
+  const pgo_profile* pgo;
 
   map<string, probe*> probe_contents;
 
@@ -130,7 +143,8 @@ struct c_unparser: public unparser, public visitor
     session (ss), o (op ?: ss->op), current_probe(0), current_function (0),
     assigned_functioncall (0), assigned_functioncall_retval (0),
     tmpvar_counter (0), label_counter (0), action_counter(0), fc_counter(0),
-    already_checked_action_count(false), vcv_needs_global_locks (*ss) {}
+    already_checked_action_count(false), vcv_needs_global_locks (*ss),
+    pgo (0) {}
   ~c_unparser () {}
 
   // The main c_unparser doesn't write declarations as it traverses,
@@ -153,14 +167,24 @@ struct c_unparser: public unparser, public visitor
   void emit_module_init ();
   void emit_module_refresh ();
   void emit_module_exit ();
+  void emit_exporter_snapshot ();
   void emit_function (functiondecl* v);
   void emit_lock_decls (const varuse_collecting_visitor& v);
   void emit_lock ();
   bool locks_needed_p (visitable *s);
   void locks_not_needed_argh (statement *s);
   void emit_unlock ();
+  void collect_striped_globals ();
+  void collect_atomic_globals ();
+  void collect_read_mostly_globals ();
+  void emit_stripe_lock (mapvar const& mv, vector<tmpvar> const& idx, bool write_p);
+  void emit_stripe_unlock ();
   void emit_probe (derived_probe* v);
   void emit_probe_condition_update(derived_probe* v);
+  void emit_pgo_counters ();
+  string pgo_attributes (derived_probe* p);
+  string pgo_attributes (functiondecl* fd);
+  string pgo_branch_hint (if_statement* s);
 
   void emit_compiled_printfs ();
   void emit_compiled_printf_locals ();
@@ -206,6 +230,7 @@ struct c_unparser: public unparser, public visitor
 
   void c_strcat (const string& lvalue, const string& rvalue);
   void c_strcat (const string& lvalue, expression* rvalue);
+  void c_strcat_chain (const string& lvalue, concatenation* e);
 
   void c_strcpy (const string& lvalue, const string& rvalue);
   void c_strcpy (const string& lvalue, expression* rvalue);
@@ -284,6 +309,15 @@ struct c_unparser: public unparser, public visitor
   // wrap one child visit of a compound statement
   virtual void wrap_compound_visit (expression *e) { if (e) e->visit (this); }
   virtual void wrap_compound_visit (statement *s) { if (s) s->visit (this); }
+
+  // start/close expressions which copy each of their operands into a
+  // temporary before using any of them, such as function arguments
+  virtual void start_compound_expression (const char*, expression*) { }
+  virtual void close_compound_expression (const char*, expression*) { }
+
+  // evaluate one operand of a compound expression into its temporary
+  virtual void wrap_compound_assign (tmpvar& t, expression *e, const char* msg)
+    { c_assign (t, e, msg); }
 };
 
 // A shadow visitor, meant to generate temporary variable declarations
@@ -294,9 +328,50 @@ struct c_tmpcounter cxx_final: public c_unparser
   c_unparser* parent;
   set<string> declared_vars;
 
+  // The structs and unions being declared, innermost last, with the
+  // bytes they take so far, for the -vv context size report.
+  struct decl_scope
+  {
+    bool is_union;
+    unsigned size;
+  };
+  vector<decl_scope> scopes;
+  unsigned string_size;
+  unsigned unshared_size; // what the locals would take without overlays
+
+  // Compound expressions being declared, innermost last.  The
+  // temporary each operand is copied into is declared after the union
+  // of the operands' own temporaries, which are dead by then.
+  struct compound_expression
+  {
+    std::ostream::pos_type before, after;
+    string result; // the temporary of the operand being evaluated
+    vector<pair<exp_type, string> > results;
+  };
+  vector<compound_expression> compound_exprs;
+
   c_tmpcounter (c_unparser* p):
-    c_unparser(p->session, &null_o), parent (p)
-  { }
+    c_unparser(p->session, &null_o), parent (p), unshared_size (0)
+  {
+    striped_globals = p->striped_globals;
+    atomic_globals = p->atomic_globals;
+
+    // As in runtime_defines.h, for a 64-bit kernel.
+    string_size = 512;
+    for (unsigned i = 0; i < session->c_macros.size(); i++)
+      if (startswith (session->c_macros[i], "MAXSTRINGLEN="))
+        try
+          {
+            string_size = lex_cast<unsigned> (session->c_macros[i].substr (13));
+          }
+        catch (const runtime_error&) { }
+  }
+
+  unsigned decl_size (exp_type ty) const
+    { return ty == pe_string ? string_size : 8; }
+  void open_scope (bool is_union);
+  void close_scope ();
+  void add_size (unsigned size);
 
   // When vars are created *and used* (i.e. not overridden tmpvars) they call
   // var_declare(), which will forward to the parent c_unparser for output;
@@ -314,6 +389,10 @@ struct c_tmpcounter cxx_final: public c_unparser
   void wrap_compound_visit (expression *e) cxx_override;
   void wrap_compound_visit (statement *s) cxx_override;
 
+  void start_compound_expression (const char*, expression*) cxx_override;
+  void close_compound_expression (const char*, expression*) cxx_override;
+  void wrap_compound_assign (tmpvar& t, expression *e, const char* msg) cxx_override;
+
   void start_struct_def (std::ostream::pos_type &before,
                          std::ostream::pos_type &after, const token* tok);
   void close_struct_def (std::ostream::pos_type before,
@@ -606,8 +685,51 @@ ostream & operator<<(ostream & o, var const & v)
 void
 c_tmpcounter::var_declare (string const& name, var const& v)
 {
-  if (declared_vars.insert(name).second)
-    v.declare (*parent);
+  if (!declared_vars.insert(name).second)
+    return;
+
+  if (!compound_exprs.empty() && compound_exprs.back().result == name)
+    {
+      compound_exprs.back().results.push_back (make_pair (v.type(), v.c_name()));
+      return;
+    }
+
+  v.declare (*parent);
+  add_size (decl_size (v.type()));
+}
+
+
+void
+c_tmpcounter::open_scope (bool is_union)
+{
+  decl_scope scope = { is_union, 0 };
+  scopes.push_back (scope);
+}
+
+
+void
+c_tmpcounter::close_scope ()
+{
+  assert (!scopes.empty());
+  unsigned size = scopes.back().size;
+  scopes.pop_back();
+  if (!scopes.empty())
+    {
+      decl_scope& outer = scopes.back();
+      outer.size = outer.is_union ? max (outer.size, size) : outer.size + size;
+    }
+}
+
+
+// Account for a declaration in the innermost struct or union.
+void
+c_tmpcounter::add_size (unsigned size)
+{
+  unshared_size += size;
+  if (scopes.empty())
+    return;
+  decl_scope& scope = scopes.back();
+  scope.size = scope.is_union ? max (scope.size, size) : scope.size + size;
 }
 
 struct stmt_expr
@@ -698,15 +820,16 @@ struct mapvar
   vector<exp_type> index_types;
   int maxsize;
   bool wrap;
+  bool striped; // --lock-stripes; see c_unparser::collect_striped_globals
   mapvar (c_unparser *u,
           bool local, exp_type ty,
 	  statistic_decl const & sd,
 	  string const & name,
 	  vector<exp_type> const & index_types,
-	  int maxsize, bool wrap)
+	  int maxsize, bool wrap, bool striped = false)
     : var (u, local, ty, sd, name),
       index_types (index_types),
-      maxsize (maxsize), wrap(wrap)
+      maxsize (maxsize), wrap(wrap), striped(striped)
   {}
 
   static string shortname(exp_type e);
@@ -741,7 +864,11 @@ struct mapvar
 
   string function_keysym(string const & fname, bool pre_agg=false) const
   {
-    string mtype = (is_parallel() && !pre_agg) ? "pmap" : "map";
+    string mtype = "map";
+    if (is_parallel() && !pre_agg)
+      mtype = "pmap";
+    else if (is_striped() && !pre_agg)
+      mtype = "smap";
     string result = "_stp_" + mtype + "_" + fname + "_" + keysym();
     return result;
   }
@@ -750,6 +877,9 @@ struct mapvar
   {
     string result = function_keysym(fname, pre_agg) + " (";
     result += pre_agg? fetch_existing_aggregate() : value();
+    // the stripe locked by c_unparser::emit_stripe_lock
+    if (is_striped() && !pre_agg)
+      result += ", c->stripe";
     for (unsigned i = 0; i < indices.size(); ++i)
       {
 	if (indices[i].type() != index_types[i])
@@ -766,6 +896,11 @@ struct mapvar
     return type() == pe_stats;
   }
 
+  bool is_striped() const
+  {
+    return striped;
+  }
+
   string stat_op_tokens() const
   {
     string result = "";
@@ -798,7 +933,7 @@ struct mapvar
 
   string calculate_aggregate() const
   {
-    if (!is_parallel())
+    if (!is_parallel() && !is_striped())
       throw SEMANTIC_ERROR(_("aggregating non-parallel map type"));
 
     return function_keysym("agg") + " (" + value() + ")";
@@ -806,6 +941,8 @@ struct mapvar
 
   string fetch_existing_aggregate() const
   {
+    if (is_striped())
+      return "_stp_smap_get_agg(" + value() + ")";
     if (!is_parallel())
       throw SEMANTIC_ERROR(_("fetching aggregate of non-parallel map type"));
 
@@ -902,16 +1039,21 @@ struct mapvar
       throw SEMANTIC_ERROR(_F("unsupported local map init for %s", value().c_str()));
 
     string prefix = "global_set(" + c_name() + ", ";
-    prefix += function_keysym("new") + " ("
-      + (is_parallel() ? stat_op_tokens() : "")
-      + "KEY_MAPENTRIES, " + (maxsize > 0 ? lex_cast(maxsize) : "MAXMAPENTRIES") + ", "
-      + ((wrap == true) ? "KEY_STAT_WRAP, " : "");
 
     // See also var::init().
 
     // Check for errors during allocation.
     string suffix = "if (" + value () + " == NULL) rc = -ENOMEM;";
 
+    if (is_striped())
+      return prefix + function_keysym("new") + " ("
+        + (maxsize > 0 ? lex_cast(maxsize) : "MAXMAPENTRIES") + ")); " + suffix;
+
+    prefix += function_keysym("new") + " ("
+      + (is_parallel() ? stat_op_tokens() : "")
+      + "KEY_MAPENTRIES, " + (maxsize > 0 ? lex_cast(maxsize) : "MAXMAPENTRIES") + ", "
+      + ((wrap == true) ? "KEY_STAT_WRAP, " : "");
+
     if (type() == pe_stats)
       {
 	switch (sdecl().type)
@@ -949,6 +1091,8 @@ struct mapvar
 
     if (is_parallel())
       return "_stp_pmap_del (" + value() + ");";
+    else if (is_striped())
+      return "_stp_smap_del (" + value() + ");";
     else
       return "_stp_map_del (" + value() + ");";
   }
@@ -979,7 +1123,7 @@ public:
     if (mv.type() != type())
       throw SEMANTIC_ERROR(_("inconsistent iterator type in itervar::start()"));
 
-    if (mv.is_parallel())
+    if (mv.is_parallel() || mv.is_striped())
       return "_stp_map_start (" + mv.fetch_existing_aggregate() + ")";
     else
       return "_stp_map_start (" + mv.value() + ")";
@@ -990,7 +1134,7 @@ public:
     if (mv.type() != type())
       throw SEMANTIC_ERROR(_("inconsistent iterator type in itervar::next()"));
 
-    if (mv.is_parallel())
+    if (mv.is_parallel() || mv.is_striped())
       return "_stp_map_iter (" + mv.fetch_existing_aggregate() + ", " + value() + ")";
     else
       return "_stp_map_iter (" + mv.value() + ", " + value() + ")";
@@ -1625,7 +1769,9 @@ c_unparser::emit_global_param (vardecl *v)
   if (v->arity == 0 && v->type == pe_long)
     {
       o->newline() << "module_param_named (" << param << ", "
-                   << "global(" << global << "), int64_t, 0);";
+                   << "global(" << global << ")"
+                   << (atomic_globals.count(v) ? ".counter" : "")
+                   << ", int64_t, 0);";
     }
   else if (v->arity == 0 && v->type == pe_string)
     {
@@ -1687,7 +1833,9 @@ c_unparser::emit_global (vardecl *v)
 
   string type;
   if (v->arity > 0)
-    type = (v->type == pe_stats) ? "PMAP" : "MAP";
+    type = (v->type == pe_stats) ? "PMAP" : striped_globals.count(v) ? "SMAP" : "MAP";
+  else if (atomic_globals.count(v))
+    type = "atomic64_t";
   else
     type = c_typename (v->type);
 
@@ -1713,6 +1861,8 @@ c_unparser::emit_global (vardecl *v)
     o->newline() << type << " " << vn << ";";
 
   o->newline() << "stp_rwlock_t " << vn << "_lock;";
+  if (read_mostly_globals.count(v))
+    o->newline() << "stp_rwlock_t *" << vn << "_cpu_locks;";
   o->newline() << "#ifdef STP_TIMING";
   o->newline() << "atomic_t " << vn << "_lock_skip_count;";
   o->newline() << "atomic_t " << vn << "_lock_contention_count;";
@@ -1724,7 +1874,13 @@ void
 c_unparser::emit_global_init (vardecl *v)
 {
   // We can only statically initialize some scalars.
-  if (v->arity == 0 && v->init)
+  if (v->arity == 0 && v->init && atomic_globals.count(v))
+    {
+      o->newline() << "." << c_globalname (v->name) << " = ATOMIC64_INIT(";
+      v->init->visit(this);
+      o->line() << "),";
+    }
+  else if (v->arity == 0 && v->init)
     {
       o->newline() << "." << c_globalname (v->name) << " = ";
       v->init->visit(this);
@@ -1754,6 +1910,340 @@ c_unparser::emit_global_init_type (vardecl *v)
 }
 
 
+// Emit the per-global dump functions behind the stapio -E exporter's
+// /proc/systemtap/MODULE/__exporter file; see runtime/linux/exporter.c.
+void
+c_unparser::emit_exporter_snapshot ()
+{
+  vector<vardecl*> exported;
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      // Only true script globals, as with module params.
+      if (v->synthetic || !v->name.starts_with("__global_"))
+        continue;
+      if (v->arity > 9) // STP_EXPORTER_MAXARITY, cf. map-gen.c
+        continue;
+      exported.push_back (v);
+    }
+
+  o->newline() << "/* ---- exporter snapshots ---- */";
+  o->newline() << "#define STP_EXPORTER_NUM_GLOBALS " << exported.size();
+  o->newline() << "#include \"linux/exporter.c\"";
+
+  for (unsigned i=0; i<exported.size(); i++)
+    {
+      vardecl* v = exported[i];
+      string vn = c_globalname (v->name);
+      interned_string name = v->name.substr(sizeof("__global_") - 1);
+      bool write_p = (v->type == pe_stats); // aggregation needs exclusive lock
+      bool striped_p = striped_globals.count(v) > 0; // locked per stripe below
+
+      o->newline() << "static void stp_exporter_dump_" << i << " (struct seq_file *m) {";
+      o->indent(1);
+
+      if (v->arity > 0)
+        {
+          mapvar mv = getmap (v);
+
+          o->newline() << "static const uint32_t key_types[] = {";
+          for (int j=0; j<v->arity; j++)
+            o->line() << (j ? ", " : " ")
+                      << (v->index_types[j] == pe_long ? "STP_EXPORTER_INT64" : "STP_EXPORTER_STRING");
+          o->line() << " };";
+          o->newline() << "struct map_node *n;";
+          o->newline() << "MAP map;";
+          if (striped_p)
+            o->newline() << "unsigned stripe;";
+          else
+            o->newline() << (write_p ? "stp_write_lock" : "stp_read_lock")
+                         << " (global_lock(" << vn << "));";
+          if (mv.is_parallel())
+            o->newline() << "map = " << mv.calculate_aggregate() << ";";
+          else if (!striped_p)
+            o->newline() << "map = " << mv.value() << ";";
+        }
+      else
+        o->newline() << (write_p ? "stp_write_lock" : "stp_read_lock")
+                     << " (global_lock(" << vn << "));";
+
+      string value_type;
+      switch (v->type)
+        {
+        case pe_long: value_type = "STP_EXPORTER_INT64"; break;
+        case pe_string: value_type = "STP_EXPORTER_STRING"; break;
+        case pe_stats: value_type = "STP_EXPORTER_STAT"; break;
+        default:
+          throw SEMANTIC_ERROR(_F("unsupported exporter type for %s", v->name.to_string().c_str()));
+        }
+      o->newline() << "_stp_exporter_put_global (m, " << lex_cast_qstring (name)
+                   << ", " << value_type << ", " << v->arity << ", "
+                   << (v->arity > 0 ? "key_types" : "NULL") << ");";
+
+      if (v->arity > 0)
+        {
+          mapvar mv = getmap (v);
+
+          // Each stripe is a consistent snapshot of its own keys.
+          if (striped_p)
+            {
+              o->newline() << "for (stripe = 0; stripe < STP_LOCK_STRIPES; stripe++) {";
+              o->newline(1) << "stp_read_lock (&global(" << vn << ")->lock[stripe]);";
+              o->newline() << "map = _stp_smap_get_map (global(" << vn << "), stripe);";
+            }
+          o->newline() << "if (map)";
+          o->newline(1) << "for (n = _stp_map_start (map); n; n = _stp_map_iter (map, n)) {";
+          o->newline(1) << "_stp_exporter_put_entry (m);";
+          // NB: runtime uses base index 1 for the first dimension
+          for (int j=0; j<v->arity; j++)
+            {
+              if (v->index_types[j] == pe_long)
+                o->newline() << "_stp_exporter_put_int64 (m, "
+                             << mv.function_keysym("key_get_int64", true)
+                             << " (n, " << j+1 << "));";
+              else
+                o->newline() << "_stp_exporter_put_str (m, "
+                             << mv.function_keysym("key_get_str", true)
+                             << " (n, " << j+1 << "));";
+            }
+          if (v->type == pe_long)
+            o->newline() << "_stp_exporter_put_int64 (m, "
+                         << mv.function_keysym("get_int64", true) << " (n));";
+          else if (v->type == pe_string)
+            o->newline() << "_stp_exporter_put_str (m, "
+                         << mv.function_keysym("get_str", true) << " (n));";
+          else
+            o->newline() << "_stp_exporter_put_stat (m, "
+                         << mv.function_keysym("get_stat_data", true) << " (n));";
+          o->newline(-1) << "}";
+          o->indent(-1);
+          if (striped_p)
+            {
+              o->newline() << "stp_read_unlock (&global(" << vn << ")->lock[stripe]);";
+              o->newline(-1) << "}";
+            }
+        }
+      else
+        {
+          o->newline() << "_stp_exporter_put_entry (m);";
+          if (v->type == pe_long && atomic_globals.count(v))
+            o->newline() << "_stp_exporter_put_int64 (m, atomic64_read (&global(" << vn << ")));";
+          else if (v->type == pe_long)
+            o->newline() << "_stp_exporter_put_int64 (m, global(" << vn << "));";
+          else if (v->type == pe_string)
+            o->newline() << "_stp_exporter_put_str (m, global(" << vn << "));";
+          else
+            o->newline() << "_stp_exporter_put_stat (m, _stp_stat_get (global("
+                         << vn << "), 0));";
+        }
+
+      if (!striped_p)
+        o->newline() << (write_p ? "stp_write_unlock" : "stp_read_unlock")
+                     << " (global_lock(" << vn << "));";
+      o->newline(-1) << "}";
+    }
+
+  o->newline() << "static const _stp_exporter_dump_fn _stp_exporter_dumps[STP_EXPORTER_NUM_GLOBALS] = {";
+  o->indent(1);
+  for (unsigned i=0; i<exported.size(); i++)
+    o->newline() << "&stp_exporter_dump_" << i << ",";
+  o->newline(-1) << "};";
+}
+
+
+// A --pgo-collect report, as printed at module exit: how often each
+// probe was hit, each function called and each if statement run and
+// taken, keyed by probe point, function name and source location.
+// Reports of several runs may be concatenated; their counts add up.
+struct pgo_profile
+{
+  map<string, unsigned long long> probe_hits;
+  map<string, unsigned long long> function_calls;
+  map<string, pair<unsigned long long, unsigned long long> > branches; // taken, run
+  unsigned long long max_probe_hits;
+  unsigned long long max_function_calls;
+
+  pgo_profile (): max_probe_hits (0), max_function_calls (0) {}
+  void load (const string& path);
+};
+
+
+void
+pgo_profile::load (const string& path)
+{
+  ifstream in (path.c_str());
+  if (!in)
+    throw SEMANTIC_ERROR (_F("cannot open profile %s", path.c_str()));
+
+  // Anything but our own "pgo: " lines, such as script output, is skipped.
+  string line;
+  while (getline (in, line))
+    {
+      if (!startswith (line, "pgo: "))
+        continue;
+      istringstream ls (line.substr (5));
+      string kind, key;
+      unsigned long long count = 0, run = 0;
+      ls >> kind >> count;
+      if (kind == "branch")
+        ls >> run;
+      ls >> ws;
+      getline (ls, key);
+      if (!ls.eof() || key.empty())
+        throw SEMANTIC_ERROR (_F("malformed profile line in %s: %s",
+                                 path.c_str(), line.c_str()));
+
+      if (kind == "probe")
+        max_probe_hits = max (max_probe_hits, probe_hits[key] += count);
+      else if (kind == "function")
+        max_function_calls = max (max_function_calls, function_calls[key] += count);
+      else if (kind == "branch")
+        {
+          branches[key].first += count;
+          branches[key].second += run;
+        }
+    }
+}
+
+
+// Whether a count is hot (at least an eighth of the hottest one of its
+// kind, 1), cold (never seen in the profiled run, -1) or neither (0).
+// Something the profile doesn't know, say a probe added since, is
+// neither.
+static int
+pgo_heat (const map<string, unsigned long long>& counts,
+          unsigned long long max_count, const string& key)
+{
+  map<string, unsigned long long>::const_iterator it = counts.find (key);
+  if (it == counts.end())
+    return 0;
+  if (it->second == 0)
+    return -1;
+  return it->second >= max_count / 8 ? 1 : 0;
+}
+
+
+// Hot handlers are grouped by gcc into .text.hot, cold ones out of the
+// way into .text.unlikely.
+string
+c_unparser::pgo_attributes (derived_probe* p)
+{
+  if (!pgo)
+    return "";
+  switch (pgo_heat (pgo->probe_hits, pgo->max_probe_hits,
+                    lex_cast (*p->sole_location())))
+    {
+    case 1: return "__attribute__((hot)) ";
+    case -1: return "__attribute__((cold)) ";
+    default: return "";
+    }
+}
+
+
+string
+c_unparser::pgo_attributes (functiondecl* fd)
+{
+  if (!pgo)
+    return "";
+  switch (pgo_heat (pgo->function_calls, pgo->max_function_calls,
+                    fd->unmangled_name))
+    {
+    case 1: return "inline __attribute__((hot)) ";
+    case -1: return "__attribute__((cold)) ";
+    default: return "";
+    }
+}
+
+
+// likely or unlikely for an if statement that went the same way at
+// least nine times out of ten, over enough runs to tell.
+string
+c_unparser::pgo_branch_hint (if_statement* s)
+{
+  if (!pgo)
+    return "";
+  map<string, pair<unsigned long long, unsigned long long> >::const_iterator it
+    = pgo->branches.find (lex_cast (s->tok->location));
+  if (it == pgo->branches.end() || it->second.second < 16)
+    return "";
+  unsigned long long taken = it->second.first, run = it->second.second;
+  if (taken * 10 >= run * 9)
+    return "likely";
+  if (taken * 10 <= run)
+    return "unlikely";
+  return "";
+}
+
+
+// Orders probes by descending hit count.
+struct pgo_hotter
+{
+  const pgo_profile& pgo;
+  pgo_hotter (const pgo_profile& p): pgo (p) {}
+
+  unsigned long long hits (derived_probe* p) const
+    {
+      map<string, unsigned long long>::const_iterator it
+        = pgo.probe_hits.find (lex_cast (*p->sole_location()));
+      return it == pgo.probe_hits.end() ? 0 : it->second;
+    }
+  bool operator() (derived_probe* a, derived_probe* b) const
+    {
+      return hits (a) > hits (b);
+    }
+};
+
+
+struct pgo_branch_collector: public traversing_visitor
+{
+  vector<if_statement*> branches;
+  void visit_if_statement (if_statement* s)
+    {
+      branches.push_back (s);
+      traversing_visitor::visit_if_statement (s);
+    }
+};
+
+
+// The --pgo-collect counters, reported by emit_module_exit() along
+// with the probe hits that STP_TIMING counts.  They are bumped without
+// atomics, so counts from racing CPUs may be a little low.
+void
+c_unparser::emit_pgo_counters ()
+{
+  pgo_branch_collector pbc;
+  for (unsigned i = 0; i < session->probes.size(); i++)
+    if (session->probes[i]->group != NULL)
+      session->probes[i]->body->visit (&pbc);
+  for (map<string,functiondecl*>::iterator it = session->functions.begin();
+       it != session->functions.end(); it++)
+    it->second->body->visit (&pbc);
+
+  o->newline() << "static struct { unsigned long taken, run; } stap_pgo_branches["
+               << pbc.branches.size() << "];";
+  o->newline() << "static const char * const stap_pgo_branch_locs[] = {";
+  o->indent(1);
+  for (unsigned i = 0; i < pbc.branches.size(); i++)
+    {
+      pgo_branches[pbc.branches[i]] = i;
+      o->newline() << lex_cast_qstring (lex_cast (pbc.branches[i]->tok->location)) << ",";
+    }
+  o->newline(-1) << "};";
+
+  o->newline() << "static unsigned long stap_pgo_calls[" << session->functions.size() << "];";
+  o->newline() << "static const char * const stap_pgo_call_names[] = {";
+  o->indent(1);
+  for (map<string,functiondecl*>::iterator it = session->functions.begin();
+       it != session->functions.end(); it++)
+    {
+      unsigned i = pgo_functions.size();
+      pgo_functions[it->second] = i;
+      o->newline() << lex_cast_qstring (it->second->unmangled_name) << ",";
+    }
+  o->newline(-1) << "};";
+}
+
+
 void
 c_unparser::emit_functionsig (functiondecl* v)
 {
@@ -1761,7 +2251,7 @@ c_unparser::emit_functionsig (functiondecl* v)
   string funcname = c_funcname (v->name, funcname_shortened);
   if (funcname_shortened)
     o->newline() << "/* " << v->name << " */";
-  o->newline() << "static void " << funcname
+  o->newline() << "static " << pgo_attributes (v) << "void " << funcname
 	       << " (struct context * __restrict__ c);";
 }
 
@@ -1777,6 +2267,12 @@ c_unparser::emit_kernel_module_init ()
   o->newline(1) << "int rc = 0;";
   o->newline() << "int i=0, j=0;"; // for derived_probe_group use
 
+  if (session->exporter_port)
+    {
+      o->newline() << "rc = _stp_mkdir_proc_module();";
+      o->newline() << "if (rc) goto out;";
+    }
+
   vector<derived_probe_group*> g = all_session_groups (*session);
   for (unsigned i=0; i<g.size(); i++)
     {
@@ -1789,6 +2285,8 @@ c_unparser::emit_kernel_module_init ()
 	  for (int j=i-1; j>=0; j--)
 	    g[j]->emit_kernel_module_exit (*session);
 	}
+      if (session->exporter_port)
+        o->newline() << "_stp_rmdir_proc_module();";
       o->newline() << "goto out;";
       o->newline(-1) << "}";
     }
@@ -1819,19 +2317,48 @@ c_unparser::emit_kernel_module_exit ()
     {
       (*i)->emit_kernel_module_exit (*session);
     }
+  if (session->exporter_port)
+    o->newline() << "_stp_rmdir_proc_module();";
   o->newline(-1) << "}\n";
   o->assert_0_indent(); 
 }
 
 
+// For --report-build, note that the C of a unit starts here.
+static void
+report_build_begin (systemtap_session& s, const string& kind,
+                    const string& name, const string& symbol)
+{
+  if (s.report_build_path.empty())
+    return;
+  systemtap_session::build_report_unit u;
+  u.kind = kind;
+  u.name = name;
+  u.symbol = symbol;
+  u.begin = u.end = s.op->tellp();
+  u.lines = 0;
+  s.build_report_units.push_back (u);
+}
+
+static void
+report_build_end (systemtap_session& s)
+{
+  if (! s.report_build_path.empty())
+    s.build_report_units.back().end = s.op->tellp();
+}
+
+
 void
 c_unparser::emit_module_init ()
 {
-  vector<derived_probe_group*> g = all_session_groups (*session);
+  vector<string> names;
+  vector<derived_probe_group*> g = all_session_groups (*session, &names);
   for (unsigned i=0; i<g.size(); i++)
     {
+      report_build_begin (*session, "group", names[i], "");
       g[i]->emit_module_decls (*session);
       o->assert_0_indent(); 
+      report_build_end (*session);
     }
 
   o->newline() << "#ifdef STAP_NEED_TRACEPOINTS";
@@ -2034,6 +2561,15 @@ c_unparser::emit_module_init ()
       o->newline(-1) << "}";
 
       o->newline() << "global_lock_init(" << c_globalname (v->name) << ");";
+      if (read_mostly_globals.count(v))
+        {
+          o->newline() << "rc = stp_cpu_locks_init(global_cpu_locks("
+                       << c_globalname (v->name) << "));";
+          o->newline() << "if (rc) {";
+          o->newline(1) << "_stp_error (\"global variable '" << v->name << "' lock allocation failed\");";
+          o->newline() << "goto out;";
+          o->newline(-1) << "}";
+        }
       o->newline() << "#ifdef STP_TIMING";
       o->newline() << "atomic_set(global_skipped(" << c_globalname (v->name) << "), 0);";
       o->newline() << "atomic_set(global_contended(" << c_globalname (v->name) << "), 0);";
@@ -2097,6 +2633,18 @@ c_unparser::emit_module_init ()
       g[i]->emit_module_post_init (*session);
     }
 
+  // Globals are allocated and the session is running, so snapshots
+  // may be taken from now on.  A failure here is not fatal to the
+  // script itself.
+  if (session->exporter_port && !session->runtime_usermode_p())
+    {
+      o->newline() << "rc = _stp_exporter_init();";
+      o->newline() << "if (rc) {";
+      o->newline(1) << "_stp_warn (\"couldn't create exporter snapshot file (rc %d)\", rc);";
+      o->newline() << "rc = 0;";
+      o->newline(-1) << "}";
+    }
+
   if (!session->runtime_usermode_p())
     {
       o->newline() << "#ifdef STP_ON_THE_FLY_TIMER_ENABLE";
@@ -2186,6 +2734,9 @@ c_unparser::emit_module_init ()
 	o->newline() << getmap (v).fini();
       else
 	o->newline() << getvar (v).fini();
+      if (read_mostly_globals.count(v))
+        o->newline() << "stp_cpu_locks_free(global_cpu_locks("
+                     << c_globalname (v->name) << "));";
     }
 
   // For any partially registered/unregistered kernel facilities.
@@ -2357,6 +2908,9 @@ c_unparser::emit_module_exit ()
   // XXX: might like to have an escape hatch, in case some probe is
   // genuinely stuck somehow
 
+  if (session->exporter_port && !session->runtime_usermode_p())
+    o->newline() << "_stp_exporter_exit();";
+
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
@@ -2364,6 +2918,9 @@ c_unparser::emit_module_exit ()
 	o->newline() << getmap (v).fini();
       else
 	o->newline() << getvar (v).fini();
+      if (read_mostly_globals.count(v))
+        o->newline() << "stp_cpu_locks_free(global_cpu_locks("
+                     << c_globalname (v->name) << "));";
     }
 
   // We're finished with the contexts if we're not in dyninst
@@ -2407,7 +2964,8 @@ c_unparser::emit_module_exit ()
   o->newline() << "int alibi = atomic_read(probe_alibi(i));";
   o->newline() << "if (alibi)";
   o->newline(1) << "_stp_printf (\"%s, (%s), hits: %d,%s, index: %d\\n\",";
-  o->newline(2) << "p->pp, p->location, alibi, p->derivation, i);";
+  o->newline(2) << "p->pp, stap_probe_string(p->location), alibi,";
+  o->newline() << "stap_probe_string(p->derivation), i);";
   o->newline(-3) << "#endif"; // STP_ALIBI
   o->newline() << "#endif"; // !defined(STP_STDOUT_NOT_ATTY)
   o->newline() << "#ifdef STP_TIMING";
@@ -2423,11 +2981,17 @@ c_unparser::emit_module_exit ()
   o->newline(2) << (!session->runtime_usermode_p() ? "\"cycles\"" : "\"nsecs\"");
   o->newline(-2) << "#endif";
   o->newline(2) << "\": %lldmin/%lldavg/%lldmax, variance: %lld,%s, index: %d\\n\",";
-  o->newline() << "p->pp, p->location, (long long) stats->count,";
+  o->newline() << "p->pp, stap_probe_string(p->location), (long long) stats->count,";
   o->newline() << "(long long) stats->min, (long long) avg, (long long) stats->max,";
-  o->newline() << "(long long) stats->variance, p->derivation, i);";
+  o->newline() << "(long long) stats->variance, stap_probe_string(p->derivation), i);";
   o->newline(-3) << "}";
   o->newline() << "#endif"; // !defined(STP_STDOUT_NOT_ATTY)
+  if (session->pgo_collect)
+    {
+      // NB: printed even to a file, which is where it's most useful.
+      o->newline() << "_stp_printf (\"pgo: probe %lld %s\\n\", (long long) "
+                   << "_stp_stat_get (probe_timing(i), 0)->count, p->pp);";
+    }
   o->newline() << "preempt_enable_no_resched();";
   o->newline() << "_stp_stat_del (probe_timing(i));";
   o->newline() << "preempt_disable();";
@@ -2500,6 +3064,18 @@ c_unparser::emit_module_exit ()
       o->newline() << "#endif"; // STP_TIMING
     }
 
+  if (session->pgo_collect)
+    {
+      o->newline() << "for (i = 0; i < ARRAY_SIZE(stap_pgo_branches); ++i)";
+      o->newline(1) << "_stp_printf (\"pgo: branch %lu %lu %s\\n\", "
+                    << "stap_pgo_branches[i].taken, stap_pgo_branches[i].run, "
+                    << "stap_pgo_branch_locs[i]);";
+      o->newline(-1) << "for (i = 0; i < ARRAY_SIZE(stap_pgo_calls); ++i)";
+      o->newline(1) << "_stp_printf (\"pgo: function %lu %s\\n\", "
+                    << "stap_pgo_calls[i], stap_pgo_call_names[i]);";
+      o->indent(-1);
+    }
+
   o->newline() << "_stp_print_flush();";
   o->newline() << "#endif";
 
@@ -2514,6 +3090,9 @@ c_unparser::emit_module_exit ()
       o->newline() << "ctr = atomic_read (global_contended(" << vn << "));";
       o->newline() << "if (ctr) _stp_printf(\"'%s' lock contention occurred %d times\\n\", "
 	           << lex_cast_qstring(orig_vn) << ", ctr);";
+      if (striped_globals.count(session->globals[i]))
+        o->newline() << "stp_report_stripe_contention (global(" << vn << "), "
+                     << lex_cast_qstring(orig_vn) << ");";
     }
   o->newline(-1) << "}";
   o->newline() << "_stp_print_flush();";
@@ -2537,6 +3116,9 @@ c_unparser::emit_module_exit ()
       o->newline() << "ctr = atomic_read (global_skipped(" << vn << "));";
       o->newline() << "if (ctr) _stp_warn (\"Skipped due to global '%s' lock timeout: %d\\n\", "
                    << lex_cast_qstring(orig_vn) << ", ctr);";
+      if (striped_globals.count(session->globals[i]))
+        o->newline() << "stp_report_stripe_skipped (global(" << vn << "), "
+                     << lex_cast_qstring(orig_vn) << ");";
     }
   o->newline() << "ctr = atomic_read (skipped_count_lowstack());";
   o->newline() << "if (ctr) _stp_warn (\"Skipped due to low stack: %d\\n\", ctr);";
@@ -2617,6 +3199,209 @@ struct max_action_info: public functioncall_traversing_visitor
   void visit_continue_statement (continue_statement *) { add_stmt_count(1); }
 };
 
+
+// Check whether a probe handler is tiny: straight-line arithmetic on
+// numeric locals and globals, with reads (and deletes) of numeric
+// arrays.  Such a handler can't fail, calls no functions and uses no
+// strings, so its entry function may skip most of the context setup.
+// See common_probe_entryfn_prologue().
+struct tiny_probe_checker: public throwing_visitor
+{
+  static const unsigned max_statement_count = 20;
+
+  bool check (systemtap_session& s, derived_probe* p);
+
+  void check_long (expression* e);
+  void check_scalar (expression* e);
+
+  void visit_block (block *s);
+  void visit_null_statement (null_statement *) {}
+  void visit_expr_statement (expr_statement *s) { s->value->visit (this); }
+  void visit_if_statement (if_statement* s);
+  void visit_next_statement (next_statement*) {}
+  void visit_delete_statement (delete_statement* s);
+  void visit_literal_number (literal_number*) {}
+  void visit_binary_expression (binary_expression* e);
+  void visit_unary_expression (unary_expression* e) { check_long (e->operand); }
+  void visit_pre_crement (pre_crement* e) { check_scalar (e->operand); }
+  void visit_post_crement (post_crement* e) { check_scalar (e->operand); }
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_comparison (comparison* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_assignment (assignment* e);
+  void visit_symbol (symbol* e);
+  void visit_arrayindex (arrayindex* e);
+  void visit_array_in (array_in* e) { e->operand->visit (this); }
+};
+
+
+bool
+tiny_probe_checker::check (systemtap_session& s, derived_probe* p)
+{
+  if (p->sole_location()->condition
+      || !p->probes_with_affected_conditions.empty())
+    return false;
+
+  max_action_info mai (s);
+  p->body->visit (&mai);
+  if (mai.statement_count > max_statement_count)
+    return false;
+
+  try
+    {
+      p->body->visit (this);
+    }
+  catch (const semantic_error&)
+    {
+      return false;
+    }
+  return true;
+}
+
+
+void
+tiny_probe_checker::check_long (expression* e)
+{
+  if (e->type != pe_long)
+    throwone (e->tok);
+  e->visit (this);
+}
+
+
+// The target of an assignment or crement: a numeric scalar, since a
+// map write can fail on a full array.
+void
+tiny_probe_checker::check_scalar (expression* e)
+{
+  symbol* sym = dynamic_cast<symbol*>(e);
+  if (!sym)
+    throwone (e->tok);
+  check_long (sym);
+}
+
+
+void
+tiny_probe_checker::visit_block (block *s)
+{
+  for (unsigned i = 0; i < s->statements.size(); i++)
+    s->statements[i]->visit (this);
+}
+
+
+void
+tiny_probe_checker::visit_if_statement (if_statement* s)
+{
+  check_long (s->condition);
+  s->thenblock->visit (this);
+  if (s->elseblock)
+    s->elseblock->visit (this);
+}
+
+
+void
+tiny_probe_checker::visit_delete_statement (delete_statement* s)
+{
+  symbol* sym = NULL;
+  arrayindex* ai = dynamic_cast<arrayindex*>(s->value);
+  if (ai)
+    {
+      if (!ai->base->is_symbol (sym))
+        throwone (s->tok);
+      for (unsigned i = 0; i < ai->indexes.size(); i++)
+        if (ai->indexes[i]) // NULL for a wildcard
+          check_long (ai->indexes[i]);
+    }
+  else if (!(sym = dynamic_cast<symbol*>(s->value)))
+    throwone (s->tok);
+}
+
+
+void
+tiny_probe_checker::visit_binary_expression (binary_expression* e)
+{
+  // Division checks for zero, which would be an error.
+  if (e->op == "/" || e->op == "%")
+    {
+      literal_number* n = dynamic_cast<literal_number*>(e->right);
+      if (!n || n->value == 0)
+        throwone (e->tok);
+    }
+  check_long (e->left);
+  check_long (e->right);
+}
+
+
+void
+tiny_probe_checker::visit_logical_or_expr (logical_or_expr* e)
+{
+  check_long (e->left);
+  check_long (e->right);
+}
+
+
+void
+tiny_probe_checker::visit_logical_and_expr (logical_and_expr* e)
+{
+  check_long (e->left);
+  check_long (e->right);
+}
+
+
+void
+tiny_probe_checker::visit_comparison (comparison* e)
+{
+  check_long (e->left);
+  check_long (e->right);
+}
+
+
+void
+tiny_probe_checker::visit_ternary_expression (ternary_expression* e)
+{
+  check_long (e->cond);
+  check_long (e->truevalue);
+  check_long (e->falsevalue);
+}
+
+
+void
+tiny_probe_checker::visit_assignment (assignment* e)
+{
+  if (e->op == "/=" || e->op == "%=")
+    {
+      literal_number* n = dynamic_cast<literal_number*>(e->right);
+      if (!n || n->value == 0)
+        throwone (e->tok);
+    }
+  else if (e->op == "<<<")
+    throwone (e->tok);
+  check_scalar (e->left);
+  check_long (e->right);
+}
+
+
+void
+tiny_probe_checker::visit_symbol (symbol* e)
+{
+  if (e->type != pe_long || !e->referent || e->referent->arity > 0)
+    throwone (e->tok);
+}
+
+
+void
+tiny_probe_checker::visit_arrayindex (arrayindex* e)
+{
+  symbol* sym;
+  if (e->type != pe_long || !e->base->is_symbol (sym))
+    throwone (e->tok);
+  for (unsigned i = 0; i < e->indexes.size(); i++)
+    if (!e->indexes[i])
+      throwone (e->tok);
+    else
+      check_long (e->indexes[i]);
+}
+
 void
 c_tmpcounter::emit_function (functiondecl* fd)
 {
@@ -2735,7 +3520,7 @@ c_unparser::emit_function (functiondecl* v)
   string funcname = c_funcname (v->name, funcname_shortened);
   if (funcname_shortened)
     o->newline() << "/* " << v->name << " */";
-  o->newline() << "static void " << funcname
+  o->newline() << "static " << pgo_attributes (v) << "void " << funcname
             << " (struct context* __restrict__ c) {";
   o->indent(1);
 
@@ -2776,6 +3561,10 @@ c_unparser::emit_function (functiondecl* v)
   o->newline(1) << "c->nesting ++;";
   o->newline(-1) << "}";
 
+  map<functiondecl*, unsigned>::const_iterator pf = pgo_functions.find (v);
+  if (pf != pgo_functions.end())
+    o->newline() << "stap_pgo_calls[" << pf->second << "]++;";
+
   // initialize runtime overloading flag
   o->newline() << "c->next = 0;";
   o->newline() << "#define STAP_NEXT do { c->next = 1; goto out; } while(0)";
@@ -2885,6 +3674,8 @@ c_tmpcounter::emit_probe (derived_probe* dp)
 
       o->newline() << "struct " << dp->name() << "_locals {";
       o->indent(1);
+      unshared_size = 0;
+      open_scope (false);
       for (unsigned j=0; j<dp->locals.size(); j++)
 	{
 	  vardecl* v = dp->locals[j];
@@ -2892,6 +3683,7 @@ c_tmpcounter::emit_probe (derived_probe* dp)
 	    {
 	      o->newline() << c_typename (v->type) << " "
 			   << c_localname (v->name) << ";";
+	      add_size (decl_size (v->type));
 	    } catch (const semantic_error& e) {
 	    semantic_error e2 (e);
 	    if (e2.tok1 == 0) e2.tok1 = v->tok;
@@ -2913,6 +3705,13 @@ c_tmpcounter::emit_probe (derived_probe* dp)
 
       o->newline(-1) << "} " << dp->name() << ";";
 
+      assert (scopes.size() == 1);
+      if (session->verbose > 1)
+        clog << _F("%s locals take %u bytes of context (%u unshared, MAXSTRINGLEN=%u)",
+                   dp->name().c_str(), scopes.back().size, unshared_size,
+                   string_size) << endl;
+      scopes.clear();
+
       // finish dummy indentation
       this->o->indent (-1);
       this->o->assert_0_indent ();
@@ -2976,7 +3775,8 @@ c_unparser::emit_probe (derived_probe* v)
   else // This probe is unique.  Remember it and output it.
     {
       o->newline();
-      o->newline() << "static void " << v->name() << " (struct context * __restrict__ c) ";
+      o->newline() << "static " << pgo_attributes (v) << "void " << v->name()
+                   << " (struct context * __restrict__ c) ";
       o->line () << "{";
       o->indent (1);
 
@@ -3066,7 +3866,11 @@ c_unparser::emit_probe (derived_probe* v)
         clog << _F("%d statements for probe %s", mai.statement_count,
 		   v->name().c_str()) << endl;
 
-      if (mai.statement_count_finite() && !session->suppress_time_limits
+      // A tiny probe's entry function doesn't even set actionremaining;
+      // its handler has only a few statements and no loops.
+      if (v->tiny)
+        this->already_checked_action_count = true;
+      else if (mai.statement_count_finite() && !session->suppress_time_limits
           && !session->unoptimized) // this is a finite-statement-count probe
         {
           o->newline() << "if (c->actionremaining < " << mai.statement_count 
@@ -3084,6 +3888,7 @@ c_unparser::emit_probe (derived_probe* v)
       // someday be local
 
       o->indent(1);
+      emit_stripe_unlock ();
 
       if (!v->probes_with_affected_conditions.empty())
         {
@@ -3103,6 +3908,7 @@ c_unparser::emit_probe (derived_probe* v)
             }
           o->newline(-1) << "deref_fault: __attribute__((unused));";
           o->newline() << "out: __attribute__((unused));";
+          emit_stripe_unlock ();
           o->newline() << "}";
         }
 
@@ -3185,6 +3991,22 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       bool write_p = vut.written.count(v) > 0;
       if (!read_p && !write_p) continue;
 
+      // Striped arrays are locked per element access instead.
+      if (striped_globals.count(v))
+        {
+          if (session->verbose > 1)
+            clog << " " << v->name << "[striped]";
+          continue;
+        }
+
+      // Atomic counters need no lock at all.
+      if (atomic_globals.count(v))
+        {
+          if (session->verbose > 1)
+            clog << " " << v->name << "[atomic]";
+          continue;
+        }
+
       bool written_p;
       if (v->type == pe_stats) // read and write locks are flipped
         // Specifically, a "<<<" to a stats object is considered a
@@ -3212,6 +4034,8 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       o->newline() << "{";
       o->newline(1) << ".lock = global_lock(" + c_globalname(v->name) + "),";
       o->newline() << ".write_p = " << (write_p ? 1 : 0) << ",";
+      if (read_mostly_globals.count(v))
+        o->newline() << ".cpu_locks = global_cpu_locks(" << c_globalname(v->name) << "),";
       o->newline() << "#ifdef STP_TIMING";
       o->newline() << ".skipped = global_skipped(" << c_globalname (v->name) << "),";
       o->newline() << ".contention = global_contended(" << c_globalname (v->name) << "),";
@@ -3221,7 +4045,8 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       numvars ++;
       if (session->verbose > 1)
         clog << " " << v->name << "[" << (read_p ? "r" : "")
-             << (write_p ? "w" : "")  << "]";
+             << (write_p ? "w" : "")
+             << (read_mostly_globals.count(v) ? "/cpu" : "") << "]";
     }
 
   o->newline(-1) << "};";
@@ -3255,74 +4080,336 @@ c_unparser::emit_lock()
   o->newline(1) << "_stp_error(\"invalid lock state\");";
   o->newline(-1) << "}";
 }
-    
+    
+
+// The given statement was found to have no lockworthy constituents.
+// But if given statement was still listed for pushdown, then it was 
+// by logic error, so kvetch and emit a token lock and/or unlock.
+// Eventually this could become an assertion error.
+void
+c_unparser::locks_not_needed_argh (statement *p)
+{
+  if (!pushdown_lock_p(p) && !pushdown_unlock_p(p))
+    return; // no problem then!
+      
+  if (this->session->verbose > 2)
+    clog << "Oops, unexpected"
+         << (pushdown_lock_p(p) ? " lock" : "")
+         << (pushdown_unlock_p(p) ? " unlock" : "")
+         << " pushdown for statement " << *p->tok << endl;
+
+  if (pushdown_lock_p(p))
+    emit_lock();
+  if (pushdown_unlock_p(p))
+    emit_unlock();
+}
+
+
+// Check whether this statement reads or writes any globals.
+// Those that do not, can allow lock or unlock operations to
+// slide forward or backward over them (respectively).
+bool
+c_unparser::locks_needed_p(visitable *s) // statement OR expression
+{
+  if (! current_probe) // called from function context?
+    return false;
+
+  if (! current_probe->needs_global_locks ())
+    return false;
+
+  // NB: In compatible mode, return TRUE all the time, so that
+  // locks/unlocks are emitted early/late always.
+  if (strverscmp(this->session->compatible.c_str(), "4.3") <= 0)
+    return true;
+  
+  varuse_collecting_visitor vut(*session);
+  s->visit (& vut);
+  bool lock_me = false;
+  for (unsigned i = 0; i < session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (striped_globals.count(v) || atomic_globals.count(v))
+        continue; // not in the locks[] of emit_lock_decls
+      bool read_p = vut.read.count(v) > 0;
+      bool write_p = vut.written.count(v) > 0;
+      lock_me = read_p || write_p;
+      if (lock_me) break; // first hit is enough
+    }
+
+  return lock_me;
+}
+
+
+void
+c_unparser::emit_unlock()
+{
+  if (this->session->verbose > 3)
+    clog << "emit unlock" << endl;
+  
+  o->newline() << "if (c->locked == 1) {";
+  o->newline(1) << "stp_unlock_probe(locks, ARRAY_SIZE(locks));";
+  o->newline() << "c->locked = 2;"; // NB: 2 so it won't re-lock
+  o->newline(-1) << "}";
+}
+
+
+// --lock-stripes: find uses of global arrays that need the whole array
+// locked.  Iteration and clearing are only harmless in probes that take
+// no global locks, that is begin/end/error probes; slices and embedded-C
+// pragmas never are.
+struct stripe_unsafe_visitor: public functioncall_traversing_visitor
+{
+  bool whole_ok;
+  set<vardecl*> unsafe;
+
+  stripe_unsafe_visitor(bool whole_ok): whole_ok (whole_ok) {}
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol *array;
+    hist_op *hist;
+    classify_indexable (s->base, array, hist);
+    if (array && !whole_ok)
+      unsafe.insert (array->referent);
+    functioncall_traversing_visitor::visit_foreach_loop (s);
+  }
+
+  void visit_delete_statement (delete_statement* s)
+  {
+    symbol *sym = dynamic_cast<symbol*>(s->value);
+    if (sym && sym->referent->arity > 0 && !whole_ok)
+      unsafe.insert (sym->referent);
+    functioncall_traversing_visitor::visit_delete_statement (s);
+  }
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    symbol *array;
+    hist_op *hist;
+    classify_indexable (e->base, array, hist);
+    for (unsigned i=0; array && i<e->indexes.size(); i++)
+      if (e->indexes[i] == NULL)
+        unsafe.insert (array->referent);
+    functioncall_traversing_visitor::visit_arrayindex (e);
+  }
+
+  void visit_embeddedcode (embeddedcode* s)
+  {
+    unsafe.insert (s->read_referents.begin(), s->read_referents.end());
+    unsafe.insert (s->write_referents.begin(), s->write_referents.end());
+  }
+
+  void visit_embedded_expr (embedded_expr* e)
+  {
+    unsafe.insert (e->read_referents.begin(), e->read_referents.end());
+    unsafe.insert (e->write_referents.begin(), e->write_referents.end());
+  }
+};
+
+
+// Pick the global arrays that get one lock per stripe of keys instead
+// of one for the whole array: ordinary (non-stat, non-wrapping) arrays
+// that are written by probes taking global locks, and that those probes
+// only ever access an element at a time.
+void
+c_unparser::collect_striped_globals ()
+{
+  if (session->lock_stripes <= 0 || session->runtime_usermode_p())
+    return;
+
+  varuse_collecting_visitor vut (*session);
+  stripe_unsafe_visitor locked_suv (false);
+  stripe_unsafe_visitor unlocked_suv (true);
+  for (unsigned i=0; i<session->probes.size(); i++)
+    {
+      derived_probe* p = session->probes[i];
+      if (p->needs_global_locks ())
+        {
+          p->body->visit (&vut);
+          p->body->visit (&locked_suv);
+        }
+      else
+        p->body->visit (&unlocked_suv);
+      if (p->sole_location()->condition)
+        p->sole_location()->condition->visit (&locked_suv);
+    }
+
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (v->arity <= 0 || v->type == pe_stats || v->wrap)
+        continue;
+      if (!vut.written.count(v) || locked_suv.unsafe.count(v)
+          || unlocked_suv.unsafe.count(v))
+        continue;
+
+      striped_globals.insert (v);
+      if (session->verbose > 1)
+        clog << _F("global %s locked in %d stripes", v->unmangled_name.to_string().c_str(),
+                   session->lock_stripes) << endl;
+    }
+}
 
-// The given statement was found to have no lockworthy constituents.
-// But if given statement was still listed for pushdown, then it was 
-// by logic error, so kvetch and emit a token lock and/or unlock.
-// Eventually this could become an assertion error.
+
+// Lock the stripe of a striped array holding the key idx, for one element
+// access; it stays locked until emit_stripe_unlock(), or until the next
+// "out:" label if the access fails.
 void
-c_unparser::locks_not_needed_argh (statement *p)
+c_unparser::emit_stripe_lock (mapvar const& mv, vector<tmpvar> const& idx, bool write_p)
 {
-  if (!pushdown_lock_p(p) && !pushdown_unlock_p(p))
-    return; // no problem then!
-      
-  if (this->session->verbose > 2)
-    clog << "Oops, unexpected"
-         << (pushdown_lock_p(p) ? " lock" : "")
-         << (pushdown_unlock_p(p) ? " unlock" : "")
-         << " pushdown for statement " << *p->tok << endl;
+  o->newline() << "if (!stp_lock_stripe (c, " << mv.value() << ", "
+               << mv.function_keysym("stripe") << " (";
+  for (unsigned i=0; i<idx.size(); i++)
+    o->line() << (i ? ", " : "") << idx[i].value();
+  o->line() << "), " << (write_p ? 1 : 0) << ")) goto out;";
+}
 
-  if (pushdown_lock_p(p))
-    emit_lock();
-  if (pushdown_unlock_p(p))
-    emit_unlock();
+
+void
+c_unparser::emit_stripe_unlock ()
+{
+  if (!striped_globals.empty())
+    o->newline() << "stp_unlock_stripe (c);";
 }
 
 
-// Check whether this statement reads or writes any globals.
-// Those that do not, can allow lock or unlock operations to
-// slide forward or backward over them (respectively).
-bool
-c_unparser::locks_needed_p(visitable *s) // statement OR expression
+// Find the numeric scalar globals that are not just counters: those
+// assigned, reset or otherwise read-modify-written, other than by += and
+// -= (or ++ and --), in probes that take global locks, and those used as
+// foreach variables or referenced from embedded C anywhere.
+struct atomic_unsafe_visitor: public functioncall_traversing_visitor
 {
-  if (! current_probe) // called from function context?
-    return false;
+  bool exclusive; // in a begin/end/error probe
+  set<vardecl*> unsafe;
 
-  if (! current_probe->needs_global_locks ())
-    return false;
+  atomic_unsafe_visitor(bool exclusive): exclusive (exclusive) {}
 
-  // NB: In compatible mode, return TRUE all the time, so that
-  // locks/unlocks are emitted early/late always.
-  if (strverscmp(this->session->compatible.c_str(), "4.3") <= 0)
-    return true;
-  
-  varuse_collecting_visitor vut(*session);
-  s->visit (& vut);
-  bool lock_me = false;
-  for (unsigned i = 0; i < session->globals.size(); i++)
+  void visit_assignment (assignment* e)
+  {
+    symbol *sym;
+    if (!exclusive && e->left->is_symbol (sym) && sym->referent->arity == 0
+        && e->op != "+=" && e->op != "-=")
+      unsafe.insert (sym->referent);
+    functioncall_traversing_visitor::visit_assignment (e);
+  }
+
+  void visit_delete_statement (delete_statement* s)
+  {
+    symbol *sym;
+    if (!exclusive && s->value->is_symbol (sym) && sym->referent->arity == 0)
+      unsafe.insert (sym->referent);
+    functioncall_traversing_visitor::visit_delete_statement (s);
+  }
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    for (unsigned i=0; i<s->indexes.size(); i++)
+      unsafe.insert (s->indexes[i]->referent);
+    if (s->value)
+      unsafe.insert (s->value->referent);
+    functioncall_traversing_visitor::visit_foreach_loop (s);
+  }
+
+  void visit_embeddedcode (embeddedcode* s)
+  {
+    unsafe.insert (s->read_referents.begin(), s->read_referents.end());
+    unsafe.insert (s->write_referents.begin(), s->write_referents.end());
+  }
+
+  void visit_embedded_expr (embedded_expr* e)
+  {
+    unsafe.insert (e->read_referents.begin(), e->read_referents.end());
+    unsafe.insert (e->write_referents.begin(), e->write_referents.end());
+  }
+};
+
+
+// Pick the numeric scalar globals that locking probes only ever add to,
+// like "hits++", so that they can be atomic64_t counters needing no lock.
+// Reads then see each counter on its own, no longer consistent with the
+// other globals the probe reads under its locks.
+void
+c_unparser::collect_atomic_globals ()
+{
+  if (session->unoptimized || session->runtime_usermode_p())
+    return;
+
+  varuse_collecting_visitor vut (*session);
+  atomic_unsafe_visitor locked_auv (false);
+  atomic_unsafe_visitor exclusive_auv (true);
+  for (unsigned i=0; i<session->probes.size(); i++)
     {
-      vardecl* v = session->globals[i];
-      bool read_p = vut.read.count(v) > 0;
-      bool write_p = vut.written.count(v) > 0;
-      lock_me = read_p || write_p;
-      if (lock_me) break; // first hit is enough
+      derived_probe* p = session->probes[i];
+      if (p->needs_global_locks ())
+        {
+          p->body->visit (&vut);
+          p->body->visit (&locked_auv);
+        }
+      else
+        p->body->visit (&exclusive_auv);
     }
 
-  return lock_me;
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (v->arity != 0 || v->type != pe_long)
+        continue;
+      if (!vut.written.count(v) || locked_auv.unsafe.count(v)
+          || exclusive_auv.unsafe.count(v))
+        continue;
+
+      atomic_globals.insert (v);
+      if (session->verbose > 1)
+        clog << _F("global %s is an atomic counter", v->unmangled_name.to_string().c_str())
+             << endl;
+    }
 }
 
 
+// Pick the globals that are written only by infrequent probes, like slow
+// timers, but read by frequent ones.  Their readers take a lock of their
+// own CPU instead of the shared one, and writers take all of those; see
+// probe_lock.h.  Begin/end probes take no locks, and globals written only
+// there already go unlocked, see emit_lock_decls.
 void
-c_unparser::emit_unlock()
+c_unparser::collect_read_mostly_globals ()
 {
-  if (this->session->verbose > 3)
-    clog << "emit unlock" << endl;
-  
-  o->newline() << "if (c->locked == 1) {";
-  o->newline(1) << "stp_unlock_probe(locks, ARRAY_SIZE(locks));";
-  o->newline() << "c->locked = 2;"; // NB: 2 so it won't re-lock
-  o->newline(-1) << "}";
+  if (session->unoptimized || session->runtime_usermode_p())
+    return;
+
+  set<vardecl*> frequent_reads, frequent_writes, infrequent_writes;
+  for (unsigned i=0; i<session->probes.size(); i++)
+    {
+      derived_probe* p = session->probes[i];
+      if (! p->needs_global_locks ())
+        continue;
+
+      varuse_collecting_visitor vut (*session);
+      p->body->visit (&vut);
+      if (p->infrequent_p ())
+        infrequent_writes.insert (vut.written.begin(), vut.written.end());
+      else
+        {
+          frequent_writes.insert (vut.written.begin(), vut.written.end());
+          frequent_reads.insert (vut.read.begin(), vut.read.end());
+        }
+    }
+
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      // NB: stats are read and written with their locks flipped
+      if (v->type == pe_stats || striped_globals.count(v) || atomic_globals.count(v))
+        continue;
+      if (!infrequent_writes.count(v) || frequent_writes.count(v)
+          || !frequent_reads.count(v))
+        continue;
+
+      read_mostly_globals.insert (v);
+      if (session->verbose > 1)
+        clog << _F("global %s is read-mostly", v->unmangled_name.to_string().c_str())
+             << endl;
+    }
 }
 
 
@@ -3424,6 +4511,11 @@ c_unparser::emit_map_type_instantiations ()
   for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
     collect_map_index_types(it->second->locals, types);
 
+  set< pair<vector<exp_type>, exp_type> > striped_types;
+  for (set<vardecl*>::const_iterator it = striped_globals.begin();
+       it != striped_globals.end(); ++it)
+    striped_types.insert(make_pair((*it)->index_types, (*it)->type));
+
   if (!types.empty())
     o->newline() << "#include \"alloc.c\"";
 
@@ -3439,8 +4531,13 @@ c_unparser::emit_map_type_instantiations ()
       /* For statistics, flag map-gen to pull in nested pmap-gen too.  */
       if (i->second == pe_stats)
 	o->newline() << "#define MAP_DO_PMAP 1";
+      /* Likewise smap-gen for striped arrays.  */
+      if (striped_types.count(*i))
+	o->newline() << "#define MAP_DO_SMAP 1";
       o->newline() << "#include \"map-gen.c\"";
       o->newline() << "#undef MAP_DO_PMAP";
+      if (striped_types.count(*i))
+	o->newline() << "#undef MAP_DO_SMAP";
       o->newline() << "#undef VALUE_TYPE";
       for (unsigned j = 0; j < i->first.size(); ++j)
 	{
@@ -3654,6 +4751,9 @@ c_unparser::c_assign(tmpvar& t, expression *e, const char* msg)
       // All instances of this tmpvar will use the literal value.
       t.override (oss.str());
     }
+  else if (dynamic_cast<concatenation*>(e) && !session->unoptimized)
+    // Concatenate straight into the temporary; see c_strcat_chain.
+    c_strcat_chain (t.value(), static_cast<concatenation*>(e));
   else
     c_assign (t.value(), e, msg);
 }
@@ -3912,6 +5012,30 @@ c_unparser::c_strcat (const string& lvalue, expression* rvalue)
 }
 
 
+// Write all the operands of a chain of concatenations like a.b.c
+// straight into lvalue, rather than each partial result into its own
+// temporary to be copied into the next.  The operands must not read
+// lvalue, so it should be a fresh temporary.
+void
+c_unparser::c_strcat_chain (const string& lvalue, concatenation* e)
+{
+  if (e->op != ".")
+    throw SEMANTIC_ERROR (_("unexpected concatenation operator"), e->tok);
+
+  if (e->type != pe_string ||
+      e->left->type != pe_string ||
+      e->right->type != pe_string)
+    throw SEMANTIC_ERROR (_("expected string types"), e->tok);
+
+  concatenation* left = dynamic_cast<concatenation*>(e->left);
+  if (left && !session->unoptimized)
+    c_strcat_chain (lvalue, left);
+  else
+    c_assign (lvalue, e->left, "assignment");
+  c_strcat (lvalue, e->right);
+}
+
+
 bool
 c_unparser::is_local(vardecl const *r, token const *tok)
 {
@@ -3993,7 +5117,8 @@ c_unparser::getmap(vardecl *v, token const *tok)
   if (i != session->stat_decls.end())
     sd = i->second;
   return mapvar (this, is_local (v, tok), v->type, sd,
-      v->name, v->index_types, v->maxsize, v->wrap);
+      v->name, v->index_types, v->maxsize, v->wrap,
+      striped_globals.count(v) > 0);
 }
 
 
@@ -4138,6 +5263,7 @@ void c_unparser::visit_try_block (try_block *s)
 
   o->newline() << "deref_fault: __attribute__((unused));";
   o->newline() << "out: __attribute__((unused));";
+  emit_stripe_unlock ();
 
   // Close the scope of the above nested 'out' label, to make sure
   // that the catch block, should it encounter errors, does not resolve
@@ -4308,6 +5434,7 @@ c_tmpcounter::start_struct_def (std::ostream::pos_type &before,
                << ":" << lex_cast(tok->location.line) << " */";
   o->indent(1);
   after = o->tellp();
+  open_scope (false);
 }
 
 void
@@ -4316,6 +5443,7 @@ c_tmpcounter::close_struct_def (std::ostream::pos_type before,
 {
   // meant to be used with ::start_struct_def. remove the struct if empty.
   translator_output *o = parent->o;
+  close_scope ();
   o->indent(-1);
   if (after == o->tellp())
     o->seekp(before);
@@ -4332,16 +5460,75 @@ c_tmpcounter::start_compound_statement (const char* tag, statement *s)
                << loc.file->name << ":"
                << lex_cast(loc.line) << " */";
   o->indent(1);
+  open_scope (true);
 }
 
 void
 c_tmpcounter::close_compound_statement (const char*, statement *)
 {
   translator_output *o = parent->o;
+  close_scope ();
   o->newline(-1) << "};";
 }
 
 
+void
+c_tmpcounter::start_compound_expression (const char* tag, expression *e)
+{
+  // Overlay the temporaries of the operands with each other, like the
+  // statements of a block; only the copy of each operand's value has
+  // to survive the others' evaluation.  As in ::start_struct_def, the
+  // union is dropped again if no operand needs a temporary.
+  const source_loc& loc = e->tok->location;
+  translator_output *o = parent->o;
+  compound_expression ce;
+  ce.before = o->tellp();
+  o->newline() << "union { /* " << tag << ": "
+               << loc.file->name << ":"
+               << lex_cast(loc.line) << " */";
+  o->indent(1);
+  ce.after = o->tellp();
+  compound_exprs.push_back (ce);
+  open_scope (true);
+}
+
+void
+c_tmpcounter::close_compound_expression (const char*, expression *)
+{
+  translator_output *o = parent->o;
+  assert (!compound_exprs.empty());
+  compound_expression ce = compound_exprs.back();
+  compound_exprs.pop_back();
+
+  close_scope ();
+  o->indent(-1);
+  if (ce.after == o->tellp())
+    o->seekp(ce.before);
+  else
+    o->newline() << "};";
+
+  for (unsigned i = 0; i < ce.results.size(); i++)
+    {
+      parent->c_declare (ce.results[i].first, ce.results[i].second);
+      add_size (decl_size (ce.results[i].first));
+    }
+}
+
+void
+c_tmpcounter::wrap_compound_assign (tmpvar& t, expression *e, const char* msg)
+{
+  std::ostream::pos_type before_struct_pos;
+  std::ostream::pos_type after_struct_pos;
+
+  assert (!compound_exprs.empty());
+  compound_exprs.back().result = t.c_name();
+  start_struct_def(before_struct_pos, after_struct_pos, e->tok);
+  c_unparser::wrap_compound_assign (t, e, msg);
+  close_struct_def(before_struct_pos, after_struct_pos);
+  compound_exprs.back().result.clear();
+}
+
+
 void
 c_unparser::visit_if_statement (if_statement *s)
 {
@@ -4358,16 +5545,24 @@ c_unparser::visit_if_statement (if_statement *s)
 
   if (condition_nl && pushdown_lock_p(s))
     emit_lock(); // and then thenblock/elseblock don't need to lock or pushdown!
-  
-  o->newline() << "if (";
+
+  map<if_statement*, unsigned>::const_iterator pb = pgo_branches.find (s);
+  if (pb != pgo_branches.end())
+    o->newline() << "stap_pgo_branches[" << pb->second << "].run++;";
+
+  string hint = pgo_branch_hint (s);
+  o->newline() << "if (" << (hint.empty() ? "" : hint + " (");
   o->indent (1);
 
   wrap_compound_visit (s->condition);
   o->indent (-1);
-  o->line() << ")";
+  o->line() << (hint.empty() ? ")" : "))");
   
   o->line() << "{";
   o->indent (1);
+
+  if (pb != pgo_branches.end())
+    o->newline() << "stap_pgo_branches[" << pb->second << "].taken++;";
   
   if (condition_nl && !thenblock_nl && pushdown_unlock_p(s))
     emit_unlock();
@@ -4653,20 +5848,34 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
         }
       else
 	{
+	  // a striped array is iterated through a copy of all its stripes;
+	  // see collect_striped_globals for why no locks are needed here
+	  string map = mv.value();
+	  if (mv.is_striped())
+	    {
+	      o->newline() << "if (unlikely(NULL == " << mv.calculate_aggregate() << ")) {";
+	      o->newline(1) << "c->last_error = ";
+	      o->line() << STAP_T_05 << mv << "\";";
+	      o->newline() << "c->last_stmt = " << lex_cast_qstring(*s->tok) << ";";
+	      o->newline() << "goto out;";
+	      o->newline(-1) << "}";
+	      map = mv.fetch_existing_aggregate();
+	    }
+
 	  // sort array if desired
 	  if (s->sort_direction)
 	    {
 	      if (s->limit)
 	        {
-		  o->newline() << mv.function_keysym("sortn") <<" ("
-			       << mv.value() << ", "
+		  o->newline() << mv.function_keysym("sortn", true) <<" ("
+			       << map << ", "
 			       << *res_limit << ", " << s->sort_column << ", "
 			       << - s->sort_direction << ");";
 		}
 	      else
 	        {
-		  o->newline() << mv.function_keysym("sort") <<" ("
-			       << mv.value() << ", "
+		  o->newline() << mv.function_keysym("sort", true) <<" ("
+			       << map << ", "
 			       << s->sort_column << ", "
 			       << - s->sort_direction << ");";
 		}
@@ -4784,7 +5993,12 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
 	  c_assign (v, iv.get_value (mv, v.type()), s->tok);
         }
 
-      visit_foreach_loop_value(s, iv.get_value(mv, array->type));
+      // NB: the iterated copy of a striped array goes stale if the
+      // loop body modifies the array
+      if (mv.is_striped())
+        s->block->visit (this);
+      else
+        visit_foreach_loop_value(s, iv.get_value(mv, array->type));
       record_actions(0, s->block->tok, true);
       o->newline(-1) << "}";
       loop_break_labels.pop_back ();
@@ -4952,6 +6166,8 @@ delete_statement_operand_visitor::visit_symbol (symbol* e)
       */
       if (mvar.is_parallel())
 	o->newline() << "_stp_pmap_clear (" << mvar.value() << ");";
+      else if (mvar.is_striped())
+	o->newline() << "_stp_smap_clear (" << mvar.value() << ");";
       else
 	o->newline() << "_stp_map_clear (" << mvar.value() << ");";
     }
@@ -4964,7 +6180,10 @@ delete_statement_operand_visitor::visit_symbol (symbol* e)
 	  o->newline() << "_stp_stat_clear (" << v.value() << ");";
 	  break;
 	case pe_long:
-	  o->newline() << v.value() << " = 0;";
+	  if (parent->atomic_globals.count(e->referent))
+	    o->newline() << "atomic64_set (&" << v.value() << ", 0);";
+	  else
+	    o->newline() << v.value() << " = 0;";
 	  break;
 	case pe_string:
 	  o->newline() << v.value() << "[0] = '\\0';";
@@ -4999,7 +6218,11 @@ delete_statement_operand_visitor::visit_arrayindex (arrayindex* e)
           vector<tmpvar> idx;
           parent->load_map_indices (e, idx);
           mapvar mvar = parent->getmap (array->referent, e->tok);
+          if (mvar.is_striped())
+            parent->emit_stripe_lock (mvar, idx, true);
           o->newline() << mvar.del (idx) << ";";
+          if (mvar.is_striped())
+            parent->emit_stripe_unlock ();
         }
       else // delete elements if they match the array slice.
         {
@@ -5399,7 +6622,11 @@ c_unparser::visit_array_in (array_in* e)
           // o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
 
           mapvar mvar = getmap (array->referent, e->tok);
+          if (mvar.is_striped())
+            emit_stripe_lock (mvar, idx, false);
           c_assign (res, mvar.exists(idx), e->tok);
+          if (mvar.is_striped())
+            emit_stripe_unlock ();
 
           o->newline() << res << ";";
         }
@@ -5504,7 +6731,11 @@ c_unparser::visit_regex_query (regex_query* e)
   o->indent(1);
   o->newline();
   if (e->op == "!~") o->line() << "!";
-  stapdfa *dfa = session->dfas[e->right->value];
+  stapdfa *dfa;
+  if (!e->others.empty())
+    dfa = regex_to_stapdfa (session, e->patterns(), e->tok); // -- already compiled
+  else
+    dfa = session->dfas[e->right->value];
   dfa->emit_matchop_start (o);
   e->left->visit(this);
   dfa->emit_matchop_end (o);
@@ -5564,21 +6795,12 @@ c_unparser::visit_comparison (comparison* e)
 void
 c_unparser::visit_concatenation (concatenation* e)
 {
-  if (e->op != ".")
-    throw SEMANTIC_ERROR (_("unexpected concatenation operator"), e->tok);
-
-  if (e->type != pe_string ||
-      e->left->type != pe_string ||
-      e->right->type != pe_string)
-    throw SEMANTIC_ERROR (_("expected string types"), e->tok);
-
   tmpvar t = gensym (e->type);
 
   o->line() << "({ ";
   o->indent(1);
   // o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
-  c_assign (t.value(), e->left, "assignment");
-  c_strcat (t.value(), e->right);
+  c_strcat_chain (t.value(), e);
   o->newline() << t << ";";
   o->newline(-1) << "})";
 }
@@ -5667,7 +6889,10 @@ c_unparser::visit_symbol (symbol* e)
     throw SEMANTIC_ERROR (_("invalid reference to array"), e->tok);
 
   var v = getvar(r, e->tok);
-  o->line() << v;
+  if (atomic_globals.count(r))
+    o->line() << "atomic64_read (&" << v << ")";
+  else
+    o->line() << v;
 }
 
 void
@@ -5772,7 +6997,28 @@ c_unparser_assignment::visit_symbol (symbol *e)
   prepare_rvalue (op, rval, e->tok);
 
   var lvar = parent->getvar (e->referent, e->tok);
-  c_assignop (res, lvar, rval, e->tok);
+  if (parent->atomic_globals.count(e->referent))
+    {
+      // see c_unparser::collect_atomic_globals
+      if (op == "++" || op == "+=" || op == "--" || op == "-=")
+        {
+          string fn = (op == "++" || op == "+=") ? "atomic64_add_return" : "atomic64_sub_return";
+          string undo = (op == "++" || op == "+=") ? " - " : " + ";
+          o->newline() << res << " = " << fn << " (" << rval << ", &" << lvar << ")";
+          if (post)
+            o->line() << undo << rval;
+          o->line() << ";";
+        }
+      else // only in begin/end/error probes, so no need to be atomic
+        {
+          tmpvar tmp = parent->gensym (ty);
+          o->newline() << tmp << " = atomic64_read (&" << lvar << ");";
+          c_assignop (res, tmp, rval, e->tok);
+          o->newline() << "atomic64_set (&" << lvar << ", " << tmp << ");";
+        }
+    }
+  else
+    c_assignop (res, lvar, rval, e->tok);
 
   o->newline() << res << ";";
 }
@@ -5891,15 +7137,26 @@ c_unparser::load_map_indices(arrayindex *e,
 	  r->index_types.size() != e->indexes.size())
 	throw SEMANTIC_ERROR (_("invalid array reference"), e->tok);
 
+      start_compound_expression ("arrayindex", e);
       for (unsigned i=0; i<r->index_types.size(); i++)
 	{
 	  if (r->index_types[i] != e->indexes[i]->type)
 	    throw SEMANTIC_ERROR (_("array index type mismatch"), e->indexes[i]->tok);
 
 	  tmpvar ix = gensym (r->index_types[i]);
-	  c_assign (ix, e->indexes[i], "array index copy");
+
+	  // A string function argument passed by reference can't change
+	  // in the function, so the map may read the key in place.
+	  symbol *sym_out;
+	  if (e->indexes[i]->is_symbol(sym_out)
+	      && sym_out->referent->char_ptr_arg
+	      && is_local(sym_out->referent, sym_out->tok))
+	    ix.override("((char *) " + getvar(sym_out->referent, sym_out->tok).value() + ")");
+	  else
+	    wrap_compound_assign (ix, e->indexes[i], "array index copy");
 	  idx.push_back (ix);
 	}
+      close_compound_expression ("arrayindex", e);
     }
   else
     {
@@ -5991,7 +7248,11 @@ c_unparser::visit_arrayindex (arrayindex* e)
 
       mapvar mvar = getmap (array->referent, e->tok);
       // o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
+      if (mvar.is_striped())
+        emit_stripe_lock (mvar, idx, false);
       c_assign (res, mvar.get(idx), e->tok);
+      if (mvar.is_striped())
+        emit_stripe_unlock ();
 
       o->newline() << res << ";";
     }
@@ -6134,10 +7395,14 @@ c_unparser_assignment::visit_arrayindex (arrayindex *e)
 	{
 	  mapvar mvar = parent->getmap (array->referent, e->tok);
 	  o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
+	  if (mvar.is_striped())
+	    parent->emit_stripe_lock (mvar, idx, true);
 	  if (op != "=") // don't bother fetch slot if we will just overwrite it
 	    parent->c_assign (lvar, mvar.get(idx), e->tok);
 	  c_assignop (res, lvar, rvar, e->tok);
 	  o->newline() << mvar.set (idx, lvar) << ";";
+	  if (mvar.is_striped())
+	    parent->emit_stripe_unlock ();
 	}
 
       o->newline() << res << ";";
@@ -6186,6 +7451,7 @@ c_unparser::visit_functioncall (functioncall* e)
 
   // compute actual arguments
   vector<tmpvar> tmp;
+  start_compound_expression ("functioncall", e);
   for (unsigned i=0; i<e->args.size(); i++)
     {
       tmpvar t = gensym(e->args[i]->type);
@@ -6195,10 +7461,11 @@ c_unparser::visit_functioncall (functioncall* e)
           && is_local(sym_out->referent, sym_out->tok))
         t.override(getvar(sym_out->referent, sym_out->tok).value());
       else
-        c_assign (t, e->args[i],
-                  _("function actual argument evaluation"));
+        wrap_compound_assign (t, e->args[i],
+                              _("function actual argument evaluation"));
       tmp.push_back(t);
     }
+  close_compound_expression ("functioncall", e);
 
   // overloading execution logic for functioncall:
   //
@@ -6449,13 +7716,15 @@ c_unparser::visit_print_format (print_format* e)
       // Compute actual arguments
       vector<tmpvar> tmp;
 
+      start_compound_expression ("print_format", e);
       for (unsigned i=0; i<e->args.size(); i++)
 	{
 	  tmpvar t = gensym(e->args[i]->type);
-	  c_assign (t, e->args[i],
-		    "print format actual argument evaluation");
+	  wrap_compound_assign (t, e->args[i],
+				"print format actual argument evaluation");
 	  tmp.push_back(t);
 	}
+      close_compound_expression ("print_format", e);
 
       // Allocate the result
       exp_type ty = e->print_to_stream ? pe_long : pe_string;
@@ -6733,6 +8002,8 @@ struct unwindsym_dump_context
   size_t debug_line_str_len;
 
   set<string> undone_unwindsym_modules;
+
+  ostream* shared_output; // the shared symbols module, if any
 };
 
 static bool need_byte_swap_for_target (const unsigned char e_ident[])
@@ -7554,12 +8825,56 @@ dump_unwind_tables (Dwfl_Module *m,
   return DWARF_CB_OK;
 }
 
+// With --shared-symbols, the kernel's symbol and unwind tables are
+// defined and exported by the shared symbols module, and the script
+// module only declares them.  STAP_SYMBOLS_SYM gives them names unique
+// to that module, so modules of different contents can coexist.
+static ostream&
+begin_unwindsym_table (unwindsym_dump_context *c, bool shared,
+		       const string& type, const string& name)
+{
+  if (!shared)
+    {
+      c->output << "static " << type << " " << name << "[] = \n";
+      return c->output;
+    }
+
+  string sym = "STAP_SYMBOLS_SYM(" + name + ")";
+  c->output << "extern " << type << " " << sym << "[];\n";
+  c->output << "#define " << name << " " << sym << "\n";
+  *c->shared_output << type << " " << sym << "[] = \n";
+  return *c->shared_output;
+}
+
+static void
+end_unwindsym_table (unwindsym_dump_context *c, bool shared,
+		     const string& name)
+{
+  if (!shared)
+    {
+      c->output << "};\n";
+      return;
+    }
+
+  *c->shared_output << "};\n";
+  *c->shared_output << "EXPORT_SYMBOL_GPL(STAP_SYMBOLS_SYM(" << name << "));\n";
+}
+
+static void
+emit_shared_symbols_macros (ostream& output)
+{
+  output << "#define STAP_SYMBOLS_CAT(a,b) a##_##b\n";
+  output << "#define STAP_SYMBOLS_XCAT(a,b) STAP_SYMBOLS_CAT(a,b)\n";
+  output << "#define STAP_SYMBOLS_SYM(n) STAP_SYMBOLS_XCAT(n,STAP_SYMBOLS_KEY)\n";
+}
+
 static void
-dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
+dump_unwindsym_cxt_table(unwindsym_dump_context *c, bool shared,
 			 const string& modname, unsigned modindex,
 			 const string& secname, unsigned secindex,
 			 const string& table, void*& data, size_t& len)
 {
+  systemtap_session& session = c->session;
   if (len > MAX_UNWIND_TABLE_SIZE)
     {
       if (secname.empty())
@@ -7576,14 +8891,15 @@ dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
     }
 
   // if it is the debug_line data, do not need the unwind flags to be defined
+  ostream& guard = c->output;
   if((table == "debug_line") || (table == "debug_line_str"))
-    output << "#if defined(STP_NEED_LINE_DATA)\n";
+    guard << "#if defined(STP_NEED_LINE_DATA)\n";
   else
-    output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
-  output << "static uint8_t _stp_module_" << modindex << "_" << table;
+    guard << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
+  string name = "_stp_module_" + lex_cast(modindex) + "_" + table;
   if (!secname.empty())
-    output << "_" << secindex;
-  output << "[] = \n";
+    name += "_" + lex_cast(secindex);
+  ostream& output = begin_unwindsym_table (c, shared, "uint8_t", name);
   output << "  {";
   for (size_t i = 0; i < len; i++)
     {
@@ -7592,11 +8908,11 @@ dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
       if ((i + 1) % 16 == 0)
 	output << "\n" << "   ";
     }
-  output << "};\n";
+  end_unwindsym_table (c, shared, name);
   if ((table == "debug_line") || (table == "debug_line_str"))
-    output << "#endif /* STP_NEED_LINE_DATA */\n";
+    guard << "#endif /* STP_NEED_LINE_DATA */\n";
   else
-    output << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA */\n";
+    guard << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA */\n";
 }
 
 static int
@@ -7606,6 +8922,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 {
   string modname = name;
   unsigned stpmod_idx = c->stp_module_index;
+  bool shared = c->shared_output && modname == "kernel";
   void *debug_frame = c->debug_frame;
   size_t debug_len = c->debug_len;
   void *debug_frame_hdr = c->debug_frame_hdr;
@@ -7622,19 +8939,19 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   void *debug_line_str = c->debug_line_str;
   size_t debug_line_str_len = c->debug_line_str_len;
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, shared, modname, stpmod_idx, "", 0,
 			   "debug_frame", debug_frame, debug_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, shared, modname, stpmod_idx, "", 0,
 			   "eh_frame", eh_frame, eh_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, shared, modname, stpmod_idx, "", 0,
 			   "eh_frame_hdr", eh_frame_hdr, eh_frame_hdr_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, shared, modname, stpmod_idx, "", 0,
 			   "debug_line", debug_line, debug_line_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, shared, modname, stpmod_idx, "", 0,
 			   "debug_line_str", debug_line_str, debug_line_str_len);
 
   if (c->session.need_unwind && debug_frame == NULL && eh_frame == NULL)
@@ -7664,8 +8981,11 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 
   for (unsigned secidx = 0; secidx < c->seclist.size(); secidx++)
     {
-      c->output << "static struct _stp_symbol "
-                << "_stp_module_" << stpmod_idx<< "_symbols_" << secidx << "[] = {\n";
+      string symbols = ("_stp_module_" + lex_cast(stpmod_idx)
+			+ "_symbols_" + lex_cast(secidx));
+      ostream& output = begin_unwindsym_table (c, shared, "struct _stp_symbol",
+					       symbols);
+      output << "{\n";
 
       string secname = c->seclist[secidx].first;
       Dwarf_Addr extra_offset;
@@ -7683,21 +9003,21 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 	      if (it->first < extra_offset)
 		continue;
 
-	      c->output << "  { 0x" << hex << it->first-extra_offset << dec
-			<< ", " << lex_cast_qstring (it->second) << " },\n";
+	      output << "  { 0x" << hex << it->first-extra_offset << dec
+		     << ", " << lex_cast_qstring (it->second) << " },\n";
               // XXX: these literal strings all suffer ELF relocation bloat too.
               // See if the tapsets.cxx:dwarf_derived_probe_group::emit_module_decls
               // CALCIT hack could work here.
 	    }
 	}
 
-      c->output << "};\n";
+      end_unwindsym_table (c, shared, symbols);
 
       /* For now output debug_frame index only in "magic" sections. */
       if (secname == ".dynamic" || secname == ".absolute"
 	  || secname == ".text" || secname == "_stext")
 	{
-	  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, secname, secidx,
+	  dump_unwindsym_cxt_table(c, shared, modname, stpmod_idx, secname, secidx,
 				   "debug_frame_hdr", debug_frame_hdr, debug_frame_hdr_len);
 	}
     }
@@ -7920,9 +9240,12 @@ static void dump_kallsyms(unwindsym_dump_context *c)
   Dwarf_Addr start = 0;
   Dwarf_Addr end = 0;
   Dwarf_Addr prev = 0;
+  bool shared = c->shared_output != NULL;
 
-  c->output << "static struct _stp_symbol "
-            << "_stp_module_" << stpmod_idx << "_symbols_" << 0 << "[] = {\n";
+  string symbols = "_stp_module_" + lex_cast(stpmod_idx) + "_symbols_0";
+  ostream& output = begin_unwindsym_table (c, shared, "struct _stp_symbol",
+					   symbols);
+  output << "{\n";
 
   while (getline(kallsyms, line))
     {
@@ -7945,8 +9268,8 @@ static void dump_kallsyms(unwindsym_dump_context *c)
       if (!start || addr == 0 || prev == addr)
         continue;
 
-      c->output << "  { 0x" << hex << addr - start << dec
-			<< ", " << lex_cast_qstring(name) << " },\n";
+      output << "  { 0x" << hex << addr - start << dec
+	     << ", " << lex_cast_qstring(name) << " },\n";
 
       size++;
       prev = addr;
@@ -7956,7 +9279,7 @@ static void dump_kallsyms(unwindsym_dump_context *c)
   if ((getuid() != 0) && (size == 0))
     c->session.print_warning (_F("No kallsyms found.  Your uid=%d.", getuid()));
 
-  c->output << "};\n";
+  end_unwindsym_table (c, shared, symbols);
   c->output << "static struct _stp_section _stp_module_" << stpmod_idx << "_sections[] = {\n";
   c->output << "{\n"
             << ".name = " << lex_cast_qstring(KERNEL_RELOC_SYMBOL) << ",\n"
@@ -8176,11 +9499,46 @@ prepare_symbol_data (systemtap_session& s)
   // NB: do this before the ctx.unwindsym_modules copy is taken
 }
 
+// Write out the shared symbols module source, named after a hash of
+// its contents, and the key that the script module's declarations of
+// its tables refer to.
+static void
+emit_shared_symbols (systemtap_session& s, const string& tables)
+{
+  ofstream key_out ((s.tmpdir + "/stap_symbols_key.h").c_str());
+  if (tables.empty()) // no kernel data found after all
+    return;
+
+  find_shared_symbols_hash (s, tables);
+  string key = s.shared_symbols_name.substr (strlen ("stap_symbols_"));
+  key_out << "#define STAP_SYMBOLS_KEY " << key << "\n";
+
+  ofstream shared_out (s.shared_symbols_source.c_str());
+  shared_out << "#include <linux/module.h>\n"
+    "#include <linux/kernel.h>\n"
+    "#include <sym.h>\n";
+  shared_out << "#define STAP_SYMBOLS_KEY " << key << "\n";
+  emit_shared_symbols_macros (shared_out);
+  shared_out << tables;
+  shared_out << "MODULE_DESCRIPTION(\"systemtap kernel symbol data\");\n";
+  shared_out << "MODULE_LICENSE(\"GPL\");\n";
+
+  if (s.verbose > 1)
+    clog << _F("Kernel symbol data goes into shared module %s",
+	       s.shared_symbols_name.c_str()) << endl;
+}
+
 void
 emit_symbol_data (systemtap_session& s)
 {
   ofstream kallsyms_out (s.symbols_source.c_str ());
 
+  // The kernel's tables can be shared among script modules; see
+  // begin_unwindsym_table.
+  ostringstream shared_out;
+  bool shared = (s.shared_symbols && !s.runtime_usermode_p ()
+		 && s.unwindsym_modules.count ("kernel"));
+
   if (s.runtime_usermode_p ())
     {
       kallsyms_out << "#include \"stap_common.h\"\n"
@@ -8192,6 +9550,11 @@ emit_symbol_data (systemtap_session& s)
         "#include <linux/kernel.h>\n"
         "#include <sym.h>\n"
         "#include \"stap_common.h\"\n";
+      if (shared)
+	{
+	  kallsyms_out << "#include \"stap_symbols_key.h\"\n";
+	  emit_shared_symbols_macros (kallsyms_out);
+	}
     }
 
   vector<pair<string,unsigned> > seclist;
@@ -8217,7 +9580,8 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* debug_line_len */
 				 NULL, /* debug_line_str */
 				 0, /* debug_line_str_len */
-				 s.unwindsym_modules };
+				 s.unwindsym_modules,
+				 shared ? &shared_out : NULL };
 
   // Micro optimization, mainly to speed up tiny regression tests
   // using just begin probe.
@@ -8286,6 +9650,9 @@ emit_symbol_data (systemtap_session& s)
     dump_kallsyms(&ctx);
 
   emit_symbol_data_done (&ctx, s);
+
+  if (shared)
+    emit_shared_symbols (s, shared_out.str());
 }
 
 void
@@ -8438,6 +9805,24 @@ prepare_translate_pass (systemtap_session& s)
 }
 
 
+// Count the lines of each unit, now that the translated source is out.
+static void
+report_build_lines (systemtap_session& s)
+{
+  if (s.report_build_path.empty())
+    return;
+  ifstream in (s.translated_source.c_str());
+  string source ((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  for (unsigned i=0; i<s.build_report_units.size(); i++)
+    {
+      systemtap_session::build_report_unit& u = s.build_report_units[i];
+      if (u.begin < 0 || u.end > (streamoff) source.size())
+        continue;
+      u.lines = count (source.begin() + u.begin, source.begin() + u.end, '\n');
+    }
+}
+
+
 int
 translate_pass (systemtap_session& s)
 {
@@ -8451,9 +9836,16 @@ translate_pass (systemtap_session& s)
   c_unparser cup (& s);
   s.up = & cup;
   translate_runtime(s);
+  pgo_profile pgo;
 
   try
     {
+      if (!s.pgo_use_path.empty())
+        {
+          pgo.load (s.pgo_use_path);
+          cup.pgo = &pgo;
+        }
+
       int64_t major=0, minor=0;
       try
 	{
@@ -8540,10 +9932,18 @@ translate_pass (systemtap_session& s)
 
       s.op->hdr->newline() << "#define STP_SKIP_BADVARS " << (s.skip_badvars ? 1 : 0);
 
+      cup.collect_striped_globals ();
+      cup.collect_atomic_globals ();
+      cup.collect_read_mostly_globals ();
+      if (!cup.read_mostly_globals.empty())
+        s.op->hdr->newline() << "#define STP_READ_MOSTLY 1";
+      if (!cup.striped_globals.empty())
+        s.op->hdr->newline() << "#define STP_LOCK_STRIPES " << s.lock_stripes;
+
       if (s.bulk_mode)
 	  s.op->hdr->newline() << "#define STP_BULKMODE";
 
-      if (s.timing || s.monitor)
+      if (s.timing || s.monitor || s.pgo_collect)
 	s.op->hdr->newline() << "#define STP_TIMING";
       if (!isatty(STDOUT_FILENO))
         {
@@ -8678,6 +10078,12 @@ translate_pass (systemtap_session& s)
         }
       s.op->assert_0_indent();
 
+      if (s.pgo_collect)
+        {
+          s.op->newline();
+          cup.emit_pgo_counters ();
+        }
+
       for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
 	{
           assert_no_interrupts();
@@ -8687,24 +10093,46 @@ translate_pass (systemtap_session& s)
       s.op->assert_0_indent();
 
 
+      // The script-level probe point, the source location and the
+      // derivation are the same for all the probes that a wildcard
+      // expands to.  Emit each distinct one once, and have the probes
+      // refer to it by index, which also saves a relocation per probe.
+      vector<string> probe_strings;
+      map<string, unsigned> probe_string_index;
+      vector<unsigned> pn_index, location_index, derivation_index;
+      auto probe_string = [&](const string& str) -> unsigned {
+        auto it = probe_string_index.insert (make_pair (str, probe_strings.size()));
+        if (it.second)
+          probe_strings.push_back (str);
+        return it.first->second;
+      };
+
       // Let's find some stats for the embedded pp strings.  Maybe they
       // are small and uniform enough to justify putting char[MAX]'s into
       // the array instead of relocated char*'s.
-      size_t pp_max = 0, pn_max = 0, location_max = 0, derivation_max = 0;
-      size_t pp_tot = 0, pn_tot = 0, location_tot = 0, derivation_tot = 0;
+      size_t pp_max = 0, pp_tot = 0;
       for (unsigned i=0; i<s.probes.size(); i++)
         {
           derived_probe* p = s.probes[i];
-#define DOIT(var,expr) do {                             \
-        size_t var##_size = (expr) + 1;                 \
-        var##_max = max (var##_max, var##_size);        \
-        var##_tot += var##_size; } while (0)
-          DOIT(pp, lex_cast_qstring(*p->sole_location()).size());
-          DOIT(pn, lex_cast_qstring(*p->script_location()).size());
-          DOIT(location, lex_cast_qstring(p->tok->location).size());
-          DOIT(derivation, lex_cast_qstring(p->derived_locations()).size());
-#undef DOIT
+          size_t pp_size = lex_cast_qstring(*p->sole_location()).size() + 1;
+          pp_max = max (pp_max, pp_size);
+          pp_tot += pp_size;
+          pn_index.push_back (probe_string (lex_cast_qstring (*p->script_location())));
+          location_index.push_back (probe_string (lex_cast_qstring (p->tok->location)));
+          derivation_index.push_back (probe_string (lex_cast_qstring (p->derived_locations())));
         }
+      if (s.verbose > 2)
+        clog << _F("%zu probe strings shared by %zu probes",
+                   probe_strings.size(), s.probes.size()) << endl;
+
+      s.op->newline();
+      s.op->newline() << "#if defined(STP_TIMING) || defined(STP_ALIBI) || defined(STP_NEED_PROBE_NAME)";
+      s.op->newline() << "static const char * const stap_probe_strings[] = {";
+      s.op->indent(1);
+      for (unsigned i=0; i<probe_strings.size(); i++)
+        s.op->newline() << probe_strings[i] << ",";
+      s.op->newline(-1) << "};";
+      s.op->newline() << "#endif";
 
       // Decide whether it's worthwhile to use char[] or char* by comparing
       // the amount of average waste (max - avg) to the relocation data size
@@ -8725,14 +10153,15 @@ translate_pass (systemtap_session& s)
             clog << "*" << endl;                                                \
         }
 
+      // NB: location, derivation and pn index stap_probe_strings[].
       s.op->newline();
       s.op->newline() << "struct stap_probe {";
       s.op->newline(1) << "const size_t index;";
       s.op->newline() << "void (* const ph) (struct context*);";
       s.op->newline() << "unsigned cond_enabled:1;"; // just one bit required
       s.op->newline() << "#if defined(STP_TIMING) || defined(STP_ALIBI)";
-      CALCIT(location);
-      CALCIT(derivation);
+      s.op->newline() << "const unsigned location;";
+      s.op->newline() << "const unsigned derivation;";
       s.op->newline() << "#define STAP_PROBE_INIT_TIMING(L, D) "
                       << ".location=(L), .derivation=(D),";
       s.op->newline() << "#else";
@@ -8740,7 +10169,7 @@ translate_pass (systemtap_session& s)
       s.op->newline() << "#endif";
       CALCIT(pp);
       s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
-      CALCIT(pn);
+      s.op->newline() << "const unsigned pn;";
       s.op->newline() << "#define STAP_PROBE_INIT_NAME(PN) .pn=(PN),";
       s.op->newline() << "#else";
       s.op->newline() << "#define STAP_PROBE_INIT_NAME(PN)";
@@ -8751,29 +10180,49 @@ translate_pass (systemtap_session& s)
                       << "STAP_PROBE_INIT_TIMING(L, D) "
                       << "}";
       s.op->newline(-1) << "};";
+      s.op->newline() << "#define stap_probe_string(I) (stap_probe_strings[(I)])";
       s.op->newline() << "static struct stap_probe stap_probes[];";
       s.op->assert_0_indent();
 #undef CALCIT
 
       // Run a varuse_collecting_visitor over probes that need global
       // variable locks.  We'll use this information later in
-      // emit_lock()/emit_unlock().
+      // emit_lock()/emit_unlock().  Also note which handlers are tiny,
+      // before the tapsets emit their entry functions.
       for (unsigned i=0; i<s.probes.size(); i++)
 	{
           assert_no_interrupts();
           s.probes[i]->session_index = i;
+          if (!s.runtime_usermode_p() && !s.unoptimized
+              && s.probes[i]->group != NULL)
+            {
+              tiny_probe_checker tpc;
+              s.probes[i]->tiny = tpc.check (s, s.probes[i]);
+              if (s.probes[i]->tiny && s.verbose > 1)
+                clog << _F("probe %s is tiny", s.probes[i]->name().c_str()) << endl;
+            }
           if (s.probes[i]->needs_global_locks())
 	    s.probes[i]->body->visit (&cup.vcv_needs_global_locks);
           // XXX: also visit s.probes[i]->sole_condition() ?
 	}
       s.op->assert_0_indent();
 
+      // With a profile, emit the hottest handlers first, next to each
+      // other, to share fewer i-cache lines with cold code.
+      vector<derived_probe*> handlers;
       for (unsigned i=0; i<s.probes.size(); i++)
+        if (s.probes[i]->group != NULL)  /* not 'never' probes */
+          handlers.push_back (s.probes[i]);
+      if (cup.pgo)
+        stable_sort (handlers.begin(), handlers.end(), pgo_hotter (pgo));
+
+      for (unsigned i=0; i<handlers.size(); i++)
         {
           assert_no_interrupts();
-          if (s.probes[i]->group == NULL)  /* 'never' probes */
-            continue;
-          s.up->emit_probe (s.probes[i]);
+          report_build_begin (s, "probe", lex_cast (*handlers[i]->sole_location()),
+                              handlers[i]->name());
+          s.up->emit_probe (handlers[i]);
+          report_build_end (s);
         }
       s.op->assert_0_indent();
 
@@ -8782,20 +10231,14 @@ translate_pass (systemtap_session& s)
       for (unsigned i=0; i<s.probes.size(); ++i)
         {
           derived_probe* p = s.probes[i];
+          s.op->newline() << "STAP_PROBE_INIT(" << i << ", ";
           if (p->group == NULL)  /* 'never' probes */
-            {
-              s.op->newline() << "STAP_PROBE_INIT(" << i << ", NULL, "
-                              << lex_cast_qstring (*p->sole_location()) << ", "
-                              << lex_cast_qstring (*p->script_location()) << ", "
-                              << lex_cast_qstring (p->tok->location) << ", "
-                              << lex_cast_qstring (p->derived_locations()) << "),";
-              continue;
-            }
-          s.op->newline() << "STAP_PROBE_INIT(" << i << ", &" << p->name() << ", "
-                          << lex_cast_qstring (*p->sole_location()) << ", "
-                          << lex_cast_qstring (*p->script_location()) << ", "
-                          << lex_cast_qstring (p->tok->location) << ", "
-                          << lex_cast_qstring (p->derived_locations()) << "),";
+            s.op->line() << "NULL, ";
+          else
+            s.op->line() << "&" << p->name() << ", ";
+          s.op->line() << lex_cast_qstring (*p->sole_location()) << ", "
+                       << pn_index[i] << ", " << location_index[i] << ", "
+                       << derivation_index[i] << "),";
         }
       s.op->newline(-1) << "};";
 
@@ -8813,7 +10256,17 @@ translate_pass (systemtap_session& s)
         {
           assert_no_interrupts();
           s.op->newline();
+          report_build_begin (s, "function", it->second->unmangled_name,
+                              cup.c_funcname (it->second->name));
           s.up->emit_function (it->second);
+          report_build_end (s);
+        }
+      s.op->assert_0_indent();
+
+      if (s.exporter_port && !s.runtime_usermode_p())
+        {
+          s.op->newline();
+          s.up->emit_exporter_snapshot ();
         }
 
       s.op->assert_0_indent();
@@ -8877,6 +10330,7 @@ translate_pass (systemtap_session& s)
   delete s.op;
   s.op = 0;
   s.up = 0;
+  report_build_lines (s);
 
  for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
    s.auxiliary_outputs[i]->close();
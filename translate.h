@@ -71,6 +71,9 @@ struct unparser
   virtual void emit_kernel_module_exit () = 0;
   // kernel module startup, shutdown
 
+  virtual void emit_exporter_snapshot () = 0;
+  // per-global dump functions behind the --exporter procfs file
+
   virtual void emit_module_init () = 0;
   virtual void emit_module_refresh () = 0;
   virtual void emit_module_exit () = 0;